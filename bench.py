@@ -145,3 +145,199 @@ def benchmark_np_chunker():
     print("Took %s seconds for NP chunking after POS tagging (%s token/sec)" %
         (np_time, int(ntokens / np_time)))
 
+
+def benchmark_packed():
+    '''
+    Compare tag_sents to tag_packed on the Penn Treebank sample in nltk
+    '''
+    import numpy as np
+    from nltk.corpus import treebank
+
+    text = [[ele[0] for ele in sentence if ele[1] != '-NONE-']
+        for sentence in treebank.tagged_sents()]
+
+    # pack the text as a tokenizer with offsets would
+    buffer = ' '.join(chain.from_iterable(text))
+    token_offsets = []
+    sentence_offsets = [0]
+    start = 0
+    for sentence in text:
+        for token in sentence:
+            token_offsets.append((start, start + len(token)))
+            start += len(token) + 1
+        sentence_offsets.append(len(token_offsets))
+    token_offsets = np.array(token_offsets, dtype=np.int64)
+    sentence_offsets = np.array(sentence_offsets, dtype=np.int64)
+    ntokens = len(token_offsets)
+
+    t1 = time.time()
+    tagger.tag_sents(text)
+    t2 = time.time()
+    tagger.tag_packed(buffer, token_offsets, sentence_offsets)
+    t3 = time.time()
+
+    print("tag_sents: %s tokens/sec" % int(ntokens / (t2 - t1)))
+    print("tag_packed: %s tokens/sec" % int(ntokens / (t3 - t2)))
+
+
+def benchmark_np_counts():
+    '''
+    Compare counting the noun phrases from chunk_sents in Python to
+    count_noun_phrases on the Penn Treebank sample in nltk
+    '''
+    from collections import defaultdict
+    from nltk.corpus import treebank
+
+    text = [[ele for ele in sentence if ele[1] != '-NONE-']
+        for sentence in treebank.tagged_sents()]
+    ntokens = sum(len(sentence) for sentence in text)
+
+    t1 = time.time()
+    counts = defaultdict(int)
+    for sentence in chunker.chunk_sents(text):
+        for phrase in sentence:
+            counts[' '.join(token for token, tag in phrase).lower()] += 1
+    t2 = time.time()
+    native_counts = chunker.count_noun_phrases(text, 'lower')
+    t3 = time.time()
+
+    assert native_counts == counts
+    print("chunk_sents + counting: %s tokens/sec" % int(ntokens / (t2 - t1)))
+    print("count_noun_phrases: %s tokens/sec" % int(ntokens / (t3 - t2)))
+
+
+def benchmark_process_pool(nprocesses=(1, 2, 4, 8), repeat=20):
+    '''
+    Throughput of tagging and chunking packed documents with ProcessPool
+    for each number of worker processes, on the Penn Treebank sample in
+    nltk split into documents of 20 sentences and repeated
+    '''
+    import numpy as np
+    from nltk.corpus import treebank
+    from mltk.process_pool import ProcessPool
+
+    text = [[ele[0] for ele in sentence if ele[1] != '-NONE-']
+        for sentence in treebank.tagged_sents()]
+
+    documents = []
+    for k in range(0, len(text), 20):
+        sentences = text[k:k + 20]
+        token_offsets = []
+        start = 0
+        for token in chain.from_iterable(sentences):
+            token_offsets.append((start, start + len(token)))
+            start += len(token) + 1
+        sentence_offsets = np.cumsum(
+            [0] + [len(sentence) for sentence in sentences])
+        documents.append((' '.join(chain.from_iterable(sentences)),
+            np.array(token_offsets, dtype=np.int64),
+            sentence_offsets.astype(np.int64)))
+    documents *= repeat
+    ntokens = sum(len(document[1]) for document in documents)
+
+    print("processes, tokens/sec, speedup")
+    baseline = None
+    for n in nprocesses:
+        with ProcessPool(tagger, chunker, nprocesses=n) as pool:
+            t1 = time.time()
+            for result in pool.map_packed(documents):
+                pass
+            t2 = time.time()
+        rate = ntokens / (t2 - t1)
+        baseline = baseline or rate
+        print("%s, %s, %.2f" % (n, int(rate), rate / baseline))
+
+
+def benchmark_early_exit(bound_scales=(1.0, 0.5, 0.25, 0.1, 0.05)):
+    '''
+    Accuracy and speed of early exit for the POS tagger on the Penn Treebank
+    sample and the NP chunker on the CoNLL-2000 test set in nltk.  The
+    accuracy is the fraction of tags/labels that match the gold data, and
+    the agreement the fraction that match exact prediction
+    '''
+    from nltk.corpus import treebank, conll2000
+
+    text = []
+    tags = []
+    for sentence in treebank.tagged_sents():
+        text.append([ele[0] for ele in sentence if ele[1] != '-NONE-'])
+        tags.extend([ele[1] for ele in sentence if ele[1] != '-NONE-'])
+
+    # the chunker gets POS tags from the exact tagger, as in
+    # benchmark_np_chunker
+    tokens = []
+    labels = []
+    for sentence in conll2000.iob_sents('test.txt'):
+        tokens.append([ele[0] for ele in sentence])
+        labels.extend(ele[2][0] if ele[2].endswith('-NP') else 'O'
+            for ele in sentence)
+    tagged = tagger.tag_sents(tokens)
+
+    def run(bound_scale):
+        early_tagger = FastPerceptronTagger()
+        early_chunker = NPChunker()
+        if bound_scale:
+            early_tagger.enable_early_exit(bound_scale)
+            early_chunker.enable_early_exit(bound_scale)
+
+        t1 = time.time()
+        predicted_tags = early_tagger.tag_arrays(text)[0]
+        t2 = time.time()
+        predicted_labels = early_chunker.chunk_arrays(tagged)[0]
+        t3 = time.time()
+        return predicted_tags, t2 - t1, predicted_labels, t3 - t2
+
+    names = tagger.tag_names()
+    exact_tags, _, exact_labels, _ = run(0.0)
+    print("bound_scale, tagger accuracy, agreement, tokens/sec, "
+        "chunker accuracy, agreement, tokens/sec")
+    for bound_scale in (0.0, ) + tuple(bound_scales):
+        predicted_tags, tag_time, predicted_labels, np_time = run(bound_scale)
+        tag_accuracy = sum(bool(names[p] == t)
+            for p, t in izip(predicted_tags, tags)) / float(len(tags))
+        np_accuracy = sum(bool(chr(p) == l)
+            for p, l in izip(predicted_labels, labels)) / float(len(labels))
+        print("%s, %.4f, %.4f, %s, %.4f, %.4f, %s" % (
+            bound_scale,
+            tag_accuracy, (predicted_tags == exact_tags).mean(),
+            int(len(tags) / tag_time),
+            np_accuracy, (predicted_labels == exact_labels).mean(),
+            int(len(labels) / np_time)))
+
+
+def benchmark_pruning(budgets=(20, 15, 10, 7, 5, 3, 2, 1)):
+    '''
+    Accuracy vs memory of the POS tagger pruned to each budget (in MB) on
+    the Penn Treebank sample in nltk, to pick the smallest model that is
+    accurate enough
+    '''
+    import os
+    import shutil
+    import tempfile
+    from nltk.corpus import treebank
+
+    text = []
+    tags = []
+    for sentence in treebank.tagged_sents():
+        text.append([ele[0] for ele in sentence if ele[1] != '-NONE-'])
+        tags.extend([ele[1] for ele in sentence if ele[1] != '-NONE-'])
+
+    def report(pruned_tagger, name):
+        memory = sum(template['bytes']
+            for template in pruned_tagger.memory_usage())
+        predicted = pruned_tagger.tag_sents(text)
+        ncorrect = sum(bool(t == p[1])
+            for t, p in izip(tags, chain.from_iterable(predicted)))
+        print("%s, %.1f, %.4f" % (
+            name, memory / 1048576.0, float(ncorrect) / len(tags)))
+
+    print("budget, memory (MB), accuracy")
+    report(tagger, 'full')
+    tmpdir = tempfile.mkdtemp()
+    try:
+        path = os.path.join(tmpdir, 'pruned.json.gz')
+        for budget in budgets:
+            tagger.export_model(path, max_bytes=budget * 1048576)
+            report(FastPerceptronTagger(model_path=path), budget)
+    finally:
+        shutil.rmtree(tmpdir)
@@ -0,0 +1,191 @@
+#ifndef _MLTK_BATCH_EXECUTOR_H_
+#define _MLTK_BATCH_EXECUTOR_H_
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <exception>
+#include <utility>
+
+#include "_model_handle.h"
+
+
+/**
+    Tags single sentences submitted from many threads (e.g. concurrent
+    web requests) in batches on background threads.
+
+    A service that tags one sentence per request pays the per call
+    overhead for every sentence.  The executor queues the submitted
+    sentences and a worker thread takes up to max_batch_size of them at
+    a time, waiting at most max_delay_us after the oldest one was
+    submitted for a batch to fill up.  So under load the batches are
+    full and when idle a request waits at most max_delay_us.
+
+    Each sentence's callback is called from the worker thread with the
+    result, or with an error message (and an empty result) if tagging
+    failed.  T is the model type, e.g. PerceptronTagger.  The model is
+    read through a ModelHandle so it can be replaced while in use.
+*/
+template <class T, class TIN, class TOUT>
+class BatchExecutor
+{
+    public:
+        typedef void (*callback_t)(void* context,
+            std::vector<TOUT>& result, const char* error);
+
+        BatchExecutor(ModelHandle<T> const & model,
+            std::size_t max_batch_size, std::size_t max_delay_us,
+            std::size_t nthreads);
+
+        /// tags any queued sentences then stops the worker threads
+        ~BatchExecutor();
+
+        /// queue a sentence.  callback(context, ...) is called when done.
+        /// The sentence is moved through to the worker, pass an rvalue to
+        /// avoid copying it
+        void submit(std::vector<TIN> sentence, callback_t callback,
+            void* context);
+
+    private:
+        struct request_t
+        {
+            std::vector<TIN> sentence;
+            callback_t callback;
+            void* context;
+            std::chrono::steady_clock::time_point submitted;
+        };
+
+        ModelHandle<T> const & model;
+        std::size_t max_batch_size;
+        std::chrono::microseconds max_delay;
+
+        bool stopping;
+        std::deque<request_t> queue;
+        std::mutex lock;
+        std::condition_variable work_available;
+        std::vector<std::thread> workers;
+
+        void work();
+
+        // disable some default constructors
+        BatchExecutor();
+        BatchExecutor& operator= (const BatchExecutor& other);
+        BatchExecutor(const BatchExecutor& other);
+};
+
+template <class T, class TIN, class TOUT>
+BatchExecutor<T, TIN, TOUT>::BatchExecutor(ModelHandle<T> const & model,
+    std::size_t max_batch_size, std::size_t max_delay_us,
+    std::size_t nthreads) :
+    model(model), max_batch_size(max_batch_size > 0 ? max_batch_size : 1),
+    max_delay(max_delay_us), stopping(false)
+{
+    if (nthreads == 0)
+        nthreads = 1;
+    for (std::size_t k = 0; k < nthreads; ++k)
+        workers.push_back(std::thread(&BatchExecutor::work, this));
+}
+
+template <class T, class TIN, class TOUT>
+BatchExecutor<T, TIN, TOUT>::~BatchExecutor()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    work_available.notify_all();
+    for (std::size_t k = 0; k < workers.size(); ++k)
+        workers[k].join();
+}
+
+template <class T, class TIN, class TOUT>
+void BatchExecutor<T, TIN, TOUT>::submit(std::vector<TIN> sentence,
+    callback_t callback, void* context)
+{
+    request_t request;
+    request.sentence = std::move(sentence);
+    request.callback = callback;
+    request.context = context;
+    request.submitted = std::chrono::steady_clock::now();
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(std::move(request));
+    }
+    work_available.notify_one();
+}
+
+template <class T, class TIN, class TOUT>
+void BatchExecutor<T, TIN, TOUT>::work()
+{
+    std::vector<request_t> batch;
+    std::vector<std::vector<TIN> > document;
+    std::vector<std::vector<TOUT> > results;
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while (queue.empty() && !stopping)
+                work_available.wait(guard);
+            if (queue.empty())
+                return;
+
+            // wait for the batch to fill up, or the oldest sentence's
+            // deadline
+            std::chrono::steady_clock::time_point deadline =
+                queue.front().submitted + max_delay;
+            while (!stopping && queue.size() < max_batch_size &&
+                    std::chrono::steady_clock::now() < deadline)
+                work_available.wait_until(guard, deadline);
+
+            // another worker may have taken the queue while we waited
+            if (queue.empty())
+                continue;
+
+            batch.clear();
+            while (!queue.empty() && batch.size() < max_batch_size)
+            {
+                batch.push_back(std::move(queue.front()));
+                queue.pop_front();
+            }
+        }
+
+        document.clear();
+        for (std::size_t k = 0; k < batch.size(); ++k)
+            document.push_back(std::move(batch[k].sentence));
+
+        bool failed = false;
+        std::string error;
+        try
+        {
+            typename ModelHandle<T>::Reader tagger(model);
+            tagger->tag_sentences(document, results);
+        }
+        catch (std::exception& e)
+        {
+            failed = true;
+            error = e.what();
+        }
+        catch (...)
+        {
+            failed = true;
+        }
+        if (failed)
+        {
+            if (error.empty())
+                error = "unknown error";
+            results.assign(batch.size(), std::vector<TOUT>());
+        }
+
+        for (std::size_t k = 0; k < batch.size(); ++k)
+            batch[k].callback(batch[k].context, results[k],
+                failed ? error.c_str() : NULL);
+    }
+}
+
+#endif // _MLTK_BATCH_EXECUTOR_H_
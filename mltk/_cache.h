@@ -0,0 +1,224 @@
+#ifndef _MLTK_CACHE_H_
+#define _MLTK_CACHE_H_
+
+#include <vector>
+#include <algorithm>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+
+
+/// eviction policies for the sentence cache
+enum cache_policy_t
+{
+    CACHE_LRU = 0,      ///< evict the least recently used sentence
+    CACHE_FIFO = 1      ///< evict the oldest inserted sentence
+};
+
+/// summary statistics for a sentence cache
+struct cache_info_t
+{
+    uint64_t hits;
+    uint64_t misses;
+    std::size_t size;
+    std::size_t capacity;
+};
+
+
+/**
+    A bounded, thread safe cache of tagged sentences.
+
+    Web pages repeat a lot of boilerplate (navigation, footers, etc) so
+    the same token sequences are tagged over and over.  The cache maps
+    a hash of the input sentence to the tagged output.  The input sentence
+    is stored along with the output and checked on lookup, so hash
+    collisions result in a cache miss, never a wrong answer.
+
+    To reduce lock contention the cache is split into a number of shards,
+    each with its own lock, eviction list and capacity.
+*/
+template <class TIN, class TOUT>
+class SentenceCache
+{
+    public:
+        SentenceCache(std::size_t capacity, cache_policy_t policy);
+        ~SentenceCache();
+
+        /// look up a sentence.  Returns true and fills result on a hit
+        bool lookup(uint64_t hash, std::vector<TIN> const & sentence,
+            std::vector<TOUT>& result);
+
+        /// add a sentence and its result, evicting if necessary.  Nothing
+        /// is added if the cache was cleared since epoch() returned epoch,
+        /// since the result may have been computed from the old model
+        void insert(uint64_t hash, std::vector<TIN> const & sentence,
+            std::vector<TOUT> const & result, uint64_t epoch);
+
+        /// remove all entries and reset the counters
+        void clear();
+
+        /// the number of clear() calls so far.  Read it before tagging a
+        /// sentence and pass it to insert
+        uint64_t epoch() const { return epochs.load(); }
+
+        cache_info_t info() const;
+
+    private:
+        struct entry_t
+        {
+            uint64_t hash;
+            std::vector<TIN> sentence;
+            std::vector<TOUT> result;
+        };
+        typedef std::list<entry_t> entry_list_t;
+        typedef std::unordered_map<uint64_t,
+            typename entry_list_t::iterator> entry_index_t;
+
+        struct shard_t
+        {
+            std::mutex lock;
+            // most recently used (or inserted) entries are at the front
+            entry_list_t entries;
+            entry_index_t index;
+            std::size_t capacity;
+        };
+
+        std::size_t capacity;
+        cache_policy_t policy;
+        std::size_t nshards;
+        std::unique_ptr<shard_t[]> shards;
+
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> misses;
+        std::atomic<uint64_t> epochs;
+
+        shard_t& get_shard(uint64_t hash)
+        {
+            // the low bits are used by the index, so use the high bits
+            return shards[(hash >> 48) % nshards];
+        }
+
+        // disable some default constructors
+        SentenceCache();
+        SentenceCache& operator= (const SentenceCache& other);
+        SentenceCache(const SentenceCache& other);
+};
+
+// the maximum number of shards in the cache
+#define MAX_CACHE_SHARDS 16
+
+template <class TIN, class TOUT>
+SentenceCache<TIN, TOUT>::SentenceCache(std::size_t capacity,
+    cache_policy_t policy) :
+    capacity(capacity), policy(policy),
+    nshards(std::max<std::size_t>(1,
+        std::min<std::size_t>(MAX_CACHE_SHARDS, capacity / 64))),
+    shards(new shard_t[nshards]), hits(0), misses(0), epochs(0)
+{
+    // spread the capacity over the shards so the total is exactly capacity
+    for (std::size_t k = 0; k < nshards; ++k)
+    {
+        shards[k].capacity = capacity / nshards + (k < capacity % nshards);
+        shards[k].index.reserve(shards[k].capacity);
+    }
+}
+
+template <class TIN, class TOUT>
+SentenceCache<TIN, TOUT>::~SentenceCache() {}
+
+template <class TIN, class TOUT>
+bool SentenceCache<TIN, TOUT>::lookup(uint64_t hash,
+    std::vector<TIN> const & sentence, std::vector<TOUT>& result)
+{
+    shard_t& shard = get_shard(hash);
+    {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        typename entry_index_t::iterator got = shard.index.find(hash);
+        if (got != shard.index.end() && got->second->sentence == sentence)
+        {
+            result = got->second->result;
+            // move to the front so it is evicted last
+            if (policy == CACHE_LRU)
+                shard.entries.splice(
+                    shard.entries.begin(), shard.entries, got->second);
+            ++hits;
+            return true;
+        }
+    }
+    ++misses;
+    return false;
+}
+
+template <class TIN, class TOUT>
+void SentenceCache<TIN, TOUT>::insert(uint64_t hash,
+    std::vector<TIN> const & sentence, std::vector<TOUT> const & result,
+    uint64_t epoch)
+{
+    shard_t& shard = get_shard(hash);
+    if (shard.capacity == 0)
+        return;
+
+    std::lock_guard<std::mutex> guard(shard.lock);
+
+    // clear() bumps the epoch before taking the shard locks, so either
+    // we see the new epoch here or the entry is removed by the clear
+    if (epochs.load() != epoch)
+        return;
+
+    // another thread may have inserted the sentence already or
+    // we have a hash collision.  In either case replace the entry
+    typename entry_index_t::iterator got = shard.index.find(hash);
+    if (got != shard.index.end())
+    {
+        shard.entries.erase(got->second);
+        shard.index.erase(got);
+    }
+    else if (shard.entries.size() >= shard.capacity)
+    {
+        // evict from the back
+        shard.index.erase(shard.entries.back().hash);
+        shard.entries.pop_back();
+    }
+
+    shard.entries.push_front(entry_t());
+    entry_t& entry = shard.entries.front();
+    entry.hash = hash;
+    entry.sentence = sentence;
+    entry.result = result;
+    shard.index[hash] = shard.entries.begin();
+}
+
+template <class TIN, class TOUT>
+void SentenceCache<TIN, TOUT>::clear()
+{
+    ++epochs;
+    for (std::size_t k = 0; k < nshards; ++k)
+    {
+        std::lock_guard<std::mutex> guard(shards[k].lock);
+        shards[k].entries.clear();
+        shards[k].index.clear();
+    }
+    hits = 0;
+    misses = 0;
+}
+
+template <class TIN, class TOUT>
+cache_info_t SentenceCache<TIN, TOUT>::info() const
+{
+    cache_info_t ret;
+    ret.hits = hits;
+    ret.misses = misses;
+    ret.capacity = capacity;
+    ret.size = 0;
+    for (std::size_t k = 0; k < nshards; ++k)
+    {
+        std::lock_guard<std::mutex> guard(shards[k].lock);
+        ret.size += shards[k].entries.size();
+    }
+    return ret;
+}
+
+#endif // _MLTK_CACHE_H_
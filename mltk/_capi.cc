@@ -0,0 +1,205 @@
+
+#include <string>
+#include <vector>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <exception>
+#include <cstring>
+#include <algorithm>
+
+#include "mltk.h"
+#include "_model_io.h"
+#include "_model_handle.h"
+
+
+const char* intern_tag(std::string const & tag)
+{
+    /** The tag strings returned by mltk_tagger_tag must stay valid even
+    if the model is reloaded, so they are kept in a process wide set
+    that is never freed.  There are only a few dozen distinct tags */
+    static std::mutex lock;
+    static std::set<std::string>* tags = new std::set<std::string>();
+    std::lock_guard<std::mutex> guard(lock);
+    return tags->insert(tag).first->c_str();
+}
+
+/// a tagger model plus the interned tag names for each tag id
+struct c_tagger_model_t
+{
+    std::unique_ptr<PerceptronTagger> tagger;
+    std::vector<const char*> tag_names;
+
+    c_tagger_model_t(PerceptronTagger* tagger) : tagger(tagger)
+    {
+        for (std::size_t k = 0; k < tagger->ntags(); ++k)
+            tag_names.push_back(intern_tag(tagger->tag_name(k)));
+    }
+};
+
+struct mltk_tagger
+{
+    std::unique_ptr<ModelHandle<c_tagger_model_t> > tagger;
+};
+
+struct mltk_chunker
+{
+    std::unique_ptr<ModelHandle<FastNPChunker> > chunker;
+};
+
+// the error message for the last failed call in each thread
+static thread_local std::string last_error;
+
+static int set_error(std::string const & msg)
+{
+    last_error = msg;
+    return -1;
+}
+
+const char* mltk_last_error(void)
+{
+    return last_error.c_str();
+}
+
+mltk_tagger* mltk_tagger_load(const char* path)
+{
+    if (path == NULL)
+    {
+        set_error("path is NULL");
+        return NULL;
+    }
+
+    try
+    {
+        std::unique_ptr<mltk_tagger> ret(new mltk_tagger());
+        ret->tagger.reset(new ModelHandle<c_tagger_model_t>(
+            new c_tagger_model_t(load_tagger(path))));
+        return ret.release();
+    }
+    catch (std::exception& e)
+    {
+        set_error(e.what());
+        return NULL;
+    }
+}
+
+void mltk_tagger_free(mltk_tagger* tagger)
+{
+    delete tagger;
+}
+
+int mltk_tagger_reload(mltk_tagger* tagger, const char* path)
+{
+    if (tagger == NULL || path == NULL)
+        return set_error("NULL argument");
+
+    try
+    {
+        tagger->tagger->swap(new c_tagger_model_t(load_tagger(path)));
+        return 0;
+    }
+    catch (std::exception& e)
+    {
+        return set_error(e.what());
+    }
+}
+
+int mltk_tagger_tag(const mltk_tagger* tagger, const char* const* tokens,
+    size_t ntokens, const char** tags)
+{
+    if (tagger == NULL || (ntokens > 0 && (tokens == NULL || tags == NULL)))
+        return set_error("NULL argument");
+
+    try
+    {
+        // reused so tagging doesn't allocate once they've grown
+        static thread_local std::vector<token_ref_t> sentence;
+        static thread_local std::vector<std::size_t> ids;
+        sentence.clear();
+        for (std::size_t k = 0; k < ntokens; ++k)
+            sentence.push_back(token_ref_t(tokens[k], std::strlen(tokens[k])));
+
+        ModelHandle<c_tagger_model_t>::Reader model(*tagger->tagger);
+        model->tagger->tag_ids(sentence, ids);
+        for (std::size_t k = 0; k < ntokens; ++k)
+            tags[k] = model->tag_names[ids[k]];
+        return 0;
+    }
+    catch (std::exception& e)
+    {
+        return set_error(e.what());
+    }
+}
+
+mltk_chunker* mltk_chunker_load(const char* path)
+{
+    if (path == NULL)
+    {
+        set_error("path is NULL");
+        return NULL;
+    }
+
+    try
+    {
+        std::unique_ptr<mltk_chunker> ret(new mltk_chunker());
+        ret->chunker.reset(
+            new ModelHandle<FastNPChunker>(load_chunker(path)));
+        return ret.release();
+    }
+    catch (std::exception& e)
+    {
+        set_error(e.what());
+        return NULL;
+    }
+}
+
+void mltk_chunker_free(mltk_chunker* chunker)
+{
+    delete chunker;
+}
+
+int mltk_chunker_reload(mltk_chunker* chunker, const char* path)
+{
+    if (chunker == NULL || path == NULL)
+        return set_error("NULL argument");
+
+    try
+    {
+        chunker->chunker->swap(load_chunker(path));
+        return 0;
+    }
+    catch (std::exception& e)
+    {
+        return set_error(e.what());
+    }
+}
+
+int mltk_chunker_chunk(const mltk_chunker* chunker,
+    const char* const* tokens, const char* const* tags, size_t ntokens,
+    char* labels)
+{
+    if (chunker == NULL ||
+            (ntokens > 0 && (tokens == NULL || tags == NULL || labels == NULL)))
+        return set_error("NULL argument");
+
+    try
+    {
+        static thread_local std::vector<std::pair<token_ref_t, token_ref_t> >
+            sentence;
+        static thread_local std::vector<char> iob;
+        sentence.clear();
+        for (std::size_t k = 0; k < ntokens; ++k)
+            sentence.push_back(std::make_pair(
+                token_ref_t(tokens[k], std::strlen(tokens[k])),
+                token_ref_t(tags[k], std::strlen(tags[k]))));
+
+        ModelHandle<FastNPChunker>::Reader model(*chunker->chunker);
+        model->tag_labels(sentence, iob);
+        std::copy(iob.begin(), iob.end(), labels);
+        return 0;
+    }
+    catch (std::exception& e)
+    {
+        return set_error(e.what());
+    }
+}
@@ -1,103 +1,61 @@
 
-#include <iostream>
 #include <unordered_map>
 #include <string>
 #include <map>
 #include <vector>
+#include <memory>
 #include <algorithm>
 #include <functional>
+#include <stdexcept>
 
-#include "_utils.cc"
+#include "_ctagger.h"
 
 
-/**
-perceptron tagger implemented as follows
-
-Want to predict C classes with F features and a bias
-Each feature value is a string, e.g. for the "word suffix" feature
-    the value is "ing", etc..
-
-features = N dim array
-each entry is hash map of word->C dimensional float
-
-For each feature value combination we have some class weights represented
-as a C dimensional float.
-
-Predict sums up the C dim arrays for each feature value
-*/
-
-/// features used to predict a given POS
-typedef std::vector<std::string> features_t;
-
-/// weights for individual classes for each feature
-typedef std::vector<float> class_weights_t;
-typedef class_weights_t bias_weights_t;
-
-/// the weights for one feature (word -> class weights)
-typedef std::unordered_map<std::string, class_weights_t,
-    std::function<unsigned long(const std::string&)> > one_weight_t;
-
-/// all weights for all features
-typedef std::vector<one_weight_t> weights_t;
-
-/// some words always have a defined tag
-typedef std::unordered_map<std::string, std::string,
-    std::function<unsigned long(const std::string&)> > tagmap_t;
-
-/// tags are tuples of (token, tag)
-typedef std::pair<std::string, std::string> tag_t;
-
-/** it's easier to pass things in as std::map from cython
- since it doesn't require dragging along the custom hash... */
-typedef std::vector<std::pair<std::string, float> > class_weights_in_t;
-typedef std::vector<std::map<std::string, class_weights_in_t> > weights_in_t;
-typedef std::map<std::string, std::string> tagmap_in_t;
-
-
-
-std::string last_n_letters(std::string const & s, int n)
+void last_n_letters(std::string const & s, std::size_t n,
+    std::string& out)
 {
     ///< get the last three letters (or less) of the string
     if (s.length() > n)
-        return s.substr(s.length() - n);
+        out.assign(s, s.length() - n, n);
     else
-        return s.substr(0);
+        out.assign(s);
 }
 
 
 void get_features(std::size_t k,
     std::string const & word,
-    std::vector<std::string>& context,
-    std::string& prev,
-    std::string& prev2,
+    std::vector<std::string> const & context,
+    std::string const & prev,
+    std::string const & prev2,
     features_t& features)
 {
     //< create some features for the given word
     std::size_t i = k + 2;
 
-    std::string suffix;
-
-    features.clear();
-
-    suffix = last_n_letters(word, 3);
-    features.push_back(suffix);
-    features.push_back(word.substr(0, 1));
-    features.push_back(prev);
-    features.push_back(prev2);
-    features.push_back(join(prev, prev2));
-    features.push_back(context[i]);
-    features.push_back(join(prev, context[i]));
-    features.push_back(context[i-1]);
-    suffix = last_n_letters(context[i-1], 3);
-    features.push_back(suffix);
-    features.push_back(context[i-2]);
-    features.push_back(context[i+1]);
-    suffix = last_n_letters(context[i+1], 3);
-    features.push_back(suffix);
-    features.push_back(context[i+2]);
+    features.resize(NFEATURES);
+
+    last_n_letters(word, 3, features[0]);
+    features[1].assign(word, 0, 1);
+    features[2].assign(prev);
+    features[3].assign(prev2);
+    join_into(prev, prev2, features[4]);
+    features[5].assign(context[i]);
+    join_into(prev, context[i], features[6]);
+    features[7].assign(context[i-1]);
+    last_n_letters(context[i-1], 3, features[8]);
+    features[9].assign(context[i-2]);
+    features[10].assign(context[i+1]);
+    last_n_letters(context[i+1], 3, features[11]);
+    features[12].assign(context[i+2]);
 }
 
 
+// the padding before and after each sentence
+const std::string START = "-START-";
+const std::string START2 = "-START2-";
+const std::string END = "-END-";
+const std::string END2 = "-END2-";
+
 // since the classes are fixed we'll predefine them here
 const std::string POS_TAGS[] =
 {
@@ -107,30 +65,24 @@ const std::string POS_TAGS[] =
     "TO", "UH", "VB", "VBD", "VBG", "VBN", "VBP", "VBZ", "WDT", "WP", "WP$",
     "WRB", "``"
 };
-const int NTAGS = sizeof(POS_TAGS) / sizeof(POS_TAGS[0]);
-const int NFEATURES = 13;
+static_assert(sizeof(POS_TAGS) / sizeof(POS_TAGS[0]) == NTAGS,
+    "NTAGS must be the number of POS_TAGS");
 
-class AveragedPerceptron
+const std::string FEATURE_NAMES[] =
 {
-    public:
-        AveragedPerceptron(weights_in_t weights,
-            class_weights_in_t bias_weights);
-        ~AveragedPerceptron();
-        std::string predict(features_t const & features);
-
-    private:
-        weights_t weights;
-        bias_weights_t bias_weights;
-
-        // disable some default constructors
-        AveragedPerceptron();
-        AveragedPerceptron& operator= (const AveragedPerceptron& other);
-        AveragedPerceptron(const AveragedPerceptron& other);
+    "suffix", "first letter", "prev tag", "prev2 tag", "prev tags",
+    "word", "prev tag+word", "prev word", "prev word suffix", "prev2 word",
+    "next word", "next word suffix", "next2 word"
 };
 
+// the hash tables for the weights are kept sparse to avoid collisions
+const float WEIGHTS_MAX_LOAD_FACTOR = 0.1;
+
 AveragedPerceptron::AveragedPerceptron(
-    weights_in_t weights, class_weights_in_t bias_weights) :
-    weights(), bias_weights(NTAGS, 0.0)
+    weights_in_t weights, class_weights_in_t bias_weights,
+    huge_page_mode_t huge_pages) :
+    arena(new PageArena(huge_pages)), weights(), bias_weights(NTAGS, 0.0),
+    bounds(NFEATURES, 0.0)
 {
     // a mapping from class name to index
     std::map<std::string, std::size_t> class_map;
@@ -144,11 +96,16 @@ AveragedPerceptron::AveragedPerceptron(
         it != bias_weights.end(); ++it)
         this->bias_weights[class_map[it->first]] = it->second;
 
-    // now the weight vectors
+    // now the weight vectors.  The tables are sized up front since the
+    // arena doesn't reuse the buckets freed by a rehash
+    ArenaAllocator<float> allocator(arena.get());
+    this->weights.reserve(weights.size());
     for (weights_in_t::iterator it = weights.begin(); it != weights.end(); ++it)
     {
-        one_weight_t one_weight(100, murmurhash3);
-        one_weight.max_load_factor(0.1);   // to avoid collisons
+        one_weight_t one_weight(0, murmurhash3, std::equal_to<std::string>(),
+            allocator);
+        one_weight.max_load_factor(WEIGHTS_MAX_LOAD_FACTOR);
+        one_weight.reserve(it->size());
 
         // it iterates over a map->vector(pair)
         std::map<std::string, class_weights_in_t>::iterator itw;
@@ -156,132 +113,396 @@ AveragedPerceptron::AveragedPerceptron(
         {
             // itw->first = the word
             // itw->second is vector of pair we'll turn to dense array
-            class_weights_t feature_vec(NTAGS, 0.0);
+            float* feature_vec = allocator.allocate(NTAGS);
+            std::fill(feature_vec, feature_vec + NTAGS, 0.0);
             for (class_weights_in_t::iterator itc = itw->second.begin();
                     itc != itw->second.end(); ++itc)
                 feature_vec[class_map[itc->first]] = itc->second;
             one_weight[itw->first] = feature_vec;
         }
-        this->weights.push_back(one_weight);
+        this->weights.push_back(std::move(one_weight));
+    }
+
+    // the bounds for early exit: the most any feature in each template
+    // can change the difference between two class scores
+    for (std::size_t k = 0; k < this->weights.size(); ++k)
+    {
+        for (one_weight_t::const_iterator it = this->weights[k].begin();
+            it != this->weights[k].end(); ++it)
+        {
+            float range = *std::max_element(it->second,
+                it->second + NTAGS) - *std::min_element(it->second,
+                it->second + NTAGS);
+            bounds[k] = std::max(bounds[k], range);
+        }
     }
 }
 
 AveragedPerceptron::~AveragedPerceptron() {}
 
-std::string AveragedPerceptron::predict(features_t const & features)
+namespace
 {
-    // make a prediction - add all the class scores from the features/weights
-    // and return the max
 
-    // initialize to the bias weights
-    std::vector<float> scores(bias_weights);
+/// the heap bytes used by a string's characters, 0 if they fit in
+/// the string itself (the short string optimization)
+std::size_t string_bytes(std::string const & s)
+{
+    return s.capacity() + 1 > sizeof(std::string) ? s.capacity() + 1 : 0;
+}
+
+/// a hash table node: the next pointer, the (key, weights) pair and
+/// the cached hash, plus the key's characters and the class weights
+std::size_t node_bytes(std::string const & feature)
+{
+    return sizeof(void*) +
+        sizeof(std::pair<const std::string, const float*>) +
+        sizeof(std::size_t) + string_bytes(feature) + NTAGS * sizeof(float);
+}
+
+}
+
+std::size_t weight_entry_bytes(std::string const & feature)
+{
+    // the tables are sized for their entries at the max load factor
+    return node_bytes(feature) + sizeof(void*) / WEIGHTS_MAX_LOAD_FACTOR;
+}
+
+std::size_t prune_weights(weights_in_t& weights, std::size_t max_bytes)
+{
+    // (range, template, feature) for each feature value.  std::map
+    // iterates in order, so ties are broken the same way every time
+    typedef std::pair<float, std::pair<std::size_t, std::string> > ranked_t;
+    std::vector<ranked_t> ranked;
+    for (std::size_t k = 0; k < weights.size(); ++k)
+    {
+        std::map<std::string, class_weights_in_t>::const_iterator it;
+        for (it = weights[k].begin(); it != weights[k].end(); ++it)
+        {
+            float max_weight = 0.0;
+            float min_weight = 0.0;
+            for (std::size_t i = 0; i < it->second.size(); ++i)
+            {
+                max_weight = std::max(max_weight, it->second[i].second);
+                min_weight = std::min(min_weight, it->second[i].second);
+            }
+            ranked.push_back(std::make_pair(max_weight - min_weight,
+                std::make_pair(k, it->first)));
+        }
+    }
+    std::stable_sort(ranked.begin(), ranked.end(),
+        [](ranked_t const & a, ranked_t const & b)
+        { return a.first > b.first; });
+
+    // keep the most important ones that fit
+    std::size_t bytes = 0;
+    std::size_t nkeep = 0;
+    for (; nkeep < ranked.size(); ++nkeep)
+    {
+        std::size_t entry = weight_entry_bytes(ranked[nkeep].second.second);
+        if (bytes + entry > max_bytes)
+            break;
+        bytes += entry;
+    }
+    for (std::size_t j = nkeep; j < ranked.size(); ++j)
+        weights[ranked[j].second.first].erase(ranked[j].second.second);
+
+    return bytes;
+}
+
+void AveragedPerceptron::memory_usage(
+    std::vector<feature_memory_t>& usage) const
+{
+    usage.clear();
+    for (std::size_t k = 0; k < weights.size(); ++k)
+    {
+        feature_memory_t memory;
+        memory.name = FEATURE_NAMES[k];
+        memory.entries = weights[k].size();
+        memory.bytes = weights[k].bucket_count() * sizeof(void*);
+        for (one_weight_t::const_iterator it = weights[k].begin();
+            it != weights[k].end(); ++it)
+            memory.bytes += node_bytes(it->first);
+        memory.load_factor = weights[k].load_factor();
+        usage.push_back(memory);
+    }
+}
+
+void AveragedPerceptron::get_weights(weights_in_t& weights,
+    class_weights_in_t& bias_weights, perceptron_delta_t const * delta) const
+{
+    // the input format only has the non zero weights
+    weights.assign(NFEATURES, std::map<std::string, class_weights_in_t>());
+    bias_weights.clear();
 
-    // now read through the features
-    one_weight_t::const_iterator got;
     for (std::size_t k = 0; k < NFEATURES; ++k)
     {
-        std::string feature = features[k];
-        got = weights[k].find(feature);
-        if (got != weights[k].end())
+        // the words in the weights and/or the delta
+        std::map<std::string, class_weights_t> merged;
+        for (one_weight_t::const_iterator it = this->weights[k].begin();
+            it != this->weights[k].end(); ++it)
+            merged[it->first].assign(it->second, it->second + NTAGS);
+        if (delta)
         {
-            // this feature exists.  update the scores
+            std::unordered_map<std::string, class_weights_t>::const_iterator
+                it;
+            for (it = delta->weights[k].begin();
+                it != delta->weights[k].end(); ++it)
+            {
+                class_weights_t& feature_vec = merged[it->first];
+                feature_vec.resize(NTAGS, 0.0);
+                for (std::size_t i = 0; i < NTAGS; ++i)
+                    feature_vec[i] += it->second[i];
+            }
+        }
+
+        std::map<std::string, class_weights_t>::const_iterator it;
+        for (it = merged.begin(); it != merged.end(); ++it)
+        {
+            class_weights_in_t class_weights;
             for (std::size_t i = 0; i < NTAGS; ++i)
-                scores[i] += got->second[i];
+            {
+                if (it->second[i] != 0.0)
+                    class_weights.push_back(
+                        std::make_pair(POS_TAGS[i], it->second[i]));
+            }
+            if (!class_weights.empty())
+                weights[k][it->first] = class_weights;
         }
     }
 
-    // now find the maximum class associated with the scores
-    float max_score = -1.0e20;
-    std::string chosen_class;
     for (std::size_t i = 0; i < NTAGS; ++i)
     {
-        if (scores[i] > max_score)
-        {
-            max_score = scores[i];
-            chosen_class = POS_TAGS[i];
-        }
+        float weight = this->bias_weights[i] +
+            (delta ? delta->bias_weights[i] : 0.0);
+        if (weight != 0.0)
+            bias_weights.push_back(std::make_pair(POS_TAGS[i], weight));
     }
+}
 
-    return chosen_class;
+
+perceptron_delta_t::perceptron_delta_t() :
+    weights(NFEATURES), bias_weights(NTAGS, 0.0)
+{
 }
 
-class PerceptronTagger : public TaggerBase<std::string, tag_t>
+void perceptron_delta_t::add_bias(float* scores) const
 {
-    public:
-        PerceptronTagger(weights_in_t weights, class_weights_in_t bias_weights,
-            tagmap_in_t specified_tags);
-        ~PerceptronTagger();
+    for (std::size_t i = 0; i < NTAGS; ++i)
+        scores[i] += bias_weights[i];
+}
 
-        /// tags a single sentence
-        std::vector<tag_t> tag_sentence(
-            std::vector<std::string> const & sentence);
+void perceptron_delta_t::add_weights(std::size_t k,
+    std::string const & feature, float* scores) const
+{
+    std::unordered_map<std::string, class_weights_t>::const_iterator got =
+        weights[k].find(feature);
+    if (got != weights[k].end())
+    {
+        for (std::size_t i = 0; i < NTAGS; ++i)
+            scores[i] += got->second[i];
+    }
+}
 
-    private:
-        tagmap_t specified_tags;
-        AveragedPerceptron model;
+void perceptron_delta_t::update(features_t const & features,
+    std::size_t truth, std::size_t guess)
+{
+    bias_weights[truth] += 1.0;
+    bias_weights[guess] -= 1.0;
+    for (std::size_t k = 0; k < NFEATURES; ++k)
+    {
+        class_weights_t& feature_vec = weights[k][features[k]];
+        feature_vec.resize(NTAGS, 0.0);
+        feature_vec[truth] += 1.0;
+        feature_vec[guess] -= 1.0;
+    }
+}
 
-        // disable some default constructors
-        PerceptronTagger();
-        PerceptronTagger& operator= (const PerceptronTagger& other);
-        PerceptronTagger(const PerceptronTagger& other);
+bool perceptron_delta_t::empty() const
+{
+    for (std::size_t k = 0; k < weights.size(); ++k)
+    {
+        if (!weights[k].empty())
+            return false;
+    }
+    return true;
+}
 
-};
+PosTaggerSpec::PosTaggerSpec(
+    weights_in_t weights, class_weights_in_t bias_weights,
+    tagmap_in_t specified_tags, huge_page_mode_t huge_pages) :
+    tag_names(POS_TAGS, POS_TAGS + NTAGS),
+    specified_tags(20000, murmurhash3),
+    weights(std::move(weights), std::move(bias_weights), huge_pages)
+{
+    // the tag ids for the model classes are their index in POS_TAGS.
+    // Some specified tags aren't model classes so give them new ids
+    std::map<std::string, std::size_t> tag_ids;
+    for (std::size_t k = 0; k < tag_names.size(); ++k)
+        tag_ids[tag_names[k]] = k;
+
+    for (tagmap_in_t::const_iterator it = specified_tags.begin();
+        it != specified_tags.end(); ++it)
+    {
+        std::map<std::string, std::size_t>::iterator got =
+            tag_ids.find(it->second);
+        if (got == tag_ids.end())
+        {
+            got = tag_ids.insert(
+                std::make_pair(it->second, tag_names.size())).first;
+            tag_names.push_back(it->second);
+        }
+        this->specified_tags[it->first] = got->second;
+    }
+}
 
 PerceptronTagger::PerceptronTagger(
     weights_in_t weights, class_weights_in_t bias_weights,
-    tagmap_in_t specified_tags) :
-    specified_tags(20000, murmurhash3), model(weights, bias_weights)
+    tagmap_in_t specified_tags, huge_page_mode_t huge_pages) :
+    model(std::make_shared<PosTaggerSpec>(std::move(weights),
+        std::move(bias_weights), std::move(specified_tags), huge_pages))
 {
-    this->specified_tags.insert(specified_tags.begin(), specified_tags.end());
 }
 
+PerceptronTagger::PerceptronTagger(model_t model) : model(model) {}
+
+PerceptronTagger::PerceptronTagger(pending_model_t model) : model(model) {}
+
 PerceptronTagger::~PerceptronTagger() {}
 
+PerceptronTagger::model_t PerceptronTagger::shared_model() const
+{
+    return model.shared_spec();
+}
+
+bool PerceptronTagger::model_loaded() const
+{
+    return model.loaded();
+}
+
+bool PerceptronTagger::wait_for_model() const
+{
+    return model.wait();
+}
+
+std::size_t PerceptronTagger::ntags() const
+{
+    return model.spec().tag_names.size();
+}
+
+std::string const & PerceptronTagger::tag_name(std::size_t id) const
+{
+    return model.spec().tag_names[id];
+}
+
 std::vector<tag_t> PerceptronTagger::tag_sentence(
-    std::vector<std::string> const & sentence)
+    std::vector<std::string> const & sentence) const
 {
-    // tag a single sentence
+    // tag a single sentence.  Only the returned tags are allocated
+    static thread_local std::vector<std::size_t> ids;
+    tag_ids(sentence, ids);
+
     std::vector<tag_t> tags;
+    tags.reserve(sentence.size());
+    for (std::size_t i = 0; i < sentence.size(); ++i)
+        tags.push_back(std::make_pair(sentence[i], tag_name(ids[i])));
 
-    // make the context for each word
-    std::vector<std::string> context;
-    context.reserve(sentence.size() + 4);
-    context.push_back("-START-"); context.push_back("-START2-");
-    for (std::vector<std::string>::const_iterator it = sentence.begin();
-            it != sentence.end(); ++it)
-        context.push_back(normalize(*it));
-    context.push_back("-END-"); context.push_back("-END2-");
+    return tags;
+}
 
-    // now tag each word
-    std::string prev = "-START-";
-    std::string prev2 = "-START2-";
+void PerceptronTagger::tag_ids(std::vector<std::string> const & sentence,
+    std::vector<std::size_t>& ids) const
+{
+    ids.clear();
+    ids.reserve(sentence.size());
+    model.label(sentence, overlay.current().get(), ids);
+}
 
-    features_t features;
+void PerceptronTagger::tag_ids(std::vector<token_ref_t> const & sentence,
+    std::vector<std::size_t>& ids) const
+{
+    ids.clear();
+    ids.reserve(sentence.size());
+    model.label(sentence, overlay.current().get(), ids);
+}
 
-    for (std::size_t i=0; i < sentence.size(); ++i)
+void PerceptronTagger::tag_packed(packed_document_t const & document,
+    std::vector<std::size_t>& ids) const
+{
+    ids.clear();
+    ids.reserve(document.ntokens);
+
+    std::shared_ptr<const perceptron_delta_t> delta = overlay.current();
+    static thread_local std::vector<token_ref_t> tokens;
+    for (std::size_t j = 0; j < document.nsentences; ++j)
     {
-        std::string tag;
-        std::string const & word = sentence[i];
+        tokens.clear();
+        for (int64_t k = document.sentence_offsets[j];
+                k < document.sentence_offsets[j + 1]; ++k)
+            tokens.push_back(document.token(k));
+        model.label(tokens, delta.get(), ids);
+    }
+}
 
-        // check if the word is in the set of specified tags
-        tagmap_t::const_iterator got = specified_tags.find(word);
-        if (got != specified_tags.end())
-        {
-            tag = got->second;
-        }
-        else
-        {
-            // we'll make some features and run the model to predict
-            // the results
-            get_features(i, word, context, prev, prev2, features);
-            tag = model.predict(features);
-        }
-        tags.push_back(std::make_pair(word, tag));
+std::size_t PerceptronTagger::update(std::vector<std::string> const & sentence,
+    std::vector<std::string> const & gold_tags)
+{
+    if (gold_tags.size() != sentence.size())
+        throw std::invalid_argument(
+            "The sentence and gold tags have different lengths");
 
-        prev2 = prev;
-        prev = tag;
+    std::vector<std::size_t> gold;
+    for (std::size_t i = 0; i < gold_tags.size(); ++i)
+    {
+        std::size_t tag = std::find(POS_TAGS, POS_TAGS + NTAGS, gold_tags[i])
+            - POS_TAGS;
+        if (tag == NTAGS &&
+                model.spec().specified_tags.count(sentence[i]) == 0)
+            throw std::invalid_argument("Unknown tag " + gold_tags[i]);
+        gold.push_back(tag);
     }
 
-    return tags;
+    std::lock_guard<std::mutex> guard(overlay.writer_lock());
+    return model.learn(sentence, gold, overlay.pending());
+}
+
+void PerceptronTagger::snapshot()
+{
+    {
+        std::lock_guard<std::mutex> guard(overlay.writer_lock());
+        overlay.publish();
+    }
+    clear_cache();
 }
 
+void PerceptronTagger::reset_updates()
+{
+    {
+        std::lock_guard<std::mutex> guard(overlay.writer_lock());
+        overlay.clear();
+    }
+    clear_cache();
+}
+
+void PerceptronTagger::set_early_exit(float bound_scale)
+{
+    model.set_early_exit(bound_scale);
+    clear_cache();
+}
+
+void PerceptronTagger::memory_usage(
+    std::vector<feature_memory_t>& usage) const
+{
+    model.spec().weights.memory_usage(usage);
+}
+
+void PerceptronTagger::get_weights(weights_in_t& weights,
+    class_weights_in_t& bias_weights, tagmap_in_t& specified_tags) const
+{
+    std::shared_ptr<const perceptron_delta_t> delta = overlay.current();
+    model.spec().weights.get_weights(weights, bias_weights, delta.get());
+
+    specified_tags.clear();
+    for (tagmap_t::const_iterator it = model.spec().specified_tags.begin();
+        it != model.spec().specified_tags.end(); ++it)
+        specified_tags[it->first] = tag_name(it->second);
+}
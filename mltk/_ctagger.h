@@ -0,0 +1,433 @@
+#ifndef _MLTK_CTAGGER_H_
+#define _MLTK_CTAGGER_H_
+
+#include <unordered_map>
+#include <string>
+#include <map>
+#include <vector>
+#include <functional>
+#include <atomic>
+
+#include "_utils.h"
+#include "_model_overlay.h"
+#include "_placement.h"
+#include "_sequence_model.h"
+
+
+/**
+perceptron tagger implemented as follows
+
+Want to predict C classes with F features and a bias
+Each feature value is a string, e.g. for the "word suffix" feature
+    the value is "ing", etc..
+
+features = N dim array
+each entry is hash map of word->C dimensional float
+
+For each feature value combination we have some class weights represented
+as a C dimensional float.
+
+Predict sums up the C dim arrays for each feature value
+*/
+
+/// features used to predict a given POS
+typedef std::vector<std::string> features_t;
+
+/// weights for individual classes for each feature
+typedef std::vector<float> class_weights_t;
+typedef class_weights_t bias_weights_t;
+
+/// the weights for one feature (word -> NTAGS class weights).  The
+/// nodes and the class weights are allocated next to each other in the
+/// AveragedPerceptron's arena
+typedef std::unordered_map<std::string, const float*,
+    std::function<unsigned long(const std::string&)>,
+    std::equal_to<std::string>,
+    ArenaAllocator<std::pair<const std::string, const float*> > >
+    one_weight_t;
+
+/// all weights for all features
+typedef std::vector<one_weight_t> weights_t;
+
+/// some words always have a defined tag (word -> tag id)
+typedef std::unordered_map<std::string, std::size_t,
+    std::function<unsigned long(const std::string&)> > tagmap_t;
+
+/// tags are tuples of (token, tag)
+typedef std::pair<std::string, std::string> tag_t;
+
+/** it's easier to pass things in as std::map from cython
+ since it doesn't require dragging along the custom hash... */
+typedef std::vector<std::pair<std::string, float> > class_weights_in_t;
+typedef std::vector<std::map<std::string, class_weights_in_t> > weights_in_t;
+typedef std::map<std::string, std::string> tagmap_in_t;
+
+/// the model classes, in the order of the class indices
+extern const std::string POS_TAGS[];
+const int NTAGS = 45;
+
+/// the number of features returned by get_features
+const int NFEATURES = 13;
+
+/// the names of the feature templates, in the order of get_features
+extern const std::string FEATURE_NAMES[];
+
+/// the padding before and after each sentence in the context
+extern const std::string START;
+extern const std::string START2;
+extern const std::string END;
+extern const std::string END2;
+
+/**
+    The context for get_features: the normalized words of the sentence
+    (std::string or token_ref_t) padded with START, START2 and END, END2.
+    Shared by the tagger and the trainer so the features can't drift.
+
+    The strings in context are overwritten in place and context is never
+    shrunk, so one reused for every sentence stops allocating.  It can
+    have more entries than sentence.size() + 4, left from a longer
+    sentence
+*/
+template <class TOKEN>
+void get_context(std::vector<TOKEN> const & sentence,
+    std::vector<std::string>& context)
+{
+    if (context.size() < sentence.size() + 4)
+        context.resize(sentence.size() + 4);
+    context[0].assign(START); context[1].assign(START2);
+    for (std::size_t i = 0; i < sentence.size(); ++i)
+    {
+        assign_token(sentence[i], context[i + 2]);
+        normalize_into(context[i + 2], context[i + 2]);
+    }
+    context[sentence.size() + 2].assign(END);
+    context[sentence.size() + 3].assign(END2);
+}
+
+/// the features for the k'th word of a sentence given its context and
+/// the previous two tags.  Like get_context, the strings in features are
+/// overwritten in place
+void get_features(std::size_t k,
+    std::string const & word,
+    std::vector<std::string> const & context,
+    std::string const & prev,
+    std::string const & prev2,
+    features_t& features);
+
+
+/**
+    Changes to the AveragedPerceptron weights from online updates (see
+    PerceptronTagger::update), added to the weights when predicting.
+    Only features that were updated have weights
+*/
+struct perceptron_delta_t
+{
+    std::vector<std::unordered_map<std::string, class_weights_t> > weights;
+    class_weights_t bias_weights;
+
+    perceptron_delta_t();
+
+    /// add the bias weights to scores
+    void add_bias(float* scores) const;
+
+    /// add the weights of feature value of template k to scores, if any
+    void add_weights(std::size_t k, std::string const & feature,
+        float* scores) const;
+
+    /// the perceptron update for predicting guess instead of truth
+    void update(features_t const & features, std::size_t truth,
+        std::size_t guess);
+
+    bool empty() const;
+};
+
+/// the memory used by the weights for one feature template
+struct feature_memory_t
+{
+    std::string name;
+    /// the number of feature values with weights
+    std::size_t entries;
+    /// estimated heap bytes for the hash table, keys and weights,
+    /// not counting the allocator's own overhead
+    std::size_t bytes;
+    /// entries per hash bucket
+    float load_factor;
+};
+
+/// the estimated bytes memory_usage counts for one feature value,
+/// including its share of the hash buckets
+std::size_t weight_entry_bytes(std::string const & feature);
+
+/**
+    Prune the weights to an estimated max_bytes of memory once loaded by
+    removing the least important feature values, those whose class
+    weights have the smallest range (including the implied zero weights).
+    A feature value's range is the most it can change the difference
+    between two class scores, so the rarely seen values that training
+    left with small weights go first.  The bias weights are kept.
+    Returns the estimated bytes of the pruned weights
+*/
+std::size_t prune_weights(weights_in_t& weights, std::size_t max_bytes);
+
+/**
+    The tagger's weight store: a hash table from feature value to its
+    class weights for each feature template
+*/
+class AveragedPerceptron
+{
+    public:
+        /// huge_pages is how the memory for the weights is backed
+        AveragedPerceptron(weights_in_t weights,
+            class_weights_in_t bias_weights,
+            huge_page_mode_t huge_pages = HUGE_PAGES_OFF);
+        ~AveragedPerceptron();
+
+        /// set scores to the bias weights
+        void bias(float* scores) const
+        {
+            std::copy(bias_weights.begin(), bias_weights.end(), scores);
+        }
+
+        /// add the class weights of feature value of template k, if any
+        void add_weights(std::size_t k, std::string const & feature,
+            float* scores) const
+        {
+            one_weight_t::const_iterator got = weights[k].find(feature);
+            if (got != weights[k].end())
+            {
+                for (std::size_t i = 0; i < NTAGS; ++i)
+                    scores[i] += got->second[i];
+            }
+        }
+
+        /// the largest range of class weights of any feature value of
+        /// template k
+        float bound(std::size_t k) const { return bounds[k]; }
+
+        /// the weights (plus delta if not NULL) in the input format
+        void get_weights(weights_in_t& weights,
+            class_weights_in_t& bias_weights,
+            perceptron_delta_t const * delta = NULL) const;
+
+        /// the memory used by each feature template's weights
+        void memory_usage(std::vector<feature_memory_t>& usage) const;
+
+    private:
+        // the memory for weights, so it's declared first
+        std::unique_ptr<PageArena> arena;
+        weights_t weights;
+        bias_weights_t bias_weights;
+        std::vector<float> bounds;
+
+        // disable some default constructors
+        AveragedPerceptron();
+        AveragedPerceptron& operator= (const AveragedPerceptron& other);
+        AveragedPerceptron(const AveragedPerceptron& other);
+};
+
+/**
+    The POS tagger as a LinearSequenceModel: the features of get_features,
+    the AveragedPerceptron weights and the specified tags as fixed labels.
+    Any tag can follow any other.
+
+    Labels are tag ids (see PerceptronTagger::tag_name), and the history
+    before the first word is START_ID and START2_ID
+*/
+class PosTaggerSpec
+{
+    public:
+        static const std::size_t NCLASSES = NTAGS;
+        static const std::size_t NFEATURES = ::NFEATURES;
+        static const std::size_t EARLY_EXIT_INTERVAL = 3;
+        static const std::size_t START_ID = std::size_t(-1);
+        static const std::size_t START2_ID = std::size_t(-2);
+
+        typedef ::features_t features_t;
+        typedef std::vector<std::string> context_t;
+        typedef perceptron_delta_t delta_t;
+        typedef no_constraint_t<NTAGS> constraint_t;
+        typedef std::size_t label_t;
+
+        PosTaggerSpec(weights_in_t weights, class_weights_in_t bias_weights,
+            tagmap_in_t specified_tags, huge_page_mode_t huge_pages);
+
+        /// the model classes, followed by any extra tags that only appear
+        /// in the specified tags
+        std::vector<std::string> tag_names;
+        tagmap_t specified_tags;
+        AveragedPerceptron weights;
+
+        void start(std::size_t& prev, std::size_t& prev2) const
+        {
+            prev = START_ID;
+            prev2 = START2_ID;
+        }
+
+        template <class TOKEN>
+        void context(std::vector<TOKEN> const & sentence,
+            context_t& context) const
+        {
+            get_context(sentence, context);
+        }
+
+        template <class TOKEN>
+        std::string const & word(std::vector<TOKEN> const & sentence,
+            std::size_t i, std::string& buffer) const
+        {
+            return token_string(sentence[i], buffer);
+        }
+
+        bool fixed_label(std::string const & word, std::size_t& label) const
+        {
+            tagmap_t::const_iterator got = specified_tags.find(word);
+            if (got == specified_tags.end())
+                return false;
+            label = got->second;
+            return true;
+        }
+
+        void features(std::size_t i, std::string const & word,
+            context_t const & context, std::size_t prev, std::size_t prev2,
+            features_t& features) const
+        {
+            get_features(i, word, context, history(prev), history(prev2),
+                features);
+        }
+
+        void bias(float* scores) const { weights.bias(scores); }
+
+        void add_weights(std::size_t k, std::string const & feature,
+            float* scores) const
+        {
+            weights.add_weights(k, feature, scores);
+        }
+
+        float bound(std::size_t k) const { return weights.bound(k); }
+
+        std::size_t output(std::size_t label) const { return label; }
+
+    private:
+        /// the tag name for a tag id or START_ID, START2_ID
+        std::string const & history(std::size_t id) const
+        {
+            if (id < tag_names.size())
+                return tag_names[id];
+            return id == START_ID ? START : START2;
+        }
+
+        // disable some default constructors
+        PosTaggerSpec();
+        PosTaggerSpec& operator= (const PosTaggerSpec& other);
+        PosTaggerSpec(const PosTaggerSpec& other);
+};
+
+class PerceptronTagger : public TaggerBase<std::string, tag_t>
+{
+    public:
+        typedef LinearSequenceModel<PosTaggerSpec>::model_t model_t;
+        typedef LinearSequenceModel<PosTaggerSpec>::pending_model_t
+            pending_model_t;
+
+        PerceptronTagger(weights_in_t weights, class_weights_in_t bias_weights,
+            tagmap_in_t specified_tags,
+            huge_page_mode_t huge_pages = HUGE_PAGES_OFF);
+
+        /// a tagger for a model shared with other taggers, e.g. from
+        /// shared_tagger_model.  The cache, early exit setting and online
+        /// updates are still this tagger's own
+        explicit PerceptronTagger(model_t model);
+
+        /// a tagger for a model that may still be loading.  The methods
+        /// that use the model wait for it, and throw the load error if it
+        /// failed
+        explicit PerceptronTagger(pending_model_t model);
+
+        ~PerceptronTagger();
+
+        /// the model, to share it with another tagger
+        model_t shared_model() const;
+
+        /// true once the model has loaded
+        bool model_loaded() const;
+
+        /// wait for the model to load, returns false if it failed
+        bool wait_for_model() const;
+
+        /// tags a single sentence
+        std::vector<tag_t> tag_sentence(
+            std::vector<std::string> const & sentence) const;
+
+        /// tags a single sentence, returning the tag id for each token.
+        /// With ids reused from call to call, this doesn't allocate
+        /// once the thread's workspace has warmed up
+        void tag_ids(std::vector<std::string> const & sentence,
+            std::vector<std::size_t>& ids) const;
+
+        /// tag_ids for a sentence of tokens stored elsewhere
+        void tag_ids(std::vector<token_ref_t> const & sentence,
+            std::vector<std::size_t>& ids) const;
+
+        /// tags all the sentences in a packed document, returning the
+        /// tag id for each token.  The cache isn't used
+        void tag_packed(packed_document_t const & document,
+            std::vector<std::size_t>& ids) const;
+
+        /// the number of distinct tags the tagger can output.  The
+        /// model classes come first, followed by any extra tags that
+        /// only appear in the specified tags
+        std::size_t ntags() const;
+
+        /// the tag for a given tag id
+        std::string const & tag_name(std::size_t id) const;
+
+        /**
+            Online learning, e.g. to fix systematic mistakes on a new
+            domain without retraining.  Tags the sentence with the updates
+            so far and makes the usual perceptron update for each wrong
+            tag.  Returns the number of wrong tags.  The gold tags must be
+            model classes (in POS_TAGS).  Words with specified tags aren't
+            learned.
+
+            The updates are a delta on top of the model weights that
+            tagging doesn't use until snapshot() is called.  update() and
+            snapshot() can be called while other threads are tagging.
+            Throws std::invalid_argument for bad gold tags
+        */
+        std::size_t update(std::vector<std::string> const & sentence,
+            std::vector<std::string> const & gold_tags);
+
+        /// start tagging with all the updates so far.  Clears the cache
+        void snapshot();
+
+        /// discard all the updates and go back to the model weights
+        void reset_updates();
+
+        /// the model weights and the updates in the snapshot, in the
+        /// input format, e.g. to save the updated model
+        void get_weights(weights_in_t& weights,
+            class_weights_in_t& bias_weights,
+            tagmap_in_t& specified_tags) const;
+
+        /**
+            Approximate tagging, see LinearSequenceModel::set_early_exit.
+            A feature's bound is the largest range of class weights of
+            any feature value in its template, computed at load
+        */
+        void set_early_exit(float bound_scale);
+
+        /// the memory used by each feature template's weights, not
+        /// counting the online updates or the specified tags
+        void memory_usage(std::vector<feature_memory_t>& usage) const;
+
+    private:
+        LinearSequenceModel<PosTaggerSpec> model;
+        ModelOverlay<perceptron_delta_t> overlay;
+
+        // disable some default constructors
+        PerceptronTagger();
+        PerceptronTagger& operator= (const PerceptronTagger& other);
+        PerceptronTagger(const PerceptronTagger& other);
+
+};
+
+#endif // _MLTK_CTAGGER_H_
@@ -0,0 +1,133 @@
+#ifndef _MLTK_MODEL_HANDLE_H_
+#define _MLTK_MODEL_HANDLE_H_
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <cstddef>
+
+
+/**
+    A handle to a model that can be replaced while other threads are
+    using it, e.g. to deploy retrained weights in a long running server.
+
+    This is a simple form of RCU (read-copy-update).  Readers never take
+    a lock, they only increment and decrement one of two reader counts.
+    swap() publishes the new model so that new readers pick it up,
+    then waits until all the readers of the old model have finished
+    before deleting it.  Readers register with the count for the current
+    phase and swap() flips the phase before waiting on a count, so a
+    steady stream of new readers can't keep it waiting forever.
+
+    In C++ use the Reader guard:
+
+        ModelHandle<PerceptronTagger>::Reader tagger(handle);
+        tagger->tag_sentences(document, tags);
+
+    acquire() and release() are the same thing for Cython, which can't
+    use stack allocated guards.
+*/
+template <class T>
+class ModelHandle
+{
+    public:
+        /// takes ownership of model
+        explicit ModelHandle(T* model);
+        ~ModelHandle();
+
+        /// get the current model, it is valid until release(token)
+        T* acquire(unsigned int& token) const;
+        void release(unsigned int token) const;
+
+        /// replace the model, taking ownership of new_model.  Blocks until
+        /// all in-flight readers of the old model are finished with it
+        void swap(T* new_model);
+
+        class Reader
+        {
+            public:
+                explicit Reader(ModelHandle const & handle) :
+                    handle(handle), model(handle.acquire(token)) {}
+                ~Reader() { handle.release(token); }
+
+                T& operator*() const { return *model; }
+                T* operator->() const { return model; }
+
+            private:
+                ModelHandle const & handle;
+                unsigned int token;
+                T* model;
+
+                Reader(const Reader& other);
+                Reader& operator= (const Reader& other);
+        };
+
+    private:
+        std::atomic<T*> model;
+
+        // readers increment readers[phase] while using the model
+        std::atomic<unsigned int> phase;
+        mutable std::atomic<long> readers[2];
+
+        // only one swap at a time
+        std::mutex swap_lock;
+
+        // disable some default constructors
+        ModelHandle();
+        ModelHandle& operator= (const ModelHandle& other);
+        ModelHandle(const ModelHandle& other);
+};
+
+template <class T>
+ModelHandle<T>::ModelHandle(T* model) : model(model), phase(0)
+{
+    readers[0] = 0;
+    readers[1] = 0;
+}
+
+template <class T>
+ModelHandle<T>::~ModelHandle()
+{
+    delete model.load();
+}
+
+template <class T>
+T* ModelHandle<T>::acquire(unsigned int& token) const
+{
+    // register before loading the model, so that swap() either waits
+    // for us or we see the new model
+    token = phase.load();
+    ++readers[token];
+    return model.load();
+}
+
+template <class T>
+void ModelHandle<T>::release(unsigned int token) const
+{
+    --readers[token];
+}
+
+template <class T>
+void ModelHandle<T>::swap(T* new_model)
+{
+    std::lock_guard<std::mutex> guard(swap_lock);
+
+    T* old_model = model.exchange(new_model);
+
+    // wait for every reader that registered before the exchange, since
+    // they may have the old model.  A reader can register in either count
+    // (it may have read the phase just before a flip) so wait for both.
+    // The phase is flipped before waiting on each count so that new
+    // readers register in the other one
+    for (std::size_t k = 0; k < 2; ++k)
+    {
+        unsigned int old_phase = phase.load();
+        phase.store(1 - old_phase);
+        while (readers[old_phase].load() != 0)
+            std::this_thread::yield();
+    }
+
+    delete old_model;
+}
+
+#endif // _MLTK_MODEL_HANDLE_H_
@@ -0,0 +1,643 @@
+
+#include <string>
+#include <sstream>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include <ios>
+#include <memory>
+#include <tuple>
+#include <climits>
+#include <locale>
+#include <limits>
+
+#include <zlib.h>
+#include <sys/stat.h>
+
+#include "_model_io.h"
+
+
+std::string read_model_file(std::string const & path)
+{
+    /// read an entire file, decompressing it if it is gzipped
+    gzFile fin = gzopen(path.c_str(), "rb");
+    if (fin == NULL)
+        throw std::ios_base::failure("Unable to open model file " + path);
+
+    std::string ret;
+    char buffer[65536];
+    int nread;
+    while ((nread = gzread(fin, buffer, sizeof(buffer))) > 0)
+        ret.append(buffer, nread);
+    gzclose(fin);
+
+    if (nread < 0)
+        throw std::ios_base::failure("Error reading model file " + path);
+    return ret;
+}
+
+void write_model_file(std::string const & path, std::string const & text)
+{
+    // "T" writes without compression
+    bool gzipped = path.length() >= 3 &&
+        path.compare(path.length() - 3, 3, ".gz") == 0;
+    gzFile fout = gzopen(path.c_str(), gzipped ? "wb" : "wT");
+    if (fout == NULL)
+        throw std::runtime_error("Unable to open model file " + path);
+
+    std::size_t pos = 0;
+    while (pos < text.length())
+    {
+        unsigned int n = std::min<std::size_t>(text.length() - pos, 1 << 20);
+        if (gzwrite(fout, text.data() + pos, n) != int(n))
+        {
+            gzclose(fout);
+            throw std::runtime_error("Error writing model file " + path);
+        }
+        pos += n;
+    }
+    if (gzclose(fout) != Z_OK)
+        throw std::runtime_error("Error writing model file " + path);
+}
+
+std::string json_string(std::string const & s)
+{
+    /// the strings are utf-8 so only quotes, backslashes and control
+    /// characters need escaping
+    std::string ret;
+    ret.reserve(s.length() + 2);
+    ret.push_back('"');
+    for (std::size_t k = 0; k < s.length(); ++k)
+    {
+        unsigned char c = s[k];
+        if (c == '"' || c == '\\')
+        {
+            ret.push_back('\\');
+            ret.push_back(c);
+        }
+        else if (c < 0x20)
+        {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            ret.append(escaped);
+        }
+        else
+            ret.push_back(c);
+    }
+    ret.push_back('"');
+    return ret;
+}
+
+
+/**
+    A minimal pull style JSON reader.
+
+    The models are large (millions of values) so rather than building a
+    document tree, the loaders walk the expected structure directly
+    and skip anything they don't recognize.  Iterate over the members of
+    an object or the elements of an array with:
+
+        reader.expect('{');
+        for (bool first = true; reader.next_item('}', first); )
+            ...
+*/
+class JsonReader
+{
+    public:
+        JsonReader(std::string const & text, std::string const & path) :
+            path(path), begin(text.c_str()), pos(text.c_str()),
+            end(text.c_str() + text.length())
+        {
+            numbers.imbue(std::locale::classic());
+        }
+
+        /// consume the next character, which must be c
+        void expect(char c)
+        {
+            skip_whitespace();
+            if (pos == end || *pos != c)
+                error(std::string("expected '") + c + "'");
+            ++pos;
+        }
+
+        /// true if there is another item before the closing character
+        bool next_item(char close, bool& first)
+        {
+            skip_whitespace();
+            if (pos != end && *pos == close)
+            {
+                ++pos;
+                return false;
+            }
+            if (!first)
+                expect(',');
+            first = false;
+            return true;
+        }
+
+        std::string read_string();
+        double read_number();
+        void skip_value();
+
+    private:
+        std::string path;
+        const char* begin;
+        const char* pos;
+        const char* end;
+        // parses numbers with '.' as the decimal point whatever the
+        // global locale is, which strtod doesn't
+        std::istringstream numbers;
+
+        void skip_whitespace()
+        {
+            while (pos != end &&
+                    (*pos == ' ' || *pos == '\n' || *pos == '\r' ||
+                    *pos == '\t'))
+                ++pos;
+        }
+
+        unsigned int read_hex4();
+        void skip_digits();
+        void append_utf8(unsigned int code_point, std::string& out);
+
+        void error(std::string const & msg)
+        {
+            std::ostringstream out;
+            out << "Invalid model file " << path << ": " << msg
+                << " at offset " << (pos - begin);
+            throw std::runtime_error(out.str());
+        }
+};
+
+unsigned int JsonReader::read_hex4()
+{
+    unsigned int ret = 0;
+    for (std::size_t k = 0; k < 4; ++k, ++pos)
+    {
+        if (pos == end)
+            error("truncated unicode escape");
+        char c = *pos;
+        ret <<= 4;
+        if (c >= '0' && c <= '9')
+            ret |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            ret |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            ret |= c - 'A' + 10;
+        else
+            error("invalid unicode escape");
+    }
+    return ret;
+}
+
+void JsonReader::append_utf8(unsigned int code_point, std::string& out)
+{
+    if (code_point < 0x80)
+        out.push_back(code_point);
+    else if (code_point < 0x800)
+    {
+        out.push_back(0xC0 | (code_point >> 6));
+        out.push_back(0x80 | (code_point & 0x3F));
+    }
+    else if (code_point < 0x10000)
+    {
+        out.push_back(0xE0 | (code_point >> 12));
+        out.push_back(0x80 | ((code_point >> 6) & 0x3F));
+        out.push_back(0x80 | (code_point & 0x3F));
+    }
+    else
+    {
+        out.push_back(0xF0 | (code_point >> 18));
+        out.push_back(0x80 | ((code_point >> 12) & 0x3F));
+        out.push_back(0x80 | ((code_point >> 6) & 0x3F));
+        out.push_back(0x80 | (code_point & 0x3F));
+    }
+}
+
+std::string JsonReader::read_string()
+{
+    // strings are returned as utf-8 encoded bytes, the same as the
+    // tokens passed to the tagger
+    expect('"');
+    std::string ret;
+    while (true)
+    {
+        const char* start = pos;
+        while (pos != end && *pos != '"' && *pos != '\\')
+            ++pos;
+        ret.append(start, pos);
+
+        if (pos == end)
+            error("unterminated string");
+        if (*pos++ == '"')
+            return ret;
+
+        // an escape sequence
+        if (pos == end)
+            error("unterminated string");
+        char c = *pos++;
+        switch (c)
+        {
+            case '"': case '\\': case '/': ret.push_back(c); break;
+            case 'b': ret.push_back('\b'); break;
+            case 'f': ret.push_back('\f'); break;
+            case 'n': ret.push_back('\n'); break;
+            case 'r': ret.push_back('\r'); break;
+            case 't': ret.push_back('\t'); break;
+            case 'u':
+            {
+                unsigned int code_point = read_hex4();
+                // characters outside the BMP are escaped as surrogate pairs
+                if (code_point >= 0xD800 && code_point < 0xDC00 &&
+                    end - pos >= 6 && pos[0] == '\\' && pos[1] == 'u')
+                {
+                    pos += 2;
+                    unsigned int low = read_hex4();
+                    if (low < 0xDC00 || low > 0xDFFF)
+                        error("invalid unicode surrogate pair");
+                    code_point = 0x10000 +
+                        ((code_point - 0xD800) << 10) + (low - 0xDC00);
+                }
+                append_utf8(code_point, ret);
+                break;
+            }
+            default:
+                error("invalid escape sequence");
+        }
+    }
+}
+
+void JsonReader::skip_digits()
+{
+    while (pos != end && *pos >= '0' && *pos <= '9')
+        ++pos;
+}
+
+double JsonReader::read_number()
+{
+    skip_whitespace();
+    // find the end of the number, then parse it
+    const char* start = pos;
+    if (pos != end && *pos == '-')
+        ++pos;
+    skip_digits();
+    if (pos != end && *pos == '.')
+    {
+        ++pos;
+        skip_digits();
+    }
+    if (pos != end && (*pos == 'e' || *pos == 'E'))
+    {
+        ++pos;
+        if (pos != end && (*pos == '+' || *pos == '-'))
+            ++pos;
+        skip_digits();
+    }
+
+    double ret = 0;
+    numbers.clear();
+    numbers.str(std::string(start, pos));
+    if (!(numbers >> ret) || numbers.rdbuf()->in_avail() > 0)
+    {
+        pos = start;
+        error("expected a number");
+    }
+    return ret;
+}
+
+void JsonReader::skip_value()
+{
+    skip_whitespace();
+    if (pos == end)
+        error("expected a value");
+
+    bool first = true;
+    switch (*pos)
+    {
+        case '"':
+            read_string();
+            break;
+        case '{':
+            expect('{');
+            while (next_item('}', first))
+            {
+                read_string();
+                expect(':');
+                skip_value();
+            }
+            break;
+        case '[':
+            expect('[');
+            while (next_item(']', first))
+                skip_value();
+            break;
+        case 't': case 'f': case 'n':
+            // true, false or null
+            while (pos != end && *pos >= 'a' && *pos <= 'z')
+                ++pos;
+            break;
+        default:
+            read_number();
+    }
+}
+
+
+void read_class_weights(JsonReader& reader, class_weights_in_t& weights)
+{
+    /// class weights are a list of [class, weight] pairs
+    reader.expect('[');
+    for (bool first = true; reader.next_item(']', first); )
+    {
+        reader.expect('[');
+        std::string label = reader.read_string();
+        reader.expect(',');
+        float weight = reader.read_number();
+        reader.expect(']');
+        weights.push_back(std::make_pair(label, weight));
+    }
+}
+
+void read_tagger_model(std::string const & path, weights_in_t& weights,
+    class_weights_in_t& bias_weights, tagmap_in_t& specified_tags)
+{
+    std::string text = read_model_file(path);
+    JsonReader reader(text, path);
+
+    weights.clear();
+    bias_weights.clear();
+    specified_tags.clear();
+
+    reader.expect('{');
+    for (bool first = true; reader.next_item('}', first); )
+    {
+        std::string key = reader.read_string();
+        reader.expect(':');
+        if (key == "weights")
+        {
+            // a list with one {word: class weights} object per feature
+            reader.expect('[');
+            for (bool first_feature = true;
+                reader.next_item(']', first_feature); )
+            {
+                weights.push_back(
+                    std::map<std::string, class_weights_in_t>());
+                reader.expect('{');
+                for (bool first_word = true;
+                    reader.next_item('}', first_word); )
+                {
+                    std::string word = reader.read_string();
+                    reader.expect(':');
+                    read_class_weights(reader, weights.back()[word]);
+                }
+            }
+        }
+        else if (key == "bias_weights")
+            read_class_weights(reader, bias_weights);
+        else if (key == "specified_tags")
+        {
+            reader.expect('{');
+            for (bool first_word = true; reader.next_item('}', first_word); )
+            {
+                std::string word = reader.read_string();
+                reader.expect(':');
+                specified_tags[word] = reader.read_string();
+            }
+        }
+        else
+            reader.skip_value();
+    }
+}
+
+void read_chunker_model(std::string const & path, np_weights_t& weights,
+    np_labelmap_in_t& labelmap)
+{
+    std::string text = read_model_file(path);
+    JsonReader reader(text, path);
+
+    weights.clear();
+    labelmap.clear();
+
+    reader.expect('{');
+    for (bool first = true; reader.next_item('}', first); )
+    {
+        std::string key = reader.read_string();
+        reader.expect(':');
+        if (key == "weights")
+        {
+            reader.expect('[');
+            for (bool first_weight = true;
+                reader.next_item(']', first_weight); )
+                weights.push_back(reader.read_number());
+        }
+        else if (key == "labelmap")
+        {
+            // labels are stored as one character strings, e.g. "I"
+            reader.expect('{');
+            for (bool first_word = true; reader.next_item('}', first_word); )
+            {
+                std::string word = reader.read_string();
+                reader.expect(':');
+                std::string label = reader.read_string();
+                if (label.length() != 1)
+                    throw std::runtime_error(
+                        "Invalid label " + label + " in " + path);
+                labelmap[word] = label[0];
+            }
+        }
+        else
+            reader.skip_value();
+    }
+
+    // the bias weights are stored after the feature weights
+    if (weights.size() != BIAS_INDEX + N_CLASSES)
+        throw std::runtime_error("Invalid number of weights in " + path);
+}
+
+PerceptronTagger* load_tagger(std::string const & path,
+    huge_page_mode_t huge_pages)
+{
+    weights_in_t weights;
+    class_weights_in_t bias_weights;
+    tagmap_in_t specified_tags;
+    read_tagger_model(path, weights, bias_weights, specified_tags);
+    return new PerceptronTagger(weights, bias_weights, specified_tags,
+        huge_pages);
+}
+
+FastNPChunker* load_chunker(std::string const & path,
+    huge_page_mode_t huge_pages)
+{
+    np_weights_t weights;
+    np_labelmap_in_t labelmap;
+    read_chunker_model(path, weights, labelmap);
+    return new FastNPChunker(weights, labelmap, huge_pages);
+}
+
+bool model_key_t::operator<(model_key_t const & other) const
+{
+    return std::tie(path, version, huge_pages) <
+        std::tie(other.path, other.version, other.huge_pages);
+}
+
+model_key_t model_key(std::string const & path, huge_page_mode_t huge_pages)
+{
+    model_key_t key;
+    key.huge_pages = huge_pages;
+
+    // a missing file keeps the path as given and an empty version, so
+    // loading it fails as usual
+    char canonical[PATH_MAX];
+    key.path = realpath(path.c_str(), canonical) ? canonical : path;
+    struct stat info;
+    if (stat(key.path.c_str(), &info) == 0)
+    {
+        std::ostringstream version;
+        version << info.st_dev << ":" << info.st_ino << ":" << info.st_size
+            << ":" << info.st_mtim.tv_sec << "." << info.st_mtim.tv_nsec;
+        key.version = version.str();
+    }
+    return key;
+}
+
+PerceptronTagger::pending_model_t shared_tagger_model(
+    std::string const & path, huge_page_mode_t huge_pages, model_load_t when)
+{
+    return tagger_registry_t::instance().get(model_key(path, huge_pages),
+        [path, huge_pages]() -> PerceptronTagger::model_t
+        {
+            weights_in_t weights;
+            class_weights_in_t bias_weights;
+            tagmap_in_t specified_tags;
+            read_tagger_model(path, weights, bias_weights, specified_tags);
+            return std::make_shared<PosTaggerSpec>(std::move(weights),
+                std::move(bias_weights), std::move(specified_tags),
+                huge_pages);
+        }, when);
+}
+
+FastNPChunker::pending_model_t shared_chunker_model(
+    std::string const & path, huge_page_mode_t huge_pages, model_load_t when)
+{
+    return chunker_registry_t::instance().get(model_key(path, huge_pages),
+        [path, huge_pages]() -> FastNPChunker::model_t
+        {
+            np_weights_t weights;
+            np_labelmap_in_t labelmap;
+            read_chunker_model(path, weights, labelmap);
+            return std::make_shared<NPChunkerSpec>(weights, labelmap,
+                huge_pages);
+        }, when);
+}
+
+
+namespace
+{
+
+/// a stream for a model file, writing numbers in the classic locale so
+/// they read back whatever the global locale is, and with enough digits
+/// that the weights read back exactly
+void init_model_stream(std::ostringstream& out)
+{
+    out.imbue(std::locale::classic());
+    out.precision(std::numeric_limits<float>::max_digits10);
+}
+
+void write_weight(std::ostringstream& out, float weight)
+{
+    if (weight == 0.0)
+        out << '0';
+    else
+        out << weight;
+}
+
+void write_class_weights(std::ostringstream& out,
+    class_weights_in_t const & weights)
+{
+    /// class weights are a list of [class, weight] pairs
+    out << "[";
+    for (std::size_t k = 0; k < weights.size(); ++k)
+    {
+        out << (k > 0 ? ", [" : "[") << json_string(weights[k].first)
+            << ", ";
+        write_weight(out, weights[k].second);
+        out << "]";
+    }
+    out << "]";
+}
+
+}
+
+void write_tagger_model(std::string const & path, weights_in_t const & weights,
+    class_weights_in_t const & bias_weights,
+    tagmap_in_t const & specified_tags)
+{
+    std::ostringstream out;
+    init_model_stream(out);
+    out << "{\"weights\": [";
+    for (std::size_t k = 0; k < weights.size(); ++k)
+    {
+        out << (k > 0 ? ", {" : "{");
+        std::map<std::string, class_weights_in_t>::const_iterator it;
+        for (it = weights[k].begin(); it != weights[k].end(); ++it)
+        {
+            out << (it != weights[k].begin() ? ", " : "")
+                << json_string(it->first) << ": ";
+            write_class_weights(out, it->second);
+        }
+        out << "}";
+    }
+    out << "], \"bias_weights\": ";
+    write_class_weights(out, bias_weights);
+    out << ", \"specified_tags\": {";
+    for (tagmap_in_t::const_iterator it = specified_tags.begin();
+        it != specified_tags.end(); ++it)
+    {
+        out << (it != specified_tags.begin() ? ", " : "")
+            << json_string(it->first) << ": " << json_string(it->second);
+    }
+    out << "}}";
+
+    write_model_file(path, out.str());
+}
+
+void write_chunker_model(std::string const & path,
+    np_weights_t const & weights, np_labelmap_in_t const & labelmap)
+{
+    std::ostringstream out;
+    init_model_stream(out);
+    out << "{\"weights\": [";
+    for (std::size_t k = 0; k < weights.size(); ++k)
+    {
+        out << (k > 0 ? ", " : "");
+        write_weight(out, weights[k]);
+    }
+    out << "], \"labelmap\": {";
+    for (np_labelmap_in_t::const_iterator it = labelmap.begin();
+        it != labelmap.end(); ++it)
+    {
+        out << (it != labelmap.begin() ? ", " : "")
+            << json_string(it->first) << ": "
+            << json_string(std::string(1, it->second));
+    }
+    out << "}}";
+
+    write_model_file(path, out.str());
+}
+
+void save_tagger(PerceptronTagger const & tagger, std::string const & path)
+{
+    weights_in_t weights;
+    class_weights_in_t bias_weights;
+    tagmap_in_t specified_tags;
+    tagger.get_weights(weights, bias_weights, specified_tags);
+    write_tagger_model(path, weights, bias_weights, specified_tags);
+}
+
+void save_chunker(FastNPChunker const & chunker, std::string const & path)
+{
+    np_weights_t weights;
+    np_labelmap_in_t labelmap;
+    chunker.get_weights(weights, labelmap);
+    write_chunker_model(path, weights, labelmap);
+}
@@ -0,0 +1,101 @@
+#ifndef _MLTK_MODEL_IO_H_
+#define _MLTK_MODEL_IO_H_
+
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "_ctagger.h"
+#include "_np_chunker.h"
+#include "_model_registry.h"
+
+
+/**
+    Native loaders for the model files in mltk/models.
+
+    The models are stored as (optionally gzipped) JSON.  These read them
+    without Python, for the Cython wrappers and so the tagger and chunker
+    can be used directly from C++.
+    The readers throw std::ios_base::failure if the file can't be read and
+    std::runtime_error if it isn't a valid model.
+*/
+
+/// read the POS tagger model weights
+void read_tagger_model(std::string const & path, weights_in_t& weights,
+    class_weights_in_t& bias_weights, tagmap_in_t& specified_tags);
+
+/// read the NP chunker model weights
+void read_chunker_model(std::string const & path, np_weights_t& weights,
+    np_labelmap_in_t& labelmap);
+
+/// construct a POS tagger from a model file, with its weights backed as
+/// huge_pages says.  The caller owns the tagger
+PerceptronTagger* load_tagger(std::string const & path,
+    huge_page_mode_t huge_pages = HUGE_PAGES_OFF);
+
+/// construct a NP chunker from a model file, with its weights backed as
+/// huge_pages says.  The caller owns the chunker
+FastNPChunker* load_chunker(std::string const & path,
+    huge_page_mode_t huge_pages = HUGE_PAGES_OFF);
+
+/// identifies a model file's contents and how its weights are backed, to
+/// share the models in a ModelRegistry
+struct model_key_t
+{
+    /// the canonical path
+    std::string path;
+    /// the file's device, inode, size and modification time, so a file
+    /// that has been replaced is loaded again
+    std::string version;
+    huge_page_mode_t huge_pages;
+
+    bool operator<(model_key_t const & other) const;
+};
+
+/// the key for the model file path, backed as huge_pages says
+model_key_t model_key(std::string const & path, huge_page_mode_t huge_pages);
+
+typedef ModelRegistry<PosTaggerSpec, model_key_t> tagger_registry_t;
+typedef ModelRegistry<NPChunkerSpec, model_key_t> chunker_registry_t;
+
+/**
+    The POS tagger model in path from tagger_registry_t::instance(),
+    loading it as when says unless another tagger is already using it.
+    Every PerceptronTagger constructed from the result shares the one
+    copy of the weights.  Unlike load_tagger, the load errors are thrown
+    when the model is first used
+*/
+PerceptronTagger::pending_model_t shared_tagger_model(
+    std::string const & path, huge_page_mode_t huge_pages = HUGE_PAGES_OFF,
+    model_load_t when = LOAD_NOW);
+
+/// the NP chunker model in path from chunker_registry_t::instance(), as
+/// for shared_tagger_model
+FastNPChunker::pending_model_t shared_chunker_model(
+    std::string const & path, huge_page_mode_t huge_pages = HUGE_PAGES_OFF,
+    model_load_t when = LOAD_NOW);
+
+/// write a POS tagger model in the format read_tagger_model reads,
+/// gzipped if path ends in .gz
+void write_tagger_model(std::string const & path, weights_in_t const & weights,
+    class_weights_in_t const & bias_weights,
+    tagmap_in_t const & specified_tags);
+
+/// write a NP chunker model in the format read_chunker_model reads
+void write_chunker_model(std::string const & path,
+    np_weights_t const & weights, np_labelmap_in_t const & labelmap);
+
+/// write a POS tagger's weights, including any updates in its snapshot
+void save_tagger(PerceptronTagger const & tagger, std::string const & path);
+
+/// write a NP chunker's weights, including any updates in its snapshot
+void save_chunker(FastNPChunker const & chunker, std::string const & path);
+
+/// write a model file, gzipped if path ends in .gz.  Throws
+/// std::runtime_error on failure
+void write_model_file(std::string const & path, std::string const & text);
+
+/// s as a quoted and escaped JSON string, for writing models
+std::string json_string(std::string const & s);
+
+#endif // _MLTK_MODEL_IO_H_
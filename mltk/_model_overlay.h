@@ -0,0 +1,74 @@
+#ifndef _MLTK_MODEL_OVERLAY_H_
+#define _MLTK_MODEL_OVERLAY_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+
+/**
+    Online changes to a model's weights, kept as a delta on top of the
+    read-only base weights.
+
+    Updates are made to a pending delta that only the writer sees (one
+    writer at a time, holding writer_lock()).  publish() copies it to an
+    immutable snapshot that readers get from current().  Readers hold the
+    shared_ptr for as long as they use the snapshot, so a new snapshot
+    never changes weights under them.
+
+    current() is a single atomic load when nothing is published, so a
+    model that is never updated isn't slowed down.
+
+    T is the delta type.  It must be default constructible (empty),
+    copyable and have an empty() method.
+*/
+template <class T>
+class ModelOverlay
+{
+    public:
+        ModelOverlay() : has_snapshot(false) {}
+
+        /// the published snapshot, or NULL if there isn't one
+        std::shared_ptr<const T> current() const
+        {
+            if (!has_snapshot.load(std::memory_order_acquire))
+                return std::shared_ptr<const T>();
+            return std::atomic_load(&snapshot);
+        }
+
+        /// hold while using pending() or calling publish() or clear()
+        std::mutex& writer_lock() { return lock; }
+
+        /// the delta updates are made to
+        T& pending() { return delta; }
+
+        /// make the pending delta visible to readers
+        void publish()
+        {
+            std::shared_ptr<const T> published;
+            if (!delta.empty())
+                published.reset(new T(delta));
+            std::atomic_store(&snapshot, published);
+            has_snapshot.store(bool(published), std::memory_order_release);
+        }
+
+        /// discard the pending delta and the snapshot
+        void clear()
+        {
+            delta = T();
+            publish();
+        }
+
+    private:
+        std::atomic<bool> has_snapshot;
+        std::shared_ptr<const T> snapshot;
+
+        std::mutex lock;
+        T delta;
+
+        // disable some default constructors
+        ModelOverlay& operator= (const ModelOverlay& other);
+        ModelOverlay(const ModelOverlay& other);
+};
+
+#endif // _MLTK_MODEL_OVERLAY_H_
@@ -0,0 +1,203 @@
+#ifndef _MLTK_MODEL_REGISTRY_H_
+#define _MLTK_MODEL_REGISTRY_H_
+
+#include <cstddef>
+#include <map>
+#include <vector>
+#include <utility>
+#include <memory>
+#include <future>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <functional>
+
+
+/// when a ModelRegistry loads a model that isn't already loaded
+enum model_load_t
+{
+    LOAD_NOW,           // before get() returns
+    LOAD_LAZY,          // when the model is first used
+    LOAD_BACKGROUND     // in a new thread
+};
+
+/**
+    A process wide registry of immutable models, so all the taggers for
+    the same model file share one copy of the weights instead of each
+    reading and parsing the file and keeping its own copy.
+
+    Models are identified by a KEY (e.g. the path, the file's version and
+    how the weights are backed), and are handed out as futures that the
+    taggers wait on when they first need the model.  Concurrent requests
+    for a model that is still loading share the same load.
+
+    The registry only keeps weak references to the models: a model is
+    freed when its last user is, and is loaded again if it is needed after
+    that.  Load errors aren't kept either, the next request tries again.
+*/
+template <class T, class KEY>
+class ModelRegistry
+{
+    public:
+        typedef std::shared_ptr<const T> model_t;
+        typedef std::shared_future<model_t> pending_model_t;
+        typedef std::function<model_t()> loader_t;
+
+        /// the process wide registry for T
+        static ModelRegistry& instance();
+
+        ModelRegistry() : nloads(0) {}
+
+        /// the model for key.  If it isn't loaded (or loading) yet, calls
+        /// load to load it, as when says.  A lazy load that hasn't started
+        /// is started as when says too.  The future throws load's
+        /// exception if it failed
+        pending_model_t get(KEY const & key, loader_t load,
+            model_load_t when);
+
+        /// the keys of the loaded models and the number of references to
+        /// each (from taggers and futures)
+        std::vector<std::pair<KEY, long> > loaded() const;
+
+    private:
+        struct entry_t
+        {
+            std::weak_ptr<const T> model;
+            // the load in progress, if any, and its id
+            pending_model_t pending;
+            std::size_t load_id;
+        };
+
+        mutable std::mutex lock;
+        std::map<KEY, entry_t> entries;
+        std::size_t nloads;
+
+        /// run a load and record its result (or lack of one) in the entry
+        model_t run(KEY const & key, std::size_t load_id,
+            loader_t const & load);
+
+        /// the entry for key is done with the load load_id
+        void finish(KEY const & key, std::size_t load_id, model_t model);
+
+        // disable some default constructors
+        ModelRegistry& operator= (const ModelRegistry& other);
+        ModelRegistry(const ModelRegistry& other);
+};
+
+
+template <class T, class KEY>
+ModelRegistry<T, KEY>& ModelRegistry<T, KEY>::instance()
+{
+    // never deleted, so background loads can't outlive it at exit
+    static ModelRegistry* registry = new ModelRegistry();
+    return *registry;
+}
+
+template <class T, class KEY>
+typename ModelRegistry<T, KEY>::pending_model_t
+ModelRegistry<T, KEY>::get(KEY const & key, loader_t load, model_load_t when)
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    // forget the models no one is using
+    for (typename std::map<KEY, entry_t>::iterator it = entries.begin();
+        it != entries.end(); )
+    {
+        if (it->second.model.expired() && !it->second.pending.valid())
+            entries.erase(it++);
+        else
+            ++it;
+    }
+
+    entry_t& entry = entries[key];
+    model_t model = entry.model.lock();
+    if (model)
+    {
+        std::promise<model_t> loaded_model;
+        loaded_model.set_value(model);
+        return loaded_model.get_future().share();
+    }
+    if (entry.pending.valid())
+    {
+        // a lazy load that no one has started yet is started now if
+        // that's what this request wants
+        pending_model_t pending = entry.pending;
+        guard.unlock();
+        if (when == LOAD_BACKGROUND && pending.wait_for(
+                std::chrono::seconds(0)) == std::future_status::deferred)
+            std::thread([pending]() { pending.wait(); }).detach();
+        else if (when == LOAD_NOW)
+            pending.wait();
+        return pending;
+    }
+
+    std::size_t load_id = ++nloads;
+    entry.load_id = load_id;
+    std::function<model_t()> task =
+        [this, key, load_id, load]() { return run(key, load_id, load); };
+    if (when == LOAD_LAZY)
+    {
+        entry.pending = std::async(std::launch::deferred, task).share();
+        return entry.pending;
+    }
+
+    std::packaged_task<model_t()> loader(task);
+    pending_model_t pending = loader.get_future().share();
+    entry.pending = pending;
+    guard.unlock();
+
+    if (when == LOAD_BACKGROUND)
+        std::thread(std::move(loader)).detach();
+    else
+        loader();
+    return pending;
+}
+
+template <class T, class KEY>
+typename ModelRegistry<T, KEY>::model_t ModelRegistry<T, KEY>::run(
+    KEY const & key, std::size_t load_id, loader_t const & load)
+{
+    model_t model;
+    try
+    {
+        model = load();
+    }
+    catch (...)
+    {
+        finish(key, load_id, model_t());
+        throw;
+    }
+    finish(key, load_id, model);
+    return model;
+}
+
+template <class T, class KEY>
+void ModelRegistry<T, KEY>::finish(KEY const & key, std::size_t load_id,
+    model_t model)
+{
+    // the futures given out keep the model, the entry only references it
+    std::lock_guard<std::mutex> guard(lock);
+    typename std::map<KEY, entry_t>::iterator it = entries.find(key);
+    if (it != entries.end() && it->second.load_id == load_id)
+    {
+        it->second.model = model;
+        it->second.pending = pending_model_t();
+    }
+}
+
+template <class T, class KEY>
+std::vector<std::pair<KEY, long> > ModelRegistry<T, KEY>::loaded() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<std::pair<KEY, long> > ret;
+    for (typename std::map<KEY, entry_t>::const_iterator it = entries.begin();
+        it != entries.end(); ++it)
+    {
+        long users = it->second.model.use_count();
+        if (users > 0)
+            ret.push_back(std::make_pair(it->first, users));
+    }
+    return ret;
+}
+
+#endif // _MLTK_MODEL_REGISTRY_H_
@@ -1,50 +1,23 @@
 
-#include <iostream>
 #include <vector>
 #include <string>
 #include <unordered_map>
 #include <map>
+#include <memory>
 #include <functional>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+#include <cstring>
+#include <cctype>
 
-#include "_utils.cc"
+#include "_np_chunker.h"
 
 
-/// features used to predict a given IOB label
-typedef std::vector<std::string> np_features_t;
-
-/// the feature weights
-typedef std::vector<float> np_weights_t;
-
-/// some words always have a defined label
-typedef std::unordered_map<std::string, char,
-    std::function<unsigned long(const std::string&)> > np_labelmap_t;
-
-/** it's easier to pass things in as std::map from cython
- since it doesn't require dragging along the custom hash... */
-typedef std::map<std::string, char> np_labelmap_in_t;
-
-/// Input to the chunker are already tokenized, POS tagged sentences
-typedef std::pair<std::string, std::string> tag_t;
-
-struct iob_t {
-    std::string token;
-    std::string tag;
-    char label;
-    iob_t(std::string token, std::string tag, char label) :
-        token(token), tag(tag), label(label) {}
-};
-
-/// Output from the chunker are tags + the IOB labels
-typedef std::vector<iob_t> iob_label_t;
-
-/// Instead of IOB labels, also allow the option to output noun phrases
-typedef std::vector<tag_t> np_t;
-
-
-void get_features(std::size_t k,
+void get_np_features(std::size_t k,
     std::string const & word,
-    std::vector<std::string>& context,
-    std::vector<std::string>& tags,
+    std::vector<std::string> const & context,
+    std::vector<std::string> const & tags,
     np_features_t& features)
 {
     /** Create some features for the current position.
@@ -53,216 +26,164 @@ void get_features(std::size_t k,
     tags = the POS tags for the sentence, padded
     features = the return 
     */
-    features.clear();
-    features.reserve(20);
+    features.resize(20);
 
     std::size_t i = k + 2;
 
     // unigram words
-    features.push_back(join("w-2", 3, context[i-2]));
-    features.push_back(join("w-1", 3, context[i-1]));
-    features.push_back(join("w0", 2, context[i]));
-    features.push_back(join("w1", 2, context[i+1]));
-    features.push_back(join("w2", 2, context[i+2]));
+    join_into("w-2", 3, context[i-2], features[0]);
+    join_into("w-1", 3, context[i-1], features[1]);
+    join_into("w0", 2, context[i], features[2]);
+    join_into("w1", 2, context[i+1], features[3]);
+    join_into("w2", 2, context[i+2], features[4]);
 
     // bigram words
-    features.push_back(join("w-1w0", 5, context[i-1], context[i]));
-    features.push_back(join("w0w1", 4, context[i], context[i+1]));
+    join_into("w-1w0", 5, context[i-1], context[i], features[5]);
+    join_into("w0w1", 4, context[i], context[i+1], features[6]);
 
     // unigram tags
-    features.push_back(join("t-2", 3, tags[i-2]));
-    features.push_back(join("t-1", 3, tags[i-1]));
-    features.push_back(join("t0", 2, tags[i]));
-    features.push_back(join("t1", 2, tags[i+1]));
-    features.push_back(join("t2", 2, tags[i+2]));
+    join_into("t-2", 3, tags[i-2], features[7]);
+    join_into("t-1", 3, tags[i-1], features[8]);
+    join_into("t0", 2, tags[i], features[9]);
+    join_into("t1", 2, tags[i+1], features[10]);
+    join_into("t2", 2, tags[i+2], features[11]);
 
     // bigram tags
-    features.push_back(join("t-2t-1", 6, tags[i-2], tags[i-1]));
-    features.push_back(join("t-1t0", 5, tags[i-1], tags[i]));
-    features.push_back(join("t0t1", 4, tags[i], tags[i+1]));
-    features.push_back(join("t1t2", 4, tags[i+1], tags[i+2]));
+    join_into("t-2t-1", 6, tags[i-2], tags[i-1], features[12]);
+    join_into("t-1t0", 5, tags[i-1], tags[i], features[13]);
+    join_into("t0t1", 4, tags[i], tags[i+1], features[14]);
+    join_into("t1t2", 4, tags[i+1], tags[i+2], features[15]);
 
     // trigram tags
-    features.push_back(join("t-2t-1t0", 8, tags[i-2], tags[i-1], tags[i]));
-    features.push_back(join("t-1t0t1", 7, tags[i-1], tags[i], tags[i+1]));
-    features.push_back(join("t0t1t2", 6, tags[i], tags[i+1], tags[i+2]));
+    join_into("t-2t-1t0", 8, tags[i-2], tags[i-1], tags[i], features[16]);
+    join_into("t-1t0t1", 7, tags[i-1], tags[i], tags[i+1], features[17]);
+    join_into("t0t1t2", 6, tags[i], tags[i+1], tags[i+2], features[18]);
 
     // first letter
-    features.push_back(join('p', word[0]));
-}
-
-
-// the dimension of our hashed feature vector (2 ** 17)
-#define N_FEATURES 131072
-// we'll use bit wise & instead of mod in the feature hash...
-#define N_FEATURES_MINUS_1 131071
-// the bias weights start at this index (N_FEATURES * N_CLASSES)
-#define BIAS_INDEX 393216
-
-
-inline uint64_t feature_hash(const std::string& key)
-{
-    /// The hash function for our feature hashing
-    return murmurhash3(key) & N_FEATURES_MINUS_1;
+    join_into('p', word[0], features[19]);
 }
 
-// the number of possible output classes (I, O, B)
-#define N_CLASSES 3
-
-class FastNPChunker : public TaggerBase<tag_t, iob_t>
-{
-    public:
-        FastNPChunker(np_weights_t weights, np_labelmap_in_t labelmap_in);
-        ~FastNPChunker();
-
-        /// Given a POS tagged sentence, return IOB labels for each token
-        iob_label_t tag_sentence(std::vector<tag_t> const & sentence);
-
-        /// Given POS tagged sentences, return NP only
-        void chunk_sentences(
-            std::vector<std::vector<tag_t> > & sentences,
-            std::vector<std::vector<np_t> > & noun_phrases);
-
-    private:
-        // the weights are logically a 2D matrix of (n_features, n_classes)
-        // but are stored as a flattened array running across rows
-        // then down columns.  Thus the weights for feature k are
-        // in entries (k * N_CLASSES):(k * N_CLASSES + N_CLASSES)
-        np_weights_t weights;
-
-        // if the word is in labelmap then it always has a predefined label
-        np_labelmap_t labelmap;
-
-        // the output class labels
-        std::vector<char> classes;
-
-        /// Given some features, compute the scores for each class
-        void compute_scores(np_features_t const & features,
-            std::vector<float>& scores);
+const char NP_CLASSES[N_CLASSES] = {'I', 'O', 'B'};
 
-        // disable some default constructors
-        FastNPChunker();
-        FastNPChunker& operator= (const FastNPChunker& other);
-        FastNPChunker(const FastNPChunker& other);
-};
-
-FastNPChunker::FastNPChunker(
-    np_weights_t weights, np_labelmap_in_t labelmap_in) :
-    weights(weights), labelmap(1000, murmurhash3), classes()
+NPChunkerSpec::NPChunkerSpec(
+    np_weights_t const & weights, np_labelmap_in_t const & labelmap_in,
+    huge_page_mode_t huge_pages) :
+    weights(weights.begin(), weights.end(),
+        HugePageAllocator<float>(huge_pages)),
+    labelmap(1000, murmurhash3), feature_bound(0.0)
 {
     // fill in the labelmap
     for (np_labelmap_in_t::const_iterator it = labelmap_in.begin();
         it != labelmap_in.end(); ++it)
     {
+        if (std::find(NP_CLASSES, NP_CLASSES + N_CLASSES, it->second) ==
+                NP_CLASSES + N_CLASSES)
+            throw std::invalid_argument("Invalid IOB label " +
+                std::string(1, it->second));
         labelmap[it->first] = it->second;
     }
 
-    // fill in the classes
-    classes.reserve(3);
-    classes.push_back('I');
-    classes.push_back('O');
-    classes.push_back('B');
+    // the most any feature can change the difference between two scores
+    for (std::size_t k = 0; k + N_CLASSES <= BIAS_INDEX; k += N_CLASSES)
+    {
+        float range = *std::max_element(&this->weights[k],
+            &this->weights[k] + N_CLASSES) - *std::min_element(
+            &this->weights[k], &this->weights[k] + N_CLASSES);
+        feature_bound = std::max(feature_bound, range);
+    }
+}
+
+FastNPChunker::FastNPChunker(
+    np_weights_t weights, np_labelmap_in_t labelmap_in,
+    huge_page_mode_t huge_pages) :
+    model(std::make_shared<NPChunkerSpec>(weights, labelmap_in, huge_pages))
+{
 }
 
+FastNPChunker::FastNPChunker(model_t model) : model(model) {}
+
+FastNPChunker::FastNPChunker(pending_model_t model) : model(model) {}
+
 FastNPChunker::~FastNPChunker() {}
 
-void FastNPChunker::compute_scores(np_features_t const & features,
-    std::vector<float>& scores)
+FastNPChunker::model_t FastNPChunker::shared_model() const
+{
+    return model.shared_spec();
+}
+
+bool FastNPChunker::model_loaded() const
 {
-    // process:
-    // 1.  initialize the scores to the bias weights
-    // 2.  for each feature, compute its hash, add in the weights
+    return model.loaded();
+}
 
-    // 1.  the bias weights are the last N_CLASSES entries in the weight
-    //  vector
-    for (std::size_t k = 0; k < N_CLASSES; ++k)
-        scores[k] = weights[BIAS_INDEX + k];
+bool FastNPChunker::wait_for_model() const
+{
+    return model.wait();
+}
 
-    // 2.
-    for (np_features_t::const_iterator it = features.begin();
-        it != features.end(); ++ it)
-    {
-        // this is the starting index for these feature weights
-        uint64_t index = feature_hash(*it) * N_CLASSES;
-        for (std::size_t k = 0; k < N_CLASSES; ++k)
-            scores[k] += weights[index + k];
-    }
+void FastNPChunker::set_early_exit(float bound_scale)
+{
+    model.set_early_exit(bound_scale);
+    clear_cache();
 }
 
-iob_label_t FastNPChunker::tag_sentence(std::vector<tag_t> const & sentence)
+
+iob_label_t FastNPChunker::tag_sentence(
+    std::vector<tag_t> const & sentence) const
 {
+    // only the returned labels are allocated
+    static thread_local std::vector<char> labels;
+    tag_labels(sentence, labels);
+
     iob_label_t ret;
     ret.reserve(sentence.size());
+    for (std::size_t i=0; i < sentence.size(); ++i)
+        ret.push_back(iob_t(sentence[i].first, sentence[i].second, labels[i]));
 
-    // make the word and tag context
-    std::vector<std::string> context;
-    std::vector<std::string> tag_context;
-    context.reserve(sentence.size() + 4);
-    tag_context.reserve(sentence.size() + 4);
-    context.push_back("-START-"); context.push_back("-START2-");
-    tag_context.push_back("-START-"); tag_context.push_back("-START2-");
-    for (std::vector<tag_t>::const_iterator it = sentence.begin();
-        it != sentence.end(); ++it)
-    {
-        context.push_back(normalize(it->first));
-        tag_context.push_back(it->second);
-    }
-    context.push_back("-END-"); context.push_back("-END2-");
-    tag_context.push_back("-END-"); tag_context.push_back("-END2-");
-
-    // loop through the sentence and assign class to each token
-    np_features_t features;
-    std::vector<float> scores(N_CLASSES, 0.0);
+    return ret;
+}
 
-    // need to keep track of last label to check for invalid sequences
-    // Since 'I' is not a valid label for the first word of the sentence,
-    // and OI is the only invalid sequence this handles the first word
-    // of the sentence case
-    char last_label = 'O';
+void FastNPChunker::tag_labels(std::vector<tag_t> const & sentence,
+    std::vector<char>& labels) const
+{
+    labels.clear();
+    labels.reserve(sentence.size());
+    model.label(sentence, overlay.current().get(), labels);
+}
 
-    for (std::size_t i=0; i < sentence.size(); ++i)
-    {
-        char label;
-        std::string const & word = sentence[i].first;
+void FastNPChunker::tag_labels(
+    std::vector<std::pair<token_ref_t, token_ref_t> > const & sentence,
+    std::vector<char>& labels) const
+{
+    labels.clear();
+    labels.reserve(sentence.size());
+    model.label(sentence, overlay.current().get(), labels);
+}
 
-        // check if word is in the labelmap
-        np_labelmap_t::const_iterator got = labelmap.find(word);
-        if (got != labelmap.end())
-        {
-            label = got->second;
-        }
-        else
-        {
-            get_features(i, word, context, tag_context, features);
-            compute_scores(features, scores);
-
-            // scores holds the class predictions
-            // predicted class is the maximum value in scores, except for
-            // invalid orderings ('O' then 'I')
-            float max_score = -1e20;
-            for (std::size_t k=0; k < N_CLASSES; ++k)
-            {
-                if (scores[k] > max_score &&
-                        // not an invalid combo
-                        !(last_label == 'O' && classes[k] == 'I'))
-                {
-                    max_score = scores[k];
-                    label = classes[k];
-                }
-            }
-        }
+void FastNPChunker::tag_packed(packed_document_t const & document,
+    packed_document_t const & tags, std::vector<char>& labels) const
+{
+    labels.clear();
+    labels.reserve(document.ntokens);
 
-        last_label = label;
-        ret.push_back(iob_t(word, sentence[i].second, label));
+    std::shared_ptr<const np_delta_t> delta = overlay.current();
+    static thread_local std::vector<std::pair<token_ref_t, token_ref_t> >
+        sentence;
+    for (std::size_t j = 0; j < document.nsentences; ++j)
+    {
+        sentence.clear();
+        for (int64_t k = document.sentence_offsets[j];
+                k < document.sentence_offsets[j + 1]; ++k)
+            sentence.push_back(
+                std::make_pair(document.token(k), tags.token(k)));
+        model.label(sentence, delta.get(), labels);
     }
-
-    return ret;
 }
 
 
 void FastNPChunker::chunk_sentences(
             std::vector<std::vector<tag_t> > & sentences,
-            std::vector<std::vector<np_t> > & noun_phrases)
+            std::vector<std::vector<np_t> > & noun_phrases) const
 {
     // strategy: first find IOB labels, then make NP chunks
     std::vector<iob_label_t> iob_labels;
@@ -315,3 +236,318 @@ void FastNPChunker::chunk_sentences(
     }
 }
 
+void FastNPChunker::chunk_spans(
+            std::vector<std::vector<tag_t> > const & sentences,
+            std::vector<np_span_t> & spans) const
+{
+    // label each sentence then read off the spans in the same pass,
+    // following the same rules as chunk_sentences
+    spans.clear();
+    std::shared_ptr<const np_delta_t> delta = overlay.current();
+    std::vector<char> labels;
+    for (std::size_t j = 0; j < sentences.size(); ++j)
+    {
+        labels.clear();
+        model.label(sentences[j], delta.get(), labels);
+
+        bool in_phrase = false;
+        std::size_t start = 0;
+        for (std::size_t k = 0; k < labels.size(); ++k)
+        {
+            if (labels[k] == 'I')
+            {
+                // inside a NP.  start one if needed
+                if (!in_phrase)
+                {
+                    in_phrase = true;
+                    start = k;
+                }
+            }
+            else
+            {
+                // beginning a new chunk - either NP or other
+                if (in_phrase)
+                    spans.push_back(np_span_t(j, start, k));
+                in_phrase = labels[k] == 'B';
+                start = k;
+            }
+        }
+
+        if (in_phrase)
+            spans.push_back(np_span_t(j, start, labels.size()));
+    }
+}
+
+std::size_t FastNPChunker::update(std::vector<tag_t> const & sentence,
+    std::vector<char> const & gold_labels)
+{
+    if (gold_labels.size() != sentence.size())
+        throw std::invalid_argument(
+            "The sentence and gold labels have different lengths");
+
+    std::vector<std::size_t> gold;
+    for (std::size_t i = 0; i < gold_labels.size(); ++i)
+    {
+        std::size_t k = std::find(NP_CLASSES, NP_CLASSES + N_CLASSES,
+            gold_labels[i]) - NP_CLASSES;
+        if (k == N_CLASSES)
+            throw std::invalid_argument("Invalid IOB label " +
+                std::string(1, gold_labels[i]));
+        gold.push_back(k);
+    }
+
+    std::lock_guard<std::mutex> guard(overlay.writer_lock());
+    return model.learn(sentence, gold, overlay.pending());
+}
+
+void FastNPChunker::snapshot()
+{
+    {
+        std::lock_guard<std::mutex> guard(overlay.writer_lock());
+        overlay.publish();
+    }
+    clear_cache();
+}
+
+void FastNPChunker::reset_updates()
+{
+    {
+        std::lock_guard<std::mutex> guard(overlay.writer_lock());
+        overlay.clear();
+    }
+    clear_cache();
+}
+
+void FastNPChunker::get_weights(np_weights_t& weights,
+    np_labelmap_in_t& labelmap) const
+{
+    weights.assign(model.spec().weights.begin(), model.spec().weights.end());
+    std::shared_ptr<const np_delta_t> delta = overlay.current();
+    if (delta)
+    {
+        std::unordered_map<uint64_t, std::vector<float> >::const_iterator it;
+        for (it = delta->weights.begin(); it != delta->weights.end(); ++it)
+        {
+            for (std::size_t k = 0; k < N_CLASSES; ++k)
+                weights[it->first * N_CLASSES + k] += it->second[k];
+        }
+    }
+
+    labelmap.clear();
+    labelmap.insert(model.spec().labelmap.begin(),
+        model.spec().labelmap.end());
+}
+
+
+void np_delta_t::add_bias(float* scores) const
+{
+    std::unordered_map<uint64_t, std::vector<float> >::const_iterator got =
+        weights.find(N_FEATURES);
+    if (got != weights.end())
+    {
+        for (std::size_t k = 0; k < N_CLASSES; ++k)
+            scores[k] += got->second[k];
+    }
+}
+
+void np_delta_t::add_weights(std::size_t, std::string const & feature,
+    float* scores) const
+{
+    std::unordered_map<uint64_t, std::vector<float> >::const_iterator got =
+        weights.find(feature_hash(feature));
+    if (got != weights.end())
+    {
+        for (std::size_t k = 0; k < N_CLASSES; ++k)
+            scores[k] += got->second[k];
+    }
+}
+
+void np_delta_t::update(np_features_t const & features, std::size_t truth,
+    std::size_t guess)
+{
+    // the bias first, then the features
+    for (std::size_t k = 0; k <= features.size(); ++k)
+    {
+        uint64_t row = k == 0 ? N_FEATURES : feature_hash(features[k - 1]);
+        std::vector<float>& class_weights = weights[row];
+        class_weights.resize(N_CLASSES, 0.0);
+        class_weights[truth] += 1.0;
+        class_weights[guess] -= 1.0;
+    }
+}
+
+
+namespace
+{
+
+/// append a token to a noun phrase, normalized as normalize says
+template <class TOKEN>
+void append_token(TOKEN const & token, np_normalize_t normalize,
+    std::string& word, std::string& phrase)
+{
+    std::string const & text = token_string(token, word);
+    if (!phrase.empty())
+        phrase.append(" ");
+    if (normalize == NP_EXACT)
+    {
+        phrase.append(text);
+        return;
+    }
+    if (normalize == NP_NORMALIZE)
+        normalize_into(text, word);
+    else
+    {
+        // tolower is undefined for negative chars, e.g. UTF-8 bytes
+        word.assign(text);
+        for (std::size_t k = 0; k < word.length(); ++k)
+            word[k] = std::tolower(static_cast<unsigned char>(word[k]));
+    }
+    phrase.append(word);
+}
+
+/// count the noun phrases in a labelled sentence, following the same
+/// rules as chunk_sentences
+template <class SENTENCE>
+void count_sentence(SENTENCE const & sentence,
+    std::vector<char> const & labels, np_normalize_t normalize,
+    NounPhraseCounts& counts)
+{
+    static thread_local std::string phrase;
+    static thread_local std::string word;
+    phrase.clear();
+    bool in_phrase = false;
+    for (std::size_t k = 0; k < labels.size(); ++k)
+    {
+        // B and O end the current phrase, B and I add to one
+        if (labels[k] != 'I' && in_phrase)
+        {
+            counts.add(phrase);
+            phrase.clear();
+            in_phrase = false;
+        }
+        if (labels[k] != 'O')
+        {
+            append_token(sentence[k].first, normalize, word, phrase);
+            in_phrase = true;
+        }
+    }
+    if (in_phrase)
+        counts.add(phrase);
+}
+
+}
+
+void FastNPChunker::count_noun_phrases(
+    std::vector<std::vector<tag_t> > const & sentences,
+    np_normalize_t normalize, NounPhraseCounts& counts) const
+{
+    std::shared_ptr<const np_delta_t> delta = overlay.current();
+    static thread_local std::vector<char> labels;
+    for (std::size_t j = 0; j < sentences.size(); ++j)
+    {
+        labels.clear();
+        model.label(sentences[j], delta.get(), labels);
+        count_sentence(sentences[j], labels, normalize, counts);
+    }
+}
+
+void FastNPChunker::count_noun_phrases(packed_document_t const & document,
+    packed_document_t const & tags, np_normalize_t normalize,
+    NounPhraseCounts& counts) const
+{
+    std::shared_ptr<const np_delta_t> delta = overlay.current();
+    static thread_local std::vector<char> labels;
+    static thread_local std::vector<std::pair<token_ref_t, token_ref_t> >
+        sentence;
+    for (std::size_t j = 0; j < document.nsentences; ++j)
+    {
+        sentence.clear();
+        for (int64_t k = document.sentence_offsets[j];
+                k < document.sentence_offsets[j + 1]; ++k)
+            sentence.push_back(
+                std::make_pair(document.token(k), tags.token(k)));
+        labels.clear();
+        model.label(sentence, delta.get(), labels);
+        count_sentence(sentence, labels, normalize, counts);
+    }
+}
+
+
+NounPhraseCounts::NounPhraseCounts() : slots(16, 0) {}
+
+std::size_t NounPhraseCounts::find(const char* phrase, std::size_t length,
+    uint64_t hash) const
+{
+    // linear probing, the table is never more than half full
+    std::size_t mask = slots.size() - 1;
+    for (std::size_t slot = hash & mask; ; slot = (slot + 1) & mask)
+    {
+        if (slots[slot] == 0)
+            return slot;
+        entry_t const & entry = entries[slots[slot] - 1];
+        if (entry.hash == hash && entry.length == length &&
+                std::memcmp(buffer.data() + entry.offset, phrase,
+                    length) == 0)
+            return slot;
+    }
+}
+
+void NounPhraseCounts::add(std::string const & phrase, std::size_t count)
+{
+    add(phrase.data(), phrase.length(), murmurhash3(phrase), count);
+}
+
+void NounPhraseCounts::add(const char* phrase, std::size_t length,
+    uint64_t hash, std::size_t count)
+{
+    std::size_t slot = find(phrase, length, hash);
+    if (slots[slot] != 0)
+    {
+        entries[slots[slot] - 1].count += count;
+        return;
+    }
+
+    entry_t entry = {buffer.size(), length, count, hash};
+    buffer.append(phrase, length);
+    entries.push_back(entry);
+    slots[slot] = entries.size();
+    if (2 * entries.size() > slots.size())
+        grow();
+}
+
+void NounPhraseCounts::merge(NounPhraseCounts const & other)
+{
+    for (std::size_t k = 0; k < other.entries.size(); ++k)
+    {
+        entry_t const & entry = other.entries[k];
+        add(other.buffer.data() + entry.offset, entry.length, entry.hash,
+            entry.count);
+    }
+}
+
+std::size_t NounPhraseCounts::lookup(std::string const & phrase) const
+{
+    std::size_t slot = find(phrase.data(), phrase.length(),
+        murmurhash3(phrase));
+    return slots[slot] == 0 ? 0 : entries[slots[slot] - 1].count;
+}
+
+void NounPhraseCounts::clear()
+{
+    buffer.clear();
+    entries.clear();
+    std::fill(slots.begin(), slots.end(), 0);
+}
+
+void NounPhraseCounts::grow()
+{
+    slots.assign(2 * slots.size(), 0);
+    std::size_t mask = slots.size() - 1;
+    for (std::size_t k = 0; k < entries.size(); ++k)
+    {
+        std::size_t slot = entries[k].hash & mask;
+        while (slots[slot] != 0)
+            slot = (slot + 1) & mask;
+        slots[slot] = k + 1;
+    }
+}
@@ -0,0 +1,502 @@
+#ifndef _MLTK_NP_CHUNKER_H_
+#define _MLTK_NP_CHUNKER_H_
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <map>
+#include <functional>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+
+#include "_utils.h"
+#include "_model_overlay.h"
+#include "_placement.h"
+#include "_sequence_model.h"
+
+
+/// features used to predict a given IOB label
+typedef std::vector<std::string> np_features_t;
+
+/// the feature weights
+typedef std::vector<float> np_weights_t;
+
+/// the feature weights in the chunker, optionally in huge pages
+typedef std::vector<float, HugePageAllocator<float> > np_table_t;
+
+/// some words always have a defined label
+typedef std::unordered_map<std::string, char,
+    std::function<unsigned long(const std::string&)> > np_labelmap_t;
+
+/** it's easier to pass things in as std::map from cython
+ since it doesn't require dragging along the custom hash... */
+typedef std::map<std::string, char> np_labelmap_in_t;
+
+/// Input to the chunker are already tokenized, POS tagged sentences
+typedef std::pair<std::string, std::string> tag_t;
+
+struct iob_t {
+    std::string token;
+    std::string tag;
+    char label;
+    iob_t(std::string token, std::string tag, char label) :
+        token(token), tag(tag), label(label) {}
+};
+
+inline bool operator==(iob_t const & a, iob_t const & b)
+{
+    return a.label == b.label && a.token == b.token && a.tag == b.tag;
+}
+
+/// Output from the chunker are tags + the IOB labels
+typedef std::vector<iob_t> iob_label_t;
+
+/// Instead of IOB labels, also allow the option to output noun phrases
+typedef std::vector<tag_t> np_t;
+
+/// Or as a span of tokens, sentences[sentence][start:end]
+struct np_span_t {
+    std::size_t sentence;
+    std::size_t start;
+    std::size_t end;
+    np_span_t(std::size_t sentence, std::size_t start, std::size_t end) :
+        sentence(sentence), start(start), end(end) {}
+};
+
+/// how FastNPChunker::count_noun_phrases normalizes the tokens
+enum np_normalize_t
+{
+    NP_EXACT,           // as they are
+    NP_LOWERCASE,       // lower cased
+    NP_NORMALIZE        // with normalize(), e.g. numbers are !DIGITS
+};
+
+/**
+    A noun phrase -> count table, filled by
+    FastNPChunker::count_noun_phrases.  A phrase is its tokens joined by
+    single spaces.
+
+    The phrases are stored back to back in one buffer, with an open
+    addressing hash table of indices into the entries, so adding a phrase
+    only allocates while the buffer and table are growing and there is
+    no node or string per phrase.  clear() keeps the memory for the next
+    document.  The phrases are numbered in the order they were first
+    added.
+*/
+class NounPhraseCounts
+{
+    public:
+        NounPhraseCounts();
+
+        /// add count to phrase
+        void add(std::string const & phrase, std::size_t count = 1);
+
+        /// add all of other's counts
+        void merge(NounPhraseCounts const & other);
+
+        /// the count for phrase, 0 if it hasn't been added
+        std::size_t lookup(std::string const & phrase) const;
+
+        /// the number of distinct phrases
+        std::size_t size() const { return entries.size(); }
+
+        /// the k'th distinct phrase, valid until the next add or clear
+        token_ref_t phrase(std::size_t k) const
+        {
+            return token_ref_t(buffer.data() + entries[k].offset,
+                entries[k].length);
+        }
+
+        /// the k'th distinct phrase's count
+        std::size_t count(std::size_t k) const { return entries[k].count; }
+
+        /// remove all the phrases, keeping the memory
+        void clear();
+
+    private:
+        struct entry_t
+        {
+            std::size_t offset;
+            std::size_t length;
+            std::size_t count;
+            uint64_t hash;
+        };
+
+        std::string buffer;
+        std::vector<entry_t> entries;
+        // the entry index + 1 in each slot, 0 for empty.  The number of
+        // slots is a power of 2 and at least twice the number of entries
+        std::vector<std::size_t> slots;
+
+        /// the slot for a phrase, either its entry's or the empty one
+        /// where it goes
+        std::size_t find(const char* phrase, std::size_t length,
+            uint64_t hash) const;
+
+        /// add count to the phrase with the given hash
+        void add(const char* phrase, std::size_t length, uint64_t hash,
+            std::size_t count);
+
+        /// double the slots and rehash
+        void grow();
+};
+
+
+// the dimension of our hashed feature vector (2 ** 17)
+#define N_FEATURES 131072
+// we'll use bit wise & instead of mod in the feature hash...
+#define N_FEATURES_MINUS_1 131071
+// the bias weights start at this index (N_FEATURES * N_CLASSES)
+#define BIAS_INDEX 393216
+
+// the number of possible output classes (I, O, B)
+#define N_CLASSES 3
+
+/// the IOB labels, in the order of the class indices
+extern const char NP_CLASSES[N_CLASSES];
+
+/**
+    The word and tag context for get_np_features: the normalized words
+    and the POS tags of a sentence of (token, tag) pairs of std::string or
+    token_ref_t, padded with -START-, -START2- and -END-, -END2-.
+    Shared by the chunker and the trainer so the features can't drift.
+
+    As with get_context the strings are overwritten in place and the
+    vectors never shrink, so they can be longer than sentence.size() + 4
+*/
+template <class TOKEN>
+void get_np_context(std::vector<std::pair<TOKEN, TOKEN> > const & sentence,
+    std::vector<std::string>& context, std::vector<std::string>& tag_context)
+{
+    std::size_t n = sentence.size();
+    if (context.size() < n + 4)
+        context.resize(n + 4);
+    if (tag_context.size() < n + 4)
+        tag_context.resize(n + 4);
+    context[0].assign("-START-"); context[1].assign("-START2-");
+    tag_context[0].assign("-START-"); tag_context[1].assign("-START2-");
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        assign_token(sentence[i].first, context[i + 2]);
+        normalize_into(context[i + 2], context[i + 2]);
+        assign_token(sentence[i].second, tag_context[i + 2]);
+    }
+    context[n + 2].assign("-END-"); context[n + 3].assign("-END2-");
+    tag_context[n + 2].assign("-END-"); tag_context[n + 3].assign("-END2-");
+}
+
+/// the features for the k'th word of a sentence given its context.  The
+/// strings in features are overwritten in place
+void get_np_features(std::size_t k,
+    std::string const & word,
+    std::vector<std::string> const & context,
+    std::vector<std::string> const & tags,
+    np_features_t& features);
+
+inline uint64_t feature_hash(const std::string& key)
+{
+    /// The hash function for our feature hashing
+    return murmurhash3(key) & N_FEATURES_MINUS_1;
+}
+
+/**
+    Changes to the FastNPChunker weights from online updates (see
+    FastNPChunker::update), added to the weights when predicting.
+    Maps the hashed feature (or N_FEATURES for the bias) to the class
+    weights.  Only features that were updated are included
+*/
+struct np_delta_t
+{
+    std::unordered_map<uint64_t, std::vector<float> > weights;
+
+    /// add the bias weights to scores
+    void add_bias(float* scores) const;
+
+    /// add the weights of a feature to scores, if any.  k is ignored,
+    /// all the features are hashed into one table
+    void add_weights(std::size_t k, std::string const & feature,
+        float* scores) const;
+
+    /// the perceptron update for predicting class guess instead of truth
+    void update(np_features_t const & features, std::size_t truth,
+        std::size_t guess);
+
+    bool empty() const { return weights.empty(); }
+};
+
+/**
+    The decode constraint for IOB labels: 'I' can't follow 'O' (and so
+    can't start a sentence).  Class indices are those of NP_CLASSES
+*/
+struct iob_constraint_t
+{
+    static const std::size_t INSIDE = 0;
+    static const std::size_t OUTSIDE = 1;
+
+    /// the class with the highest score that can follow prev
+    static std::size_t best(float const * scores, std::size_t prev)
+    {
+        float max_score = -1e20;
+        std::size_t ret = OUTSIDE;
+        for (std::size_t k = 0; k < N_CLASSES; ++k)
+        {
+            if (scores[k] > max_score &&
+                    !(prev == OUTSIDE && k == INSIDE))
+            {
+                max_score = scores[k];
+                ret = k;
+            }
+        }
+        return ret;
+    }
+
+    /// the margin between the best two classes that can follow prev
+    static float margin(float const * scores, std::size_t prev)
+    {
+        if (prev == OUTSIDE)
+            return std::abs(scores[1] - scores[2]);
+        float max_score = std::max(scores[0], std::max(scores[1],
+            scores[2]));
+        float min_score = std::min(scores[0], std::min(scores[1],
+            scores[2]));
+        return max_score - (scores[0] + scores[1] + scores[2] - max_score -
+            min_score);
+    }
+};
+
+/**
+    The NP chunker as a LinearSequenceModel: the features of
+    get_np_features, hashed into one dense table of weights, the
+    labelmap as fixed labels and the IOB constraint.  Sentences are
+    (token, POS tag) pairs
+*/
+class NPChunkerSpec
+{
+    public:
+        static const std::size_t NCLASSES = N_CLASSES;
+        static const std::size_t NFEATURES = 20;
+        // the margin is cheap with 3 classes, so check it every feature
+        static const std::size_t EARLY_EXIT_INTERVAL = 1;
+
+        typedef np_features_t features_t;
+        typedef np_delta_t delta_t;
+        typedef iob_constraint_t constraint_t;
+        typedef char label_t;
+
+        /// the normalized words and the POS tags, see get_np_context
+        struct context_t
+        {
+            std::vector<std::string> words;
+            std::vector<std::string> tags;
+        };
+
+        /// throws std::invalid_argument if a label in labelmap_in isn't
+        /// one of NP_CLASSES
+        NPChunkerSpec(np_weights_t const & weights,
+            np_labelmap_in_t const & labelmap_in,
+            huge_page_mode_t huge_pages);
+
+        // the weights are logically a 2D matrix of (n_features, n_classes)
+        // but are stored as a flattened array running across rows
+        // then down columns.  Thus the weights for feature k are
+        // in entries (k * N_CLASSES):(k * N_CLASSES + N_CLASSES)
+        np_table_t weights;
+
+        // if the word is in labelmap then it always has a predefined label
+        np_labelmap_t labelmap;
+
+        void start(std::size_t& prev, std::size_t& prev2) const
+        {
+            // 'I' can't start a sentence, just like after 'O'
+            prev = prev2 = iob_constraint_t::OUTSIDE;
+        }
+
+        template <class TOKEN>
+        void context(std::vector<std::pair<TOKEN, TOKEN> > const & sentence,
+            context_t& context) const
+        {
+            get_np_context(sentence, context.words, context.tags);
+        }
+
+        template <class TOKEN>
+        std::string const & word(
+            std::vector<std::pair<TOKEN, TOKEN> > const & sentence,
+            std::size_t i, std::string& buffer) const
+        {
+            return token_string(sentence[i].first, buffer);
+        }
+
+        bool fixed_label(std::string const & word, std::size_t& label) const
+        {
+            np_labelmap_t::const_iterator got = labelmap.find(word);
+            if (got == labelmap.end())
+                return false;
+            label = std::find(NP_CLASSES, NP_CLASSES + N_CLASSES,
+                got->second) - NP_CLASSES;
+            return true;
+        }
+
+        void features(std::size_t i, std::string const & word,
+            context_t const & context, std::size_t, std::size_t,
+            features_t& features) const
+        {
+            get_np_features(i, word, context.words, context.tags, features);
+        }
+
+        void bias(float* scores) const
+        {
+            // the bias weights are the last N_CLASSES entries
+            for (std::size_t k = 0; k < N_CLASSES; ++k)
+                scores[k] = weights[BIAS_INDEX + k];
+        }
+
+        void add_weights(std::size_t, std::string const & feature,
+            float* scores) const
+        {
+            uint64_t index = feature_hash(feature) * N_CLASSES;
+            for (std::size_t k = 0; k < N_CLASSES; ++k)
+                scores[k] += weights[index + k];
+        }
+
+        /// the features share one table so they have the same bound,
+        /// the largest range of class weights in the table
+        float bound(std::size_t) const { return feature_bound; }
+
+        char output(std::size_t label) const { return NP_CLASSES[label]; }
+
+    private:
+        float feature_bound;
+
+        // disable some default constructors
+        NPChunkerSpec();
+        NPChunkerSpec& operator= (const NPChunkerSpec& other);
+        NPChunkerSpec(const NPChunkerSpec& other);
+};
+
+class FastNPChunker : public TaggerBase<tag_t, iob_t>
+{
+    public:
+        typedef LinearSequenceModel<NPChunkerSpec>::model_t model_t;
+        typedef LinearSequenceModel<NPChunkerSpec>::pending_model_t
+            pending_model_t;
+
+        /// huge_pages is how the memory for the weights is backed
+        FastNPChunker(np_weights_t weights, np_labelmap_in_t labelmap_in,
+            huge_page_mode_t huge_pages = HUGE_PAGES_OFF);
+
+        /// a chunker for a model shared with other chunkers, e.g. from
+        /// shared_chunker_model.  The cache, early exit setting and online
+        /// updates are still this chunker's own
+        explicit FastNPChunker(model_t model);
+
+        /// a chunker for a model that may still be loading.  The methods
+        /// that use the model wait for it, and throw the load error if it
+        /// failed
+        explicit FastNPChunker(pending_model_t model);
+
+        ~FastNPChunker();
+
+        /// the model, to share it with another chunker
+        model_t shared_model() const;
+
+        /// true once the model has loaded
+        bool model_loaded() const;
+
+        /// wait for the model to load, returns false if it failed
+        bool wait_for_model() const;
+
+        /// Given a POS tagged sentence, return IOB labels for each token
+        iob_label_t tag_sentence(std::vector<tag_t> const & sentence) const;
+
+        /// Given a POS tagged sentence, return just the IOB labels.
+        /// With labels reused from call to call, this doesn't allocate
+        /// once the thread's workspace has warmed up
+        void tag_labels(std::vector<tag_t> const & sentence,
+            std::vector<char>& labels) const;
+
+        /// tag_labels for a sentence of tokens and tags stored elsewhere
+        void tag_labels(
+            std::vector<std::pair<token_ref_t, token_ref_t> > const &
+                sentence,
+            std::vector<char>& labels) const;
+
+        /// Given a packed document and its POS tags (packed the same
+        /// way with the same sentence_offsets), return the IOB label for
+        /// each token.  The cache isn't used
+        void tag_packed(packed_document_t const & document,
+            packed_document_t const & tags, std::vector<char>& labels) const;
+
+        /// Given POS tagged sentences, return NP only
+        void chunk_sentences(
+            std::vector<std::vector<tag_t> > & sentences,
+            std::vector<std::vector<np_t> > & noun_phrases) const;
+
+        /// Given POS tagged sentences, return the NP as token spans.
+        /// Nothing is copied from the input.  The cache isn't used
+        void chunk_spans(
+            std::vector<std::vector<tag_t> > const & sentences,
+            std::vector<np_span_t> & spans) const;
+
+        /**
+            Count the noun phrases in POS tagged sentences, e.g. for
+            keyword extraction, with each token normalized as normalize
+            says.  The counts are added to counts, which isn't cleared
+            first so a batch of documents can be counted together.  The
+            cache isn't used.  Once the thread's workspace and counts have
+            grown this doesn't allocate
+        */
+        void count_noun_phrases(
+            std::vector<std::vector<tag_t> > const & sentences,
+            np_normalize_t normalize, NounPhraseCounts& counts) const;
+
+        /// count_noun_phrases for a packed document and its POS tags, as
+        /// for tag_packed
+        void count_noun_phrases(packed_document_t const & document,
+            packed_document_t const & tags, np_normalize_t normalize,
+            NounPhraseCounts& counts) const;
+
+        /**
+            Online learning, e.g. to fix systematic mistakes on a new
+            domain without retraining.  Labels the sentence with the
+            updates so far and makes the usual perceptron update for each
+            wrong label.  Returns the number of wrong labels.  Words in
+            the labelmap aren't learned.
+
+            The updates are a delta on top of the model weights that
+            chunking doesn't use until snapshot() is called.  update() and
+            snapshot() can be called while other threads are chunking.
+            Throws std::invalid_argument if a label isn't I, O or B
+        */
+        std::size_t update(std::vector<tag_t> const & sentence,
+            std::vector<char> const & gold_labels);
+
+        /// start chunking with all the updates so far.  Clears the cache
+        void snapshot();
+
+        /// discard all the updates and go back to the model weights
+        void reset_updates();
+
+        /// the model weights and the updates in the snapshot, in the
+        /// input format, e.g. to save the updated model
+        void get_weights(np_weights_t& weights,
+            np_labelmap_in_t& labelmap) const;
+
+        /**
+            Approximate chunking, see LinearSequenceModel::set_early_exit.
+            The features are hashed into one table so they all have the
+            same bound, the largest range of class weights in the table
+        */
+        void set_early_exit(float bound_scale);
+
+    private:
+        LinearSequenceModel<NPChunkerSpec> model;
+        ModelOverlay<np_delta_t> overlay;
+
+        // disable some default constructors
+        FastNPChunker();
+        FastNPChunker& operator= (const FastNPChunker& other);
+        FastNPChunker(const FastNPChunker& other);
+};
+
+#endif // _MLTK_NP_CHUNKER_H_
@@ -0,0 +1,210 @@
+
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <new>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+#include "_placement.h"
+
+
+namespace
+{
+
+std::size_t round_to_huge_pages(std::size_t bytes)
+{
+    return (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+// the arena allocates at least this much at a time
+const std::size_t ARENA_CHUNK_SIZE = 4 * HUGE_PAGE_SIZE;
+
+/// parse a sysfs cpu list, e.g. "0-3,8-11"
+std::vector<int> parse_cpu_list(std::string const & list)
+{
+    std::vector<int> cpus;
+    std::istringstream in(list);
+    std::string range;
+    while (std::getline(in, range, ','))
+    {
+        if (range.empty() || range[0] == '\n')
+            continue;
+        std::size_t dash = range.find('-');
+        int first = std::atoi(range.c_str());
+        int last = dash == std::string::npos ?
+            first : std::atoi(range.c_str() + dash + 1);
+        for (int cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+}
+
+
+void* allocate_pages(std::size_t bytes, huge_page_mode_t mode)
+{
+#ifdef __linux__
+    if (mode != HUGE_PAGES_OFF)
+    {
+        std::size_t length = round_to_huge_pages(bytes);
+        void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        if (mode == HUGE_PAGES_HUGETLB)
+            p = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (p != MAP_FAILED)
+            return p;
+
+        // transparent huge pages need 2MB aligned memory, so map an
+        // extra huge page and unmap what's outside the aligned range
+        char* mapped = static_cast<char*>(mmap(NULL, length + HUGE_PAGE_SIZE,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (mapped == MAP_FAILED)
+            throw std::bad_alloc();
+        std::size_t head = (HUGE_PAGE_SIZE -
+            reinterpret_cast<std::uintptr_t>(mapped) % HUGE_PAGE_SIZE) %
+            HUGE_PAGE_SIZE;
+        if (head > 0)
+            munmap(mapped, head);
+        munmap(mapped + head + length, HUGE_PAGE_SIZE - head);
+#ifdef MADV_HUGEPAGE
+        // fails harmlessly if the kernel doesn't have THP
+        madvise(mapped + head, length, MADV_HUGEPAGE);
+#endif
+        return mapped + head;
+    }
+#endif
+    return ::operator new(bytes);
+}
+
+void free_pages(void* p, std::size_t bytes, huge_page_mode_t mode)
+{
+    if (!p)
+        return;
+#ifdef __linux__
+    if (mode != HUGE_PAGES_OFF)
+    {
+        munmap(p, round_to_huge_pages(bytes));
+        return;
+    }
+#endif
+    ::operator delete(p);
+}
+
+
+PageArena::PageArena(huge_page_mode_t mode) :
+    mode(mode), chunks(), next(NULL), end(NULL)
+{
+}
+
+PageArena::~PageArena()
+{
+    for (std::size_t k = 0; k < chunks.size(); ++k)
+        free_pages(chunks[k].start, chunks[k].size, mode);
+}
+
+void* PageArena::allocate(std::size_t bytes, std::size_t alignment)
+{
+    std::uintptr_t aligned = (reinterpret_cast<std::uintptr_t>(next) +
+        alignment - 1) / alignment * alignment;
+    if (!next || aligned + bytes > reinterpret_cast<std::uintptr_t>(end))
+    {
+        chunk_t chunk;
+        chunk.size = std::max(ARENA_CHUNK_SIZE,
+            round_to_huge_pages(bytes + alignment));
+        chunk.start = static_cast<char*>(allocate_pages(chunk.size, mode));
+        chunks.push_back(chunk);
+        next = chunk.start;
+        end = chunk.start + chunk.size;
+        aligned = (reinterpret_cast<std::uintptr_t>(next) + alignment - 1) /
+            alignment * alignment;
+    }
+    next = reinterpret_cast<char*>(aligned + bytes);
+    return reinterpret_cast<void*>(aligned);
+}
+
+
+NumaTopology const & NumaTopology::host()
+{
+    static NumaTopology topology;
+    return topology;
+}
+
+NumaTopology::NumaTopology() : node_cpus(), cpu_nodes()
+{
+    // node ids can have gaps, so read them from the online list
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string line;
+    if (online && std::getline(online, line))
+    {
+        std::vector<int> nodes = parse_cpu_list(line);
+        for (std::size_t k = 0; k < nodes.size(); ++k)
+        {
+            std::ostringstream path;
+            path << "/sys/devices/system/node/node" << nodes[k] << "/cpulist";
+            std::ifstream fin(path.str().c_str());
+            std::string cpulist;
+            if (fin && std::getline(fin, cpulist))
+            {
+                std::vector<int> cpus = parse_cpu_list(cpulist);
+                // memory only nodes don't run threads
+                if (!cpus.empty())
+                    node_cpus.push_back(cpus);
+            }
+        }
+    }
+
+    for (std::size_t node = 0; node < node_cpus.size(); ++node)
+    {
+        for (std::size_t k = 0; k < node_cpus[node].size(); ++k)
+        {
+            std::size_t cpu = node_cpus[node][k];
+            if (cpu >= cpu_nodes.size())
+                cpu_nodes.resize(cpu + 1, 0);
+            cpu_nodes[cpu] = node;
+        }
+    }
+
+    // no NUMA information: one node with every cpu
+    if (node_cpus.empty())
+        node_cpus.push_back(std::vector<int>());
+}
+
+std::size_t NumaTopology::nnodes() const
+{
+    return node_cpus.size();
+}
+
+std::size_t NumaTopology::current_node() const
+{
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    if (cpu >= 0 && static_cast<std::size_t>(cpu) < cpu_nodes.size())
+        return cpu_nodes[cpu];
+#endif
+    return 0;
+}
+
+bool NumaTopology::bind_thread(std::size_t node) const
+{
+#ifdef __linux__
+    if (node >= node_cpus.size() || node_cpus[node].empty())
+        return false;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (std::size_t k = 0; k < node_cpus[node].size(); ++k)
+        CPU_SET(node_cpus[node][k], &cpus);
+    return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,256 @@
+#ifndef _MLTK_PLACEMENT_H_
+#define _MLTK_PLACEMENT_H_
+
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <exception>
+
+
+/**
+    Where the model weights live in memory.
+
+    Every token looks up weights scattered over tens of MB, so a lot of
+    the time goes to TLB misses and, on multi-socket hosts, to reading
+    memory attached to the other socket.  Models can put their weights
+    in 2MB huge pages (huge_page_mode_t), and NumaReplicas keeps a copy
+    of a read-only model on each NUMA node for the threads running there.
+
+    Everything falls back to ordinary memory and a single copy when huge
+    pages or NUMA aren't available (or not on Linux).
+*/
+
+/// how the memory for model weights is backed
+enum huge_page_mode_t
+{
+    /// the regular heap
+    HUGE_PAGES_OFF,
+    /// 2MB aligned anonymous memory marked with madvise(MADV_HUGEPAGE)
+    /// for transparent huge pages
+    HUGE_PAGES_THP,
+    /// pages from the hugetlbfs pool (MAP_HUGETLB), or as HUGE_PAGES_THP
+    /// if the pool doesn't have enough
+    HUGE_PAGES_HUGETLB
+};
+
+const std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+/// allocate bytes of memory backed as mode says.  Throws std::bad_alloc
+void* allocate_pages(std::size_t bytes, huge_page_mode_t mode);
+
+/// free memory from allocate_pages with the same bytes and mode
+void free_pages(void* p, std::size_t bytes, huge_page_mode_t mode);
+
+/// a std allocator for allocate_pages, e.g. for a large weight vector
+template <class T>
+class HugePageAllocator
+{
+    public:
+        typedef T value_type;
+
+        explicit HugePageAllocator(huge_page_mode_t mode = HUGE_PAGES_OFF) :
+            mode(mode) {}
+        template <class U>
+        HugePageAllocator(HugePageAllocator<U> const & other) :
+            mode(other.mode) {}
+
+        T* allocate(std::size_t n)
+        {
+            return static_cast<T*>(allocate_pages(n * sizeof(T), mode));
+        }
+        void deallocate(T* p, std::size_t n)
+        {
+            free_pages(p, n * sizeof(T), mode);
+        }
+
+        template <class U>
+        struct rebind { typedef HugePageAllocator<U> other; };
+
+        huge_page_mode_t mode;
+};
+
+template <class T, class U>
+bool operator==(HugePageAllocator<T> const & a, HugePageAllocator<U> const & b)
+{
+    return a.mode == b.mode;
+}
+
+template <class T, class U>
+bool operator!=(HugePageAllocator<T> const & a, HugePageAllocator<U> const & b)
+{
+    return a.mode != b.mode;
+}
+
+/**
+    A bump allocator for data that is built once and then only read, such
+    as the tagger's hash tables.  Consecutive allocations are next to each
+    other in memory (e.g. a hash table node and its weights), and the
+    memory comes from allocate_pages in chunks of a few huge pages.
+    Nothing is freed until the arena is destroyed.
+*/
+class PageArena
+{
+    public:
+        explicit PageArena(huge_page_mode_t mode);
+        ~PageArena();
+
+        void* allocate(std::size_t bytes, std::size_t alignment);
+
+    private:
+        struct chunk_t
+        {
+            char* start;
+            std::size_t size;
+        };
+
+        huge_page_mode_t mode;
+        std::vector<chunk_t> chunks;
+        // the unused part of the last chunk
+        char* next;
+        char* end;
+
+        // disable some default constructors
+        PageArena();
+        PageArena& operator= (const PageArena& other);
+        PageArena(const PageArena& other);
+};
+
+/// a std allocator for a PageArena.  deallocate does nothing
+template <class T>
+class ArenaAllocator
+{
+    public:
+        typedef T value_type;
+
+        explicit ArenaAllocator(PageArena* arena) : arena(arena) {}
+        template <class U>
+        ArenaAllocator(ArenaAllocator<U> const & other) :
+            arena(other.arena) {}
+
+        T* allocate(std::size_t n)
+        {
+            return static_cast<T*>(
+                arena->allocate(n * sizeof(T), alignof(T)));
+        }
+        void deallocate(T*, std::size_t) {}
+
+        template <class U>
+        struct rebind { typedef ArenaAllocator<U> other; };
+
+        PageArena* arena;
+};
+
+template <class T, class U>
+bool operator==(ArenaAllocator<T> const & a, ArenaAllocator<U> const & b)
+{
+    return a.arena == b.arena;
+}
+
+template <class T, class U>
+bool operator!=(ArenaAllocator<T> const & a, ArenaAllocator<U> const & b)
+{
+    return a.arena != b.arena;
+}
+
+
+/**
+    The NUMA nodes of this host and their cpus, from
+    /sys/devices/system/node.  Hosts without NUMA information have a
+    single node.
+*/
+class NumaTopology
+{
+    public:
+        /// the topology of this host, read the first time it's needed
+        static NumaTopology const & host();
+
+        std::size_t nnodes() const;
+
+        /// the node of the cpu the calling thread is running on
+        std::size_t current_node() const;
+
+        /// restrict the calling thread to the cpus of node.  Returns
+        /// false if that isn't possible
+        bool bind_thread(std::size_t node) const;
+
+    private:
+        NumaTopology();
+
+        std::vector<std::vector<int> > node_cpus;
+        // cpu -> node
+        std::vector<std::size_t> cpu_nodes;
+};
+
+/**
+    A copy of a read-only model for each NUMA node.  Each copy is built by
+    factory on a thread bound to its node, so the kernel's first touch
+    policy puts its memory on that node.  Threads use the copy for the
+    node they run on, ideally after NumaTopology::bind_thread.
+
+    With replicate false, or on a single node host, there is one copy
+    built on the calling thread.
+*/
+template <class T>
+class NumaReplicas
+{
+    public:
+        NumaReplicas(std::function<T*()> factory, bool replicate) :
+            replicas()
+        {
+            NumaTopology const & topology = NumaTopology::host();
+            if (!replicate || topology.nnodes() == 1)
+            {
+                replicas.push_back(std::unique_ptr<T>(factory()));
+                return;
+            }
+
+            replicas.resize(topology.nnodes());
+            for (std::size_t node = 0; node < replicas.size(); ++node)
+            {
+                std::exception_ptr error;
+                std::thread builder([&]()
+                {
+                    try
+                    {
+                        topology.bind_thread(node);
+                        replicas[node].reset(factory());
+                    }
+                    catch (...)
+                    {
+                        error = std::current_exception();
+                    }
+                });
+                builder.join();
+                if (error)
+                    std::rethrow_exception(error);
+            }
+        }
+
+        /// the number of copies
+        std::size_t size() const { return replicas.size(); }
+
+        /// the copy for node
+        T& replica(std::size_t node) const
+        {
+            return *replicas[node % replicas.size()];
+        }
+
+        /// the copy for the node the calling thread is running on
+        T& local() const
+        {
+            if (replicas.size() == 1)
+                return *replicas[0];
+            return replica(NumaTopology::host().current_node());
+        }
+
+    private:
+        std::vector<std::unique_ptr<T> > replicas;
+
+        // disable some default constructors
+        NumaReplicas& operator= (const NumaReplicas& other);
+        NumaReplicas(const NumaReplicas& other);
+};
+
+#endif // _MLTK_PLACEMENT_H_
@@ -0,0 +1,225 @@
+
+#include "_scheduler.h"
+
+
+WorkStealingPool::WorkStealingPool(std::size_t nthreads) :
+    nstealable(0), stopping(false)
+{
+    if (nthreads == 0)
+        nthreads = std::max(1u, std::thread::hardware_concurrency());
+    for (std::size_t k = 0; k < nthreads; ++k)
+        queues.push_back(std::unique_ptr<queue_t>(new queue_t()));
+    // the callers of run are thread 0
+    for (std::size_t k = 1; k < nthreads; ++k)
+        workers.push_back(std::thread(&WorkStealingPool::work, this, k));
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    started.notify_all();
+    for (std::size_t k = 0; k < workers.size(); ++k)
+        workers[k].join();
+}
+
+void WorkStealingPool::run(std::size_t ntasks, task_t const & task,
+    bool steal)
+{
+    if (ntasks == 0)
+        return;
+
+    // not worth waking the other threads
+    if (ntasks == 1 || workers.empty())
+    {
+        for (std::size_t k = 0; k < ntasks; ++k)
+            task(k);
+        return;
+    }
+
+    batch_t batch;
+    batch.task = &task;
+    batch.steal = steal;
+    batch.remaining.store(ntasks);
+
+    std::size_t nqueues = queues.size();
+    for (std::size_t k = 0; k < nqueues; ++k)
+    {
+        queue_t& queue = *queues[k];
+        std::lock_guard<std::mutex> queue_guard(queue.lock);
+        std::size_t first = k * ntasks / nqueues;
+        std::size_t last = (k + 1) * ntasks / nqueues;
+        for (std::size_t j = first; j < last; ++j)
+        {
+            entry_t entry = {&batch, j};
+            queue.tasks.push_back(entry);
+        }
+        queue.ntasks.fetch_add(last - first);
+        if (steal)
+            nstealable.fetch_add(last - first);
+    }
+    {
+        // so a worker can't miss the tasks between checking for them and
+        // waiting
+        std::lock_guard<std::mutex> guard(lock);
+    }
+    started.notify_all();
+
+    // run tasks (of this batch or another) until this batch's are all
+    // taken, then wait for the other threads to finish them
+    entry_t entry;
+    while (batch.remaining.load() > 0 && next(0, entry))
+        execute(entry);
+
+    std::unique_lock<std::mutex> guard(lock);
+    while (batch.remaining.load() > 0)
+        finished.wait(guard);
+    if (batch.error)
+        std::rethrow_exception(batch.error);
+}
+
+void WorkStealingPool::work(std::size_t id)
+{
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while (!stopping && !has_task(id))
+                started.wait(guard);
+            if (stopping)
+                return;
+        }
+
+        entry_t entry;
+        while (next(id, entry))
+            execute(entry);
+    }
+}
+
+bool WorkStealingPool::has_task(std::size_t id) const
+{
+    return queues[id]->ntasks.load() > 0 || nstealable.load() > 0;
+}
+
+bool WorkStealingPool::next(std::size_t id, entry_t& entry)
+{
+    {
+        queue_t& own = *queues[id];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tasks.empty())
+        {
+            entry = own.tasks.front();
+            own.tasks.pop_front();
+            own.ntasks.fetch_sub(1);
+            if (entry.batch->steal)
+                nstealable.fetch_sub(1);
+            return true;
+        }
+    }
+    if (nstealable.load() == 0)
+        return false;
+
+    // take the last task that can be stolen of the next thread that has
+    // any left
+    for (std::size_t k = 1; k < queues.size(); ++k)
+    {
+        queue_t& other = *queues[(id + k) % queues.size()];
+        std::lock_guard<std::mutex> guard(other.lock);
+        for (std::size_t j = other.tasks.size(); j > 0; --j)
+        {
+            if (other.tasks[j - 1].batch->steal)
+            {
+                entry = other.tasks[j - 1];
+                other.tasks.erase(other.tasks.begin() + (j - 1));
+                other.ntasks.fetch_sub(1);
+                nstealable.fetch_sub(1);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::execute(entry_t const & entry)
+{
+    batch_t& batch = *entry.batch;
+    try
+    {
+        (*batch.task)(entry.task);
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!batch.error)
+            batch.error = std::current_exception();
+    }
+
+    // the caller of run may return as soon as remaining is 0, so the
+    // batch mustn't be used after this
+    if (batch.remaining.fetch_sub(1) == 1)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        finished.notify_all();
+    }
+}
+
+
+DocumentScheduler::DocumentScheduler(std::size_t nthreads,
+    schedule_options_t const & options) :
+    schedule(options), pool(nthreads)
+{
+    schedule.overlap = std::max<std::size_t>(schedule.overlap, 2);
+}
+
+void DocumentScheduler::plan(std::vector<std::size_t> const & lengths,
+    std::vector<piece_t>& pieces, std::vector<std::size_t>& tasks) const
+{
+    // the features look this many words ahead
+    static const std::size_t LOOKAHEAD = 2;
+    std::size_t task_tokens = schedule.task_tokens;
+
+    pieces.clear();
+    tasks.clear();
+    tasks.push_back(0);
+    std::size_t ntokens = 0;
+    for (std::size_t s = 0; s < lengths.size(); ++s)
+    {
+        std::size_t length = lengths[s];
+        if (task_tokens > 0 && length > task_tokens)
+        {
+            // a task for each piece, of about equal lengths
+            if (pieces.size() > tasks.back())
+                tasks.push_back(pieces.size());
+            std::size_t npieces = (length + task_tokens - 1) / task_tokens;
+            for (std::size_t j = 0; j < npieces; ++j)
+            {
+                piece_t piece;
+                piece.sentence = s;
+                piece.begin = j * length / npieces;
+                piece.end = (j + 1) * length / npieces;
+                piece.first = piece.begin > schedule.overlap ?
+                    piece.begin - schedule.overlap : 0;
+                piece.last = std::min(length, piece.end + LOOKAHEAD);
+                pieces.push_back(piece);
+                tasks.push_back(pieces.size());
+            }
+            ntokens = 0;
+            continue;
+        }
+
+        // whole sentences, grouped up to task_tokens
+        if (pieces.size() > tasks.back() &&
+                (task_tokens == 0 || ntokens + length > task_tokens))
+        {
+            tasks.push_back(pieces.size());
+            ntokens = 0;
+        }
+        piece_t piece = {s, 0, 0, length, length};
+        pieces.push_back(piece);
+        ntokens += length;
+    }
+    if (pieces.size() > tasks.back())
+        tasks.push_back(pieces.size());
+}
@@ -0,0 +1,281 @@
+#ifndef _MLTK_SCHEDULER_H_
+#define _MLTK_SCHEDULER_H_
+
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <algorithm>
+
+#include "_utils.h"
+
+
+/**
+    A fixed pool of threads that runs batches of tasks.  The tasks are
+    dealt out in contiguous blocks, one per thread (including the thread
+    calling run), and a thread that runs out of tasks steals from the end
+    of another thread's block.  So a few slow tasks don't leave the other
+    threads idle while one thread works through its block.
+
+    Batches run from several threads at once share the queues: each
+    thread works through its queue in order, whichever batch the tasks
+    are from, and the callers of run all take the tasks in queue 0.
+*/
+class WorkStealingPool
+{
+    public:
+        typedef std::function<void(std::size_t)> task_t;
+
+        /// nthreads threads in all, counting the caller of run.  0 is one
+        /// per core
+        explicit WorkStealingPool(std::size_t nthreads);
+
+        /// stops the threads
+        ~WorkStealingPool();
+
+        std::size_t nthreads() const { return queues.size(); }
+
+        /**
+            Call task(k) for k in [0, ntasks) on the pool's threads and
+            the calling thread, and return once they've all finished.
+            Without steal each thread only runs its own block.  Rethrows
+            the first exception a task threw, after all the tasks have run.
+            Can be called from several threads at once, but not from a task
+        */
+        void run(std::size_t ntasks, task_t const & task, bool steal = true);
+
+    private:
+        /// a call to run
+        struct batch_t
+        {
+            task_t const * task;
+            bool steal;
+            std::atomic<std::size_t> remaining;
+            std::exception_ptr error;
+        };
+
+        /// task of batch
+        struct entry_t
+        {
+            batch_t* batch;
+            std::size_t task;
+        };
+
+        struct queue_t
+        {
+            std::mutex lock;
+            std::deque<entry_t> tasks;
+            // tasks.size(), for waiting on without the queue's lock
+            std::atomic<std::size_t> ntasks;
+
+            queue_t() : ntasks(0) {}
+        };
+
+        std::vector<std::unique_ptr<queue_t> > queues;
+        std::vector<std::thread> workers;
+
+        // the queued tasks of batches that can be stolen
+        std::atomic<std::size_t> nstealable;
+
+        std::mutex lock;
+        std::condition_variable started;
+        std::condition_variable finished;
+        bool stopping;
+
+        /// the body of worker thread id (> 0)
+        void work(std::size_t id);
+
+        /// true if thread id has a task it can take
+        bool has_task(std::size_t id) const;
+
+        /// the next task for thread id, from its own queue or stolen
+        bool next(std::size_t id, entry_t& entry);
+
+        /// run a task and count it as done
+        void execute(entry_t const & entry);
+
+        // disable some default constructors
+        WorkStealingPool();
+        WorkStealingPool& operator= (const WorkStealingPool& other);
+        WorkStealingPool(const WorkStealingPool& other);
+};
+
+
+/// how DocumentScheduler splits a document into tasks
+struct schedule_options_t
+{
+    /// the tokens in a task: short sentences are grouped into tasks of
+    /// about this many tokens and longer ones are split into pieces of
+    /// about this many.  0 makes one task for each sentence, unsplit
+    std::size_t task_tokens;
+    /// the words labelled before each piece of a split sentence to pick
+    /// up the history the piece starts with, at least 2
+    std::size_t overlap;
+    /// threads that run out of tasks take other threads' tasks
+    bool steal;
+
+    schedule_options_t() : task_tokens(512), overlap(8), steal(true) {}
+};
+
+/**
+    Tags a document on a WorkStealingPool, as token balanced tasks.
+
+    Tagging a document one sentence per task leaves most of the threads
+    idle when one sentence is much longer than the rest, as web pages'
+    tables and lists often are, and makes a padded context the size of
+    the whole sentence.  So sentences longer than task_tokens are cut
+    into pieces that are tagged independently, each with overlap words
+    before it and the 2 words after it (the models' features look 2 words
+    either side) as context.
+
+    The taggers are greedy, so a piece has the same labels as tagging the
+    whole sentence once it is tagging from the same history, the labels
+    of the two words before it.  These are checked once the pieces are
+    done: if a piece's labels for those words differ from the previous
+    piece's, the rest of the sentence is tagged again from the start of
+    the previous piece (whose labels are already right), so the results
+    are always exactly those of TaggerBase::tag_sentences.  This needs
+    the labels to determine the history, which they do for the tagger
+    and chunker.
+
+    The sentence cache isn't used.
+*/
+class DocumentScheduler
+{
+    public:
+        DocumentScheduler(std::size_t nthreads,
+            schedule_options_t const & options = schedule_options_t());
+
+        schedule_options_t const & options() const { return schedule; }
+
+        /// the number of threads, counting the caller's
+        std::size_t nthreads() const { return pool.nthreads(); }
+
+        /**
+            Tag a document like tagger.tag_sentences.  Returns the number
+            of split sentences that had to be tagged again because a
+            piece didn't pick up the right history (a larger overlap
+            makes this rarer)
+        */
+        template <class TIN, class TOUT>
+        std::size_t tag_sentences(TaggerBase<TIN, TOUT> const & tagger,
+            std::vector<std::vector<TIN> > const & document,
+            std::vector<std::vector<TOUT> >& tags);
+
+        /// words [first, last) of sentence are tagged for a piece, and
+        /// the labels of [begin, end) are kept
+        struct piece_t
+        {
+            std::size_t sentence;
+            std::size_t first;
+            std::size_t begin;
+            std::size_t end;
+            std::size_t last;
+        };
+
+        /// split sentences with the given lengths into pieces, in document
+        /// order, and group them into tasks: task k is pieces
+        /// [tasks[k], tasks[k + 1])
+        void plan(std::vector<std::size_t> const & lengths,
+            std::vector<piece_t>& pieces,
+            std::vector<std::size_t>& tasks) const;
+
+    private:
+        schedule_options_t schedule;
+        WorkStealingPool pool;
+
+        // disable some default constructors
+        DocumentScheduler();
+        DocumentScheduler& operator= (const DocumentScheduler& other);
+        DocumentScheduler(const DocumentScheduler& other);
+};
+
+
+template <class TIN, class TOUT>
+std::size_t DocumentScheduler::tag_sentences(
+    TaggerBase<TIN, TOUT> const & tagger,
+    std::vector<std::vector<TIN> > const & document,
+    std::vector<std::vector<TOUT> >& tags)
+{
+    std::vector<std::size_t> lengths;
+    lengths.reserve(document.size());
+    for (std::size_t s = 0; s < document.size(); ++s)
+        lengths.push_back(document[s].size());
+
+    std::vector<piece_t> pieces;
+    std::vector<std::size_t> tasks;
+    plan(lengths, pieces, tasks);
+
+    // whole sentences go straight into tags, each split sentence's
+    // pieces are put together afterwards
+    tags.clear();
+    tags.resize(document.size());
+    std::vector<std::vector<TOUT> > labelled(pieces.size());
+    pool.run(tasks.size() - 1, [&](std::size_t task)
+    {
+        std::vector<TIN> words;
+        for (std::size_t p = tasks[task]; p < tasks[task + 1]; ++p)
+        {
+            piece_t const & piece = pieces[p];
+            std::vector<TIN> const & sentence = document[piece.sentence];
+            if (piece.begin == 0 && piece.end == sentence.size())
+            {
+                tags[piece.sentence] = tagger.tag_sentence(sentence);
+                continue;
+            }
+            words.assign(sentence.begin() + piece.first,
+                sentence.begin() + piece.last);
+            labelled[p] = tagger.tag_sentence(words);
+        }
+    }, schedule.steal);
+
+    std::size_t nretagged = 0;
+    for (std::size_t p = 0; p < pieces.size(); ++p)
+    {
+        piece_t const & piece = pieces[p];
+        std::vector<TIN> const & sentence = document[piece.sentence];
+        if (piece.begin == 0 && piece.end == sentence.size())
+            continue;
+
+        std::vector<TOUT>& sentence_tags = tags[piece.sentence];
+        if (piece.begin > 0)
+        {
+            // the labels of the two words before the piece are the
+            // history it was tagged from
+            bool same_history = true;
+            for (std::size_t i = piece.begin >= 2 ? piece.begin - 2 : 0;
+                    i < piece.begin; ++i)
+                same_history = same_history &&
+                    labelled[p][i - piece.first] == sentence_tags[i];
+
+            if (!same_history)
+            {
+                piece_t const & previous = pieces[p - 1];
+                std::vector<TIN> words(sentence.begin() + previous.first,
+                    sentence.end());
+                std::vector<TOUT> rest = tagger.tag_sentence(words);
+                sentence_tags.insert(sentence_tags.end(),
+                    rest.begin() + (piece.begin - previous.first), rest.end());
+                ++nretagged;
+
+                // skip the sentence's other pieces
+                while (p + 1 < pieces.size() &&
+                        pieces[p + 1].sentence == piece.sentence)
+                    ++p;
+                continue;
+            }
+        }
+        sentence_tags.insert(sentence_tags.end(),
+            labelled[p].begin() + (piece.begin - piece.first),
+            labelled[p].begin() + (piece.end - piece.first));
+    }
+    return nretagged;
+}
+
+#endif // _MLTK_SCHEDULER_H_
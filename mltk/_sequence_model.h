@@ -0,0 +1,436 @@
+#ifndef _MLTK_SEQUENCE_MODEL_H_
+#define _MLTK_SEQUENCE_MODEL_H_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <future>
+#include <chrono>
+#include <stdexcept>
+#include <algorithm>
+#include <utility>
+
+
+/**
+    A greedy left to right linear sequence labeller: each word's label is
+    the best class of the sum of the weights of its features, given the
+    labels already chosen for the words before it.  The POS tagger and
+    the NP chunker are both instances.
+
+    Everything that differs between models is in the SPEC class, known at
+    compile time, so each instance has fixed loop bounds and its weight
+    lookups inlined:
+
+        NCLASSES, NFEATURES (static const std::size_t) - the number of
+            classes and feature templates.  Feature k comes from template k
+        EARLY_EXIT_INTERVAL (static const std::size_t) - features between
+            margin checks for early exit
+        features_t, context_t - the features of a word and the per
+            sentence context they are made from
+        delta_t - online updates to the weights, with add_bias(scores),
+            add_weights(k, feature, scores) and
+            update(features, truth, guess)
+        constraint_t - which class sequences are allowed, with static
+            best(scores, prev), the best class that can follow prev, and
+            margin(scores, prev), its lead over the next best
+        label_t - the output label type
+
+        start(prev, prev2) - the history before the first word
+        context(sentence, context) - the context for a sentence
+        word(sentence, i, buffer) - the i'th word as a std::string
+        fixed_label(word, label) - true if word always has label
+        features(i, word, context, prev, prev2, features) - the features
+            for the i'th word given the previous two labels
+        bias(scores) - set scores to the bias weights
+        add_weights(k, feature, scores) - add the weights of feature k
+        bound(k) - the most feature k can change the difference between
+            two class scores
+        output(label) - a class index (or fixed label) as a label_t
+
+    Labels are std::size_t class indices.  Fixed labels can be any other
+    value SPEC understands (e.g. tags that aren't model classes).
+
+    The SPEC is immutable, so one can be shared by any number of models
+    (with their own early exit settings), e.g. from a ModelRegistry.  It
+    can also be given as a future that is still loading, in which case
+    the first method that needs it waits for it.
+
+    The scratch memory for labelling a sentence (the context, features
+    and a token buffer) is in a workspace_t that is reused from sentence
+    to sentence, by default one per thread.  Once it has grown to fit the
+    longest words and sentences, labelling doesn't allocate.
+*/
+template <class SPEC>
+class LinearSequenceModel
+{
+    public:
+        static const std::size_t NCLASSES = SPEC::NCLASSES;
+        static const std::size_t NFEATURES = SPEC::NFEATURES;
+
+        typedef typename SPEC::features_t features_t;
+        typedef typename SPEC::context_t context_t;
+        typedef typename SPEC::delta_t delta_t;
+        typedef typename SPEC::constraint_t constraint_t;
+        typedef typename SPEC::label_t label_t;
+
+        /// the scratch memory for labelling one sentence at a time
+        struct workspace_t
+        {
+            context_t context;
+            features_t features;
+            // token_ref_t tokens are copied here for the map lookups
+            std::string buffer;
+        };
+
+        /// the calling thread's workspace for this SPEC
+        static workspace_t& local_workspace();
+
+        typedef std::shared_ptr<const SPEC> model_t;
+        typedef std::shared_future<model_t> pending_model_t;
+
+        /// label with model, which can be shared with other instances
+        explicit LinearSequenceModel(model_t model);
+
+        /// label with model once it has loaded.  If it has already loaded
+        /// this is the same as the constructor above, and if it has
+        /// already failed this throws the load error
+        explicit LinearSequenceModel(pending_model_t model);
+
+        /// the model definition.  Waits for the model to load and throws
+        /// the load error if it failed
+        SPEC const & spec() const;
+
+        /// the model definition, as shared with any other instances
+        model_t shared_spec() const;
+
+        /// true once the model has loaded, without waiting
+        bool loaded() const;
+
+        /// wait for the model to load.  Returns false instead of throwing
+        /// if it failed
+        bool wait() const;
+
+        /// label a sentence, appending the labels to labels.  delta (if
+        /// not NULL) is added to the weights.  Uses local_workspace()
+        template <class SENTENCE>
+        void label(SENTENCE const & sentence, delta_t const * delta,
+            std::vector<label_t>& labels) const;
+
+        /// label with the caller's workspace
+        template <class SENTENCE>
+        void label(SENTENCE const & sentence, delta_t const * delta,
+            std::vector<label_t>& labels, workspace_t& workspace) const;
+
+        /// label a sentence with delta added to the weights, making the
+        /// perceptron update to delta for each label that isn't gold.
+        /// Words with fixed labels aren't learned.  Returns the number of
+        /// wrong labels
+        template <class SENTENCE>
+        std::size_t learn(SENTENCE const & sentence,
+            std::vector<std::size_t> const & gold, delta_t& delta) const;
+
+        /// the best class for a word's features that can follow prev
+        std::size_t predict(features_t const & features, std::size_t prev,
+            delta_t const * delta) const;
+
+        /**
+            Approximate prediction: look up the features in order of how
+            much they can change the scores and stop once the leading
+            class can't be overtaken by the rest, i.e. when its margin is
+            more than bound_scale times the sum of the remaining bounds.
+
+            With bound_scale 1 the predictions only change through float
+            rounding; smaller values stop sooner and are less accurate.
+            0 (the default) disables it.  Not used with a delta
+        */
+        void set_early_exit(float bound_scale);
+
+    private:
+        // the model is set (with the feature order) once by whichever
+        // thread first needs it, and published by storing ready
+        mutable pending_model_t pending;
+        mutable model_t model;
+        mutable std::atomic<const SPEC*> ready;
+        mutable std::mutex load_lock;
+
+        // the feature templates in descending order of their bounds, and
+        // the sum of the bounds from each position in that order to the end
+        mutable std::array<std::size_t, NFEATURES> feature_order;
+        mutable std::array<float, NFEATURES + 1> remaining_bound;
+        std::atomic<float> bound_scale;
+
+        /// wait for pending and set the model from it
+        SPEC const & load() const;
+
+        /// set the model and the feature order.  Needs load_lock (or the
+        /// constructor)
+        void set_model(model_t loaded_model) const;
+
+        /// the shared decode loop.  Calls visit(i, label, features) for
+        /// each word, with features NULL for fixed labels
+        template <class SENTENCE, class VISIT>
+        void decode(SENTENCE const & sentence, delta_t const * delta,
+            workspace_t& workspace, VISIT visit) const;
+
+        // disable some default constructors
+        LinearSequenceModel();
+        LinearSequenceModel& operator= (const LinearSequenceModel& other);
+        LinearSequenceModel(const LinearSequenceModel& other);
+};
+
+
+/// the constraint for models where any class can follow any other:
+/// the first class with the highest score
+template <std::size_t NCLASSES>
+struct no_constraint_t
+{
+    static std::size_t best(float const * scores, std::size_t)
+    {
+        float max_score = -1.0e20;
+        std::size_t chosen_class = 0;
+        for (std::size_t i = 0; i < NCLASSES; ++i)
+        {
+            if (scores[i] > max_score)
+            {
+                max_score = scores[i];
+                chosen_class = i;
+            }
+        }
+        return chosen_class;
+    }
+
+    static float margin(float const * scores, std::size_t)
+    {
+        float max_score = -1.0e20;
+        float second_score = -1.0e20;
+        for (std::size_t i = 0; i < NCLASSES; ++i)
+        {
+            second_score = std::max(second_score,
+                std::min(max_score, scores[i]));
+            max_score = std::max(max_score, scores[i]);
+        }
+        return max_score - second_score;
+    }
+};
+
+
+template <class SPEC>
+LinearSequenceModel<SPEC>::LinearSequenceModel(model_t model) :
+    pending(), model(), ready(NULL), feature_order(), remaining_bound(),
+    bound_scale(0.0)
+{
+    set_model(model);
+}
+
+template <class SPEC>
+LinearSequenceModel<SPEC>::LinearSequenceModel(pending_model_t model) :
+    pending(model), model(), ready(NULL), feature_order(), remaining_bound(),
+    bound_scale(0.0)
+{
+    if (pending.wait_for(std::chrono::seconds(0)) ==
+            std::future_status::ready)
+        load();
+}
+
+template <class SPEC>
+void LinearSequenceModel<SPEC>::set_model(model_t loaded_model) const
+{
+    if (!loaded_model)
+        throw std::invalid_argument("The model is NULL");
+    SPEC const & spec = *loaded_model;
+
+    for (std::size_t k = 0; k < NFEATURES; ++k)
+        feature_order[k] = k;
+    std::stable_sort(feature_order.begin(), feature_order.end(),
+        [&spec](std::size_t a, std::size_t b)
+        { return spec.bound(a) > spec.bound(b); });
+    remaining_bound[NFEATURES] = 0.0;
+    for (std::size_t j = NFEATURES; j > 0; --j)
+        remaining_bound[j - 1] =
+            remaining_bound[j] + spec.bound(feature_order[j - 1]);
+
+    model = loaded_model;
+    // don't keep the load (or its loader) around
+    pending = pending_model_t();
+    ready.store(model.get(), std::memory_order_release);
+}
+
+template <class SPEC>
+SPEC const & LinearSequenceModel<SPEC>::load() const
+{
+    std::lock_guard<std::mutex> guard(load_lock);
+    if (!model)
+    {
+        // get() throws the load error, leaving the model unset so the
+        // next call throws it too
+        set_model(pending.get());
+    }
+    return *model;
+}
+
+template <class SPEC>
+SPEC const & LinearSequenceModel<SPEC>::spec() const
+{
+    SPEC const * loaded_model = ready.load(std::memory_order_acquire);
+    return loaded_model ? *loaded_model : load();
+}
+
+template <class SPEC>
+typename LinearSequenceModel<SPEC>::model_t
+LinearSequenceModel<SPEC>::shared_spec() const
+{
+    spec();
+    return model;
+}
+
+template <class SPEC>
+bool LinearSequenceModel<SPEC>::loaded() const
+{
+    return ready.load(std::memory_order_acquire) != NULL;
+}
+
+template <class SPEC>
+bool LinearSequenceModel<SPEC>::wait() const
+{
+    try
+    {
+        spec();
+        return true;
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
+template <class SPEC>
+typename LinearSequenceModel<SPEC>::workspace_t&
+LinearSequenceModel<SPEC>::local_workspace()
+{
+    static thread_local workspace_t workspace;
+    return workspace;
+}
+
+template <class SPEC>
+void LinearSequenceModel<SPEC>::set_early_exit(float bound_scale)
+{
+    this->bound_scale.store(bound_scale);
+}
+
+template <class SPEC>
+std::size_t LinearSequenceModel<SPEC>::predict(features_t const & features,
+    std::size_t prev, delta_t const * delta) const
+{
+    SPEC const & model = spec();
+    float scores[NCLASSES];
+    model.bias(scores);
+
+    float scale = bound_scale.load(std::memory_order_relaxed);
+    if (scale > 0.0 && !delta)
+    {
+        for (std::size_t j = 0; j < NFEATURES; ++j)
+        {
+            // finding the margin of the leading class costs about as much
+            // as a few lookups, so it's only checked every few features
+            if (j > 0 && j % SPEC::EARLY_EXIT_INTERVAL == 0 &&
+                    constraint_t::margin(scores, prev) >
+                    scale * remaining_bound[j])
+                break;
+            std::size_t k = feature_order[j];
+            model.add_weights(k, features[k], scores);
+        }
+        return constraint_t::best(scores, prev);
+    }
+
+    for (std::size_t k = 0; k < NFEATURES; ++k)
+        model.add_weights(k, features[k], scores);
+
+    // and the updates, if any
+    if (delta)
+    {
+        delta->add_bias(scores);
+        for (std::size_t k = 0; k < NFEATURES; ++k)
+            delta->add_weights(k, features[k], scores);
+    }
+
+    return constraint_t::best(scores, prev);
+}
+
+template <class SPEC>
+template <class SENTENCE, class VISIT>
+void LinearSequenceModel<SPEC>::decode(SENTENCE const & sentence,
+    delta_t const * delta, workspace_t& workspace, VISIT visit) const
+{
+    SPEC const & model = spec();
+    context_t& context = workspace.context;
+    features_t& features = workspace.features;
+    model.context(sentence, context);
+
+    std::size_t prev;
+    std::size_t prev2;
+    model.start(prev, prev2);
+
+    for (std::size_t i = 0; i < sentence.size(); ++i)
+    {
+        std::size_t label;
+        std::string const & word = model.word(sentence, i,
+            workspace.buffer);
+        if (model.fixed_label(word, label))
+        {
+            visit(i, label, static_cast<features_t const *>(NULL));
+        }
+        else
+        {
+            model.features(i, word, context, prev, prev2, features);
+            label = predict(features, prev, delta);
+            visit(i, label, &features);
+        }
+
+        prev2 = prev;
+        prev = label;
+    }
+}
+
+template <class SPEC>
+template <class SENTENCE>
+void LinearSequenceModel<SPEC>::label(SENTENCE const & sentence,
+    delta_t const * delta, std::vector<label_t>& labels) const
+{
+    label(sentence, delta, labels, local_workspace());
+}
+
+template <class SPEC>
+template <class SENTENCE>
+void LinearSequenceModel<SPEC>::label(SENTENCE const & sentence,
+    delta_t const * delta, std::vector<label_t>& labels,
+    workspace_t& workspace) const
+{
+    SPEC const & model = spec();
+    decode(sentence, delta, workspace,
+        [&model, &labels](std::size_t, std::size_t label, features_t const *)
+        { labels.push_back(model.output(label)); });
+}
+
+template <class SPEC>
+template <class SENTENCE>
+std::size_t LinearSequenceModel<SPEC>::learn(SENTENCE const & sentence,
+    std::vector<std::size_t> const & gold, delta_t& delta) const
+{
+    std::size_t mistakes = 0;
+    decode(sentence, &delta, local_workspace(),
+        [&](std::size_t i, std::size_t label, features_t const * features)
+        {
+            if (features && label != gold[i])
+            {
+                delta.update(*features, gold[i], label);
+                ++mistakes;
+            }
+        });
+    return mistakes;
+}
+
+#endif // _MLTK_SEQUENCE_MODEL_H_
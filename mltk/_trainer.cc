@@ -0,0 +1,490 @@
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <exception>
+#include <stdexcept>
+#include <map>
+
+#include "_trainer.h"
+#include "_model_io.h"
+
+
+TrainerShard::TrainerShard(PerceptronTrainer const & trainer) :
+    trainer(trainer), changes(), step(0)
+{
+}
+
+void TrainerShard::add_scores(std::vector<std::size_t> const & rows,
+    std::vector<float>& scores) const
+{
+    for (std::vector<std::size_t>::const_iterator it = rows.begin();
+        it != rows.end(); ++it)
+    {
+        train_row_t const & row = trainer.weights[*it];
+        for (train_row_t::const_iterator w = row.begin(); w != row.end(); ++w)
+            scores[w->label] += w->weight;
+
+        std::unordered_map<std::size_t, train_row_t>::const_iterator got =
+            changes.find(*it);
+        if (got != changes.end())
+        {
+            for (train_row_t::const_iterator w = got->second.begin();
+                w != got->second.end(); ++w)
+                scores[w->label] += w->weight;
+        }
+    }
+}
+
+void TrainerShard::update(std::vector<std::size_t> const & rows,
+    std::size_t truth, std::size_t guess)
+{
+    if (truth == guess)
+        return;
+    for (std::vector<std::size_t>::const_iterator it = rows.begin();
+        it != rows.end(); ++it)
+    {
+        train_row_t& row = changes[*it];
+        update_weight(row, truth, 1.0);
+        update_weight(row, guess, -1.0);
+    }
+}
+
+void TrainerShard::update_weight(train_row_t& row, std::size_t label,
+    float value)
+{
+    train_row_t::iterator w = row.begin();
+    while (w != row.end() && w->label != label)
+        ++w;
+    if (w == row.end())
+    {
+        row.push_back(train_weight_t(label));
+        w = row.end() - 1;
+    }
+
+    // catch up the total for the steps since the weight last changed
+    w->total += double(w->weight) * (step - w->timestamp);
+    w->timestamp = step;
+    w->weight += value;
+}
+
+
+PerceptronTrainer::PerceptronTrainer(std::size_t nrows, std::size_t nclasses) :
+    n_classes(nclasses), weights(nrows), total_steps(0.0)
+{
+}
+
+void PerceptronTrainer::train(std::size_t nexamples,
+    train_fn_t train_example, train_options_t const & options)
+{
+    std::size_t nthreads = std::max<std::size_t>(
+        std::min(options.nthreads, nexamples), 1);
+
+    std::vector<std::size_t> order(nexamples);
+    for (std::size_t k = 0; k < nexamples; ++k)
+        order[k] = k;
+    std::mt19937 rng(options.seed);
+
+    for (std::size_t iteration = 0; iteration < options.niterations;
+        ++iteration)
+    {
+        std::shuffle(order.begin(), order.end(), rng);
+
+        // each thread takes every nthreads'th example of the shuffled data
+        std::vector<TrainerShard> shards(nthreads, TrainerShard(*this));
+        std::vector<std::exception_ptr> errors(nthreads);
+        auto run_shard = [&](std::size_t s)
+        {
+            try
+            {
+                for (std::size_t k = s; k < nexamples; k += nthreads)
+                    train_example(shards[s], order[k]);
+            }
+            catch (...)
+            {
+                errors[s] = std::current_exception();
+            }
+        };
+
+        if (nthreads == 1)
+            run_shard(0);
+        else
+        {
+            std::vector<std::thread> threads;
+            for (std::size_t s = 0; s < nthreads; ++s)
+                threads.push_back(std::thread(run_shard, s));
+            for (std::size_t s = 0; s < nthreads; ++s)
+                threads[s].join();
+        }
+        for (std::size_t s = 0; s < nthreads; ++s)
+        {
+            if (errors[s])
+                std::rethrow_exception(errors[s]);
+        }
+
+        std::vector<TrainerShard*> shard_ptrs;
+        for (std::size_t s = 0; s < nthreads; ++s)
+            shard_ptrs.push_back(&shards[s]);
+        mix(shard_ptrs);
+    }
+}
+
+void PerceptronTrainer::mix(std::vector<TrainerShard*> const & shards)
+{
+    double nshards = shards.size();
+    double mean_steps = 0.0;
+    for (std::size_t s = 0; s < shards.size(); ++s)
+        mean_steps += shards[s]->step / nshards;
+
+    // the shared weights were in every shard for all of its steps
+    for (std::vector<train_row_t>::iterator row = weights.begin();
+        row != weights.end(); ++row)
+    {
+        for (train_row_t::iterator w = row->begin(); w != row->end(); ++w)
+            w->total += w->weight * mean_steps;
+    }
+
+    // then add the average of the shards' changes and their totals
+    for (std::size_t s = 0; s < shards.size(); ++s)
+    {
+        TrainerShard const & shard = *shards[s];
+        std::unordered_map<std::size_t, train_row_t>::const_iterator it;
+        for (it = shard.changes.begin(); it != shard.changes.end(); ++it)
+        {
+            train_row_t& row = weights[it->first];
+            for (train_row_t::const_iterator change = it->second.begin();
+                change != it->second.end(); ++change)
+            {
+                train_row_t::iterator w = row.begin();
+                while (w != row.end() && w->label != change->label)
+                    ++w;
+                if (w == row.end())
+                {
+                    row.push_back(train_weight_t(change->label));
+                    w = row.end() - 1;
+                }
+                double total = change->total +
+                    double(change->weight) * (shard.step - change->timestamp);
+                w->total += total / nshards;
+                w->weight += change->weight / nshards;
+            }
+        }
+    }
+
+    total_steps += mean_steps;
+}
+
+void PerceptronTrainer::averaged_weights(std::size_t row,
+    std::vector<float>& ret) const
+{
+    ret.assign(n_classes, 0.0);
+    if (total_steps == 0.0)
+        return;
+    for (train_row_t::const_iterator w = weights[row].begin();
+        w != weights[row].end(); ++w)
+        ret[w->label] = w->total / total_steps;
+}
+
+
+namespace
+{
+
+/// the words that (nearly) always have the same tag, see train_options_t
+template <class T>
+std::map<std::string, T> frequent_words(
+    std::map<std::string, std::map<T, std::size_t> > const & counts,
+    train_options_t const & options)
+{
+    std::map<std::string, T> ret;
+    typename std::map<std::string, std::map<T, std::size_t> >::const_iterator
+        it;
+    for (it = counts.begin(); it != counts.end(); ++it)
+    {
+        std::size_t n = 0;
+        std::size_t max_count = 0;
+        T mode = T();
+        typename std::map<T, std::size_t>::const_iterator c;
+        for (c = it->second.begin(); c != it->second.end(); ++c)
+        {
+            n += c->second;
+            if (c->second > max_count)
+            {
+                max_count = c->second;
+                mode = c->first;
+            }
+        }
+        if (n >= options.min_count &&
+                double(max_count) / n >= options.min_fraction)
+            ret[it->first] = mode;
+    }
+    return ret;
+}
+
+}
+
+
+void train_tagger(std::vector<std::vector<tag_t> > const & sentences,
+    train_options_t const & options, std::string const & path)
+{
+    // 1.  the specified tags
+    std::map<std::string, std::map<std::string, std::size_t> > counts;
+    for (std::size_t i = 0; i < sentences.size(); ++i)
+    {
+        for (std::size_t j = 0; j < sentences[i].size(); ++j)
+            ++counts[sentences[i][j].first][sentences[i][j].second];
+    }
+    std::map<std::string, std::string> specified_tags =
+        frequent_words(counts, options);
+
+    std::unordered_map<std::string, std::size_t> class_map;
+    for (int k = 0; k < NTAGS; ++k)
+        class_map[POS_TAGS[k]] = k;
+
+    // the model can't predict tags that aren't in POS_TAGS (like the
+    // "(" tag for brackets) so words usually tagged with one are always
+    // given it, however rare they are
+    train_options_t any_count(options);
+    any_count.min_count = 0;
+    any_count.min_fraction = 0.0;
+    std::map<std::string, std::string> most_frequent =
+        frequent_words(counts, any_count);
+    for (std::map<std::string, std::string>::const_iterator it =
+        most_frequent.begin(); it != most_frequent.end(); ++it)
+    {
+        if (class_map.count(it->second) == 0)
+            specified_tags.insert(*it);
+    }
+
+    // 2.  the gold class for each token, or -1 if it has a specified tag
+    std::vector<std::vector<int> > classes(sentences.size());
+    std::vector<std::vector<std::string> > contexts(sentences.size());
+    for (std::size_t i = 0; i < sentences.size(); ++i)
+    {
+        std::vector<std::string> words;
+        for (std::size_t j = 0; j < sentences[i].size(); ++j)
+        {
+            tag_t const & token = sentences[i][j];
+            words.push_back(token.first);
+            if (specified_tags.count(token.first))
+            {
+                classes[i].push_back(-1);
+                continue;
+            }
+            std::unordered_map<std::string, std::size_t>::const_iterator got =
+                class_map.find(token.second);
+            if (got == class_map.end())
+                throw std::invalid_argument("Unknown tag " + token.second +
+                    " for " + token.first);
+            classes[i].push_back(got->second);
+        }
+        get_context(words, contexts[i]);
+    }
+
+    // 3.  index the feature values seen in the training data, one map
+    // per feature template.  Row 0 is the bias
+    std::vector<std::unordered_map<std::string, std::size_t> > rows(NFEATURES);
+    std::size_t nrows = 1;
+    features_t features;
+    for (std::size_t i = 0; i < sentences.size(); ++i)
+    {
+        std::string const * prev = &START;
+        std::string const * prev2 = &START2;
+        for (std::size_t j = 0; j < sentences[i].size(); ++j)
+        {
+            std::string const & word = sentences[i][j].first;
+            if (classes[i][j] >= 0)
+            {
+                get_features(j, word, contexts[i], *prev, *prev2, features);
+                for (int k = 0; k < NFEATURES; ++k)
+                {
+                    if (rows[k].insert(
+                            std::make_pair(features[k], nrows)).second)
+                        ++nrows;
+                }
+            }
+            prev2 = prev;
+            prev = classes[i][j] >= 0 ? &POS_TAGS[classes[i][j]] :
+                &specified_tags[word];
+        }
+    }
+
+    // 4.  train, predicting the previous tags like the tagger does
+    PerceptronTrainer trainer(nrows, NTAGS);
+    auto train_sentence = [&](TrainerShard& shard, std::size_t i)
+    {
+        std::vector<tag_t> const & sentence = sentences[i];
+        features_t features;
+        std::vector<std::size_t> feature_rows;
+        std::vector<float> scores(NTAGS);
+        std::string const * prev = &START;
+        std::string const * prev2 = &START2;
+
+        for (std::size_t j = 0; j < sentence.size(); ++j)
+        {
+            std::string const & word = sentence[j].first;
+            if (classes[i][j] < 0)
+            {
+                prev2 = prev;
+                prev = &specified_tags.find(word)->second;
+                continue;
+            }
+
+            get_features(j, word, contexts[i], *prev, *prev2, features);
+            feature_rows.assign(1, 0);
+            for (int k = 0; k < NFEATURES; ++k)
+            {
+                std::unordered_map<std::string, std::size_t>::const_iterator
+                    got = rows[k].find(features[k]);
+                if (got != rows[k].end())
+                    feature_rows.push_back(got->second);
+            }
+
+            scores.assign(NTAGS, 0.0);
+            shard.add_scores(feature_rows, scores);
+            std::size_t guess = 0;
+            float max_score = -1.0e20;
+            for (int k = 0; k < NTAGS; ++k)
+            {
+                if (scores[k] > max_score)
+                {
+                    max_score = scores[k];
+                    guess = k;
+                }
+            }
+            shard.update(feature_rows, classes[i][j], guess);
+            shard.next_step();
+
+            prev2 = prev;
+            prev = &POS_TAGS[guess];
+        }
+    };
+    trainer.train(sentences.size(), train_sentence, options);
+
+    // 5.  write the averaged weights
+    weights_in_t weights_in(NFEATURES);
+    class_weights_in_t bias_weights_in;
+    std::vector<float> weights;
+    for (int k = 0; k < NFEATURES; ++k)
+    {
+        std::unordered_map<std::string, std::size_t>::const_iterator it;
+        for (it = rows[k].begin(); it != rows[k].end(); ++it)
+        {
+            trainer.averaged_weights(it->second, weights);
+            class_weights_in_t class_weights;
+            for (int i = 0; i < NTAGS; ++i)
+            {
+                if (weights[i] != 0.0)
+                    class_weights.push_back(
+                        std::make_pair(POS_TAGS[i], weights[i]));
+            }
+            if (!class_weights.empty())
+                weights_in[k][it->first] = class_weights;
+        }
+    }
+    trainer.averaged_weights(0, weights);
+    for (int i = 0; i < NTAGS; ++i)
+    {
+        if (weights[i] != 0.0)
+            bias_weights_in.push_back(std::make_pair(POS_TAGS[i], weights[i]));
+    }
+
+    write_tagger_model(path, weights_in, bias_weights_in, specified_tags);
+}
+
+
+void train_chunker(std::vector<iob_label_t> const & sentences,
+    train_options_t const & options, std::string const & path)
+{
+    // the classes in the order of the chunker's weights
+    const char classes[N_CLASSES] = {'I', 'O', 'B'};
+
+    // 1.  the labelmap
+    std::map<std::string, std::map<char, std::size_t> > counts;
+    for (std::size_t i = 0; i < sentences.size(); ++i)
+    {
+        for (std::size_t j = 0; j < sentences[i].size(); ++j)
+            ++counts[sentences[i][j].token][sentences[i][j].label];
+    }
+    std::map<std::string, char> labelmap = frequent_words(counts, options);
+
+    // 2.  the gold classes and the contexts
+    std::vector<std::vector<int> > gold(sentences.size());
+    std::vector<std::vector<std::string> > contexts(sentences.size());
+    std::vector<std::vector<std::string> > tag_contexts(sentences.size());
+    for (std::size_t i = 0; i < sentences.size(); ++i)
+    {
+        std::vector<tag_t> sentence;
+        for (std::size_t j = 0; j < sentences[i].size(); ++j)
+        {
+            iob_t const & token = sentences[i][j];
+            sentence.push_back(std::make_pair(token.token, token.tag));
+            char const * got = std::find(classes, classes + N_CLASSES,
+                token.label);
+            if (got == classes + N_CLASSES)
+                throw std::invalid_argument("Invalid IOB label " +
+                    std::string(1, token.label) + " for " + token.token);
+            gold[i].push_back(got - classes);
+        }
+        get_np_context(sentence, contexts[i], tag_contexts[i]);
+    }
+
+    // 3.  train on the hashed features, with the bias in the last row
+    PerceptronTrainer trainer(N_FEATURES + 1, N_CLASSES);
+    auto train_sentence = [&](TrainerShard& shard, std::size_t i)
+    {
+        iob_label_t const & sentence = sentences[i];
+        np_features_t features;
+        std::vector<std::size_t> feature_rows;
+        std::vector<float> scores(N_CLASSES);
+        char last_label = 'O';
+
+        for (std::size_t j = 0; j < sentence.size(); ++j)
+        {
+            std::string const & word = sentence[j].token;
+            std::map<std::string, char>::const_iterator got =
+                labelmap.find(word);
+            if (got != labelmap.end())
+            {
+                last_label = got->second;
+                continue;
+            }
+
+            get_np_features(j, word, contexts[i], tag_contexts[i], features);
+            feature_rows.assign(1, N_FEATURES);
+            for (np_features_t::const_iterator it = features.begin();
+                it != features.end(); ++it)
+                feature_rows.push_back(feature_hash(*it));
+
+            scores.assign(N_CLASSES, 0.0);
+            shard.add_scores(feature_rows, scores);
+            std::size_t guess = 1;
+            float max_score = -1e20;
+            for (std::size_t k = 0; k < N_CLASSES; ++k)
+            {
+                if (scores[k] > max_score &&
+                        !(last_label == 'O' && classes[k] == 'I'))
+                {
+                    max_score = scores[k];
+                    guess = k;
+                }
+            }
+            shard.update(feature_rows, gold[i][j], guess);
+            shard.next_step();
+
+            last_label = classes[guess];
+        }
+    };
+    trainer.train(sentences.size(), train_sentence, options);
+
+    // 4.  write the averaged weights
+    np_weights_t weights_out(BIAS_INDEX + N_CLASSES);
+    std::vector<float> weights;
+    for (std::size_t row = 0; row <= N_FEATURES; ++row)
+    {
+        trainer.averaged_weights(row, weights);
+        std::copy(weights.begin(), weights.end(),
+            weights_out.begin() + row * N_CLASSES);
+    }
+    np_labelmap_in_t labelmap_in(labelmap.begin(), labelmap.end());
+
+    write_chunker_model(path, weights_out, labelmap_in);
+}
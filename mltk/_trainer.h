@@ -0,0 +1,143 @@
+#ifndef _MLTK_TRAINER_H_
+#define _MLTK_TRAINER_H_
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <functional>
+#include <stdint.h>
+
+#include "_ctagger.h"
+#include "_np_chunker.h"
+
+
+/// options for train_tagger and train_chunker
+struct train_options_t
+{
+    std::size_t niterations;    ///< passes over the training data
+    std::size_t nthreads;       ///< training threads, see PerceptronTrainer
+    unsigned int seed;          ///< for shuffling the data each iteration
+
+    // words seen at least min_count times with the same tag (or label)
+    // at least min_fraction of the time always get that tag, like
+    // textblob-aptagger's tag dictionary
+    std::size_t min_count;
+    double min_fraction;
+
+    train_options_t() : niterations(5), nthreads(1), seed(42),
+        min_count(20), min_fraction(0.97) {}
+};
+
+/**
+    Train a POS tagger on sentences of (token, tag) pairs and write it to
+    path in the runtime model format (gzipped if path ends in .gz).
+    Words usually tagged with a tag that isn't in POS_TAGS always get
+    that tag (are specified tags), otherwise the tags must be in POS_TAGS.  Throws std::invalid_argument for bad training data
+    and std::runtime_error if the model can't be written
+*/
+void train_tagger(std::vector<std::vector<tag_t> > const & sentences,
+    train_options_t const & options, std::string const & path);
+
+/**
+    Train a NP chunker on sentences of (token, tag, IOB label) and write it
+    to path in the runtime model format.  The labels must be I, O or B
+*/
+void train_chunker(std::vector<iob_label_t> const & sentences,
+    train_options_t const & options, std::string const & path);
+
+
+/// one class weight, with the state for lazy averaging
+struct train_weight_t
+{
+    std::size_t label;
+    float weight;
+    double total;           ///< sum of the weight over all steps so far
+    uint64_t timestamp;     ///< the step total was last updated
+
+    train_weight_t(std::size_t label) :
+        label(label), weight(0.0), total(0.0), timestamp(0) {}
+};
+
+/// the non zero class weights for one feature
+typedef std::vector<train_weight_t> train_row_t;
+
+class PerceptronTrainer;
+
+/**
+    The weights one training thread updates during an iteration.
+
+    The shard reads the shared weights from the start of the iteration
+    and keeps its own changes to them, so threads don't need to lock.
+    The changes are averaged lazily: each weight remembers the step it
+    last changed and its running total is brought up to date when it
+    changes again, so an update only touches the features involved.
+*/
+class TrainerShard
+{
+    public:
+        explicit TrainerShard(PerceptronTrainer const & trainer);
+
+        /// add the weights for the feature rows to scores (one per class)
+        void add_scores(std::vector<std::size_t> const & rows,
+            std::vector<float>& scores) const;
+
+        /// the usual perceptron update for a wrong prediction
+        void update(std::vector<std::size_t> const & rows,
+            std::size_t truth, std::size_t guess);
+
+        /// call after each training example (token)
+        void next_step() { ++step; }
+
+    private:
+        friend class PerceptronTrainer;
+
+        PerceptronTrainer const & trainer;
+        std::unordered_map<std::size_t, train_row_t> changes;
+        uint64_t step;
+
+        void update_weight(train_row_t& row, std::size_t label, float value);
+};
+
+/**
+    Trains an averaged perceptron with sparse weights for nrows features
+    and nclasses classes.  The model specific code maps each example to
+    feature rows and calls the shard to predict and update.
+
+    With more than one thread this uses iterative parameter mixing: each
+    iteration the shuffled data is split between the threads, each thread
+    trains from the current weights on its part, then the weights are set
+    to the average of the threads' weights.  With one thread it is the
+    usual averaged perceptron.  The averaged weights are the average over
+    all steps of all iterations (mixed the same way).
+*/
+class PerceptronTrainer
+{
+    public:
+        /// trains one example (e.g. sentence) on a shard
+        typedef std::function<void(TrainerShard&, std::size_t)> train_fn_t;
+
+        PerceptronTrainer(std::size_t nrows, std::size_t nclasses);
+
+        /// train on examples 0 .. nexamples - 1
+        void train(std::size_t nexamples, train_fn_t train_example,
+            train_options_t const & options);
+
+        /// the averaged weights for a feature row, one per class
+        void averaged_weights(std::size_t row, std::vector<float>& ret) const;
+
+        std::size_t nclasses() const { return n_classes; }
+
+    private:
+        friend class TrainerShard;
+
+        std::size_t n_classes;
+
+        // the current weights, and the running totals for the averages
+        // (their timestamps aren't used)
+        std::vector<train_row_t> weights;
+        double total_steps;
+
+        void mix(std::vector<TrainerShard*> const & shards);
+};
+
+#endif // _MLTK_TRAINER_H_
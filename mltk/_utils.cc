@@ -1,48 +1,11 @@
 
 #include <string>
 #include <algorithm>
+#include <cctype>
+#include <stdexcept>
 
-#include "../ext/murmur3.c"
-
-
-/**
-    Define an interface for the taggers/chunkers/parsers/etc.
-
-    These are stages of the pipeline that operate on a single sentence,
-    as represented as a list of a templated types.  They have templated
-    types for both input and output types.
-
-    TIN is representation for a single word (e.g. string, (string, POS), etc
-    TOUT is representation for the tagged version of word
-    Subclasses implement tag_sentence(single sentence) and base class
-        tags entire documents by looping over sentences
-*/
-template <class TIN, class TOUT>
-class TaggerBase
-{
-    public:
-        /// tags a single sentence.  Subclasses implement
-        virtual std::vector<TOUT> tag_sentence(std::vector<TIN> const &) = 0;
-
-        /// tag a document as a list of sentences
-        void tag_sentences(std::vector<std::vector<TIN> >& document,
-            std::vector<std::vector<TOUT> >& tags);
-
-    private:
-
-};
-
-template <class TIN, class TOUT>
-void TaggerBase<TIN, TOUT>::tag_sentences(
-    std::vector<std::vector<TIN> >& document,
-    std::vector<std::vector<TOUT> >& tags)
-{
-    tags.clear();
-    tags.reserve(document.size());
-    typename std::vector<std::vector<TIN> >::const_iterator it;
-    for (it = document.begin(); it != document.end(); ++it)
-        tags.push_back(tag_sentence(*it));
-}
+#include "_utils.h"
+#include "../ext/murmur3.h"
 
 
 /// Use murmurhash as a custom hash for the string
@@ -55,7 +18,40 @@ uint64_t murmurhash3(const std::string& key)
     return ret[0];
 }
 
+void check_token_offsets(const int64_t* token_offsets, std::size_t ntokens,
+    std::size_t buffer_length)
+{
+    for (std::size_t k = 0; k < ntokens; ++k)
+    {
+        int64_t start = token_offsets[2 * k];
+        int64_t end = token_offsets[2 * k + 1];
+        if (start < 0 || end < start || end > int64_t(buffer_length))
+            throw std::invalid_argument("token offsets out of range");
+    }
+}
+
+void packed_document_t::check() const
+{
+    check_token_offsets(token_offsets, ntokens, buffer_length);
+
+    if (nsentences > 0 && sentence_offsets[0] != 0)
+        throw std::invalid_argument("sentence offsets must start at 0");
+    for (std::size_t k = 0; k < nsentences; ++k)
+    {
+        if (sentence_offsets[k + 1] < sentence_offsets[k] ||
+                sentence_offsets[k + 1] > int64_t(ntokens))
+            throw std::invalid_argument("sentence offsets out of range");
+    }
+}
+
 std::string normalize(std::string const & word)
+{
+    std::string ret;
+    normalize_into(word, ret);
+    return ret;
+}
+
+void normalize_into(std::string const & word, std::string& out)
 {
     /**< normalize a word.
      - All words are lower cased
@@ -63,10 +59,10 @@ std::string normalize(std::string const & word)
      - Other digits are represented as !DIGITS
     */
     if (word.find("-") != std::string::npos && word[0] != '-')
-        return "!HYPHEN";
+        out.assign("!HYPHEN");
     else if (word.find_first_not_of("0123456789") == std::string::npos &&
         word.length() == 4)
-        return "!YEAR";
+        out.assign("!YEAR");
     else if (
         // positive numbers
         std::isdigit(word[0]) ||
@@ -80,85 +76,68 @@ std::string normalize(std::string const & word)
                 ((word.size() > 2) && word[0] == '-' &&
                     word[1] == '.' && std::isdigit(word[2]))
     )))
-        return "!DIGITS";
+        out.assign("!DIGITS");
     else
     {
-        // lowercase
-        std::string ret;
-        ret.assign(word);
-        std::transform(ret.begin(), ret.end(), ret.begin(), ::tolower);
-        return ret;
+        // lowercase.  tolower is undefined for negative chars, e.g.
+        // UTF-8 bytes
+        out.assign(word);
+        for (std::size_t k = 0; k < out.length(); ++k)
+            out[k] = std::tolower(static_cast<unsigned char>(out[k]));
     }
 }
 
 // a variety of join functions, depending on how many strings to join...
+// No reserve since that can shrink out in older libstdc++, the appends
+// only allocate while out is growing
 const std::string SPACE = " ";
 
-std::string join(std::string& s1, std::string& s2)
+void join_into(std::string const & s1, std::string const & s2,
+    std::string& out)
 {
-    /**< join with a space in the center
-     find the length of the final string, reserve it then append */
-    std::string sout;
-    sout.reserve(s1.length() + s2.length() + 1);
-    sout.append(s1);
-    sout.append(SPACE);
-    sout.append(s2);
-    return sout;
+    /**< join with a space in the center */
+    out.assign(s1);
+    out.append(SPACE);
+    out.append(s2);
 }
 
-std::string join(const char* s1, int n, std::string& s2)
+void join_into(const char* s1, int n, std::string const & s2,
+    std::string& out)
 {
-    /**< join with a space in the center
-     find the length of the final string, reserve it then append */
-    std::string sout;
-    sout.reserve(n + s2.length() + 1);
-    sout.append(s1);
-    sout.append(SPACE);
-    sout.append(s2);
-    return sout;
+    /**< join with a space in the center */
+    out.assign(s1, n);
+    out.append(SPACE);
+    out.append(s2);
 }
 
-std::string join(const char* s1, int n, std::string& s2, std::string& s3)
+void join_into(const char* s1, int n, std::string const & s2,
+    std::string const & s3, std::string& out)
 {
-    /**< join with a space in the center
-     find the length of the final string, reserve it then append */
-    std::string sout;
-    sout.reserve(n + s2.length() + s3.length() + 2);
-    sout.append(s1);
-    sout.append(SPACE);
-    sout.append(s2);
-    sout.append(SPACE);
-    sout.append(s3);
-    return sout;
+    /**< join with a space in the center */
+    out.assign(s1, n);
+    out.append(SPACE);
+    out.append(s2);
+    out.append(SPACE);
+    out.append(s3);
 }
 
-std::string join(const char* s1, int n, std::string& s2, std::string& s3,
-    std::string& s4)
+void join_into(const char* s1, int n, std::string const & s2,
+    std::string const & s3, std::string const & s4, std::string& out)
 {
-    /**< join with a space in the center
-     find the length of the final string, reserve it then append */
-    std::string sout;
-    sout.reserve(n + s2.length() + s3.length() + s4.length() + 3);
-    sout.append(s1);
-    sout.append(SPACE);
-    sout.append(s2);
-    sout.append(SPACE);
-    sout.append(s3);
-    sout.append(SPACE);
-    sout.append(s4);
-    return sout;
+    /**< join with a space in the center */
+    out.assign(s1, n);
+    out.append(SPACE);
+    out.append(s2);
+    out.append(SPACE);
+    out.append(s3);
+    out.append(SPACE);
+    out.append(s4);
 }
 
-std::string join(const char s1, const char& s2)
+void join_into(const char s1, const char& s2, std::string& out)
 {
-    /**< join with a space in the center
-     find the length of the final string, reserve it then append */
-    std::string sout;
-    sout.reserve(3);
-    sout.append(1, s1);
-    sout.append(SPACE);
-    sout.append(1, s2);
-    return sout;
+    /**< join with a space in the center */
+    out.assign(1, s1);
+    out.append(SPACE);
+    out.append(1, s2);
 }
-
-
@@ -0,0 +1,272 @@
+#ifndef _MLTK_UTILS_H_
+#define _MLTK_UTILS_H_
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+
+#include "_cache.h"
+
+
+/// Use murmurhash as a custom hash for the string
+uint64_t murmurhash3(const std::string& key);
+
+inline uint64_t hash_combine(uint64_t seed, uint64_t hash)
+{
+    /// mix the hash of one more element into seed
+    return seed ^ (hash + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+}
+
+inline uint64_t token_hash(std::string const & token)
+{
+    return murmurhash3(token);
+}
+
+inline uint64_t token_hash(std::pair<std::string, std::string> const & token)
+{
+    return hash_combine(murmurhash3(token.first), murmurhash3(token.second));
+}
+
+template <class TIN>
+uint64_t sentence_hash(std::vector<TIN> const & sentence)
+{
+    /// hash an entire sentence of tokens, e.g. for the sentence cache
+    uint64_t ret = sentence.size();
+    typename std::vector<TIN>::const_iterator it;
+    for (it = sentence.begin(); it != sentence.end(); ++it)
+        ret = hash_combine(ret, token_hash(*it));
+    return ret;
+}
+
+
+/// a token stored in place in a larger buffer, e.g. a packed document
+struct token_ref_t
+{
+    const char* data;
+    std::size_t length;
+
+    token_ref_t() : data(NULL), length(0) {}
+    token_ref_t(const char* data, std::size_t length) :
+        data(data), length(length) {}
+    explicit token_ref_t(std::string const & token) :
+        data(token.data()), length(token.length()) {}
+};
+
+/// the token as a std::string, copying it into buffer if needed.  Lets
+/// the same code handle sentences of std::string and token_ref_t
+inline std::string const & token_string(std::string const & token,
+    std::string& buffer)
+{
+    return token;
+}
+
+inline std::string const & token_string(token_ref_t const & token,
+    std::string& buffer)
+{
+    buffer.assign(token.data, token.length);
+    return buffer;
+}
+
+/// copy the token to out, reusing out's memory
+inline void assign_token(std::string const & token, std::string& out)
+{
+    out.assign(token);
+}
+
+inline void assign_token(token_ref_t const & token, std::string& out)
+{
+    out.assign(token.data, token.length);
+}
+
+/**
+    A document packed into one utf-8 buffer plus offset arrays, so it
+    can be passed from Python without making a string for every token.
+
+    Token k is buffer[token_offsets[2k]:token_offsets[2k + 1]] (byte
+    offsets, e.g. from a tokenizer) and sentence j is tokens
+    sentence_offsets[j] to sentence_offsets[j + 1].  Nothing is copied,
+    so the arrays must outlive any calls that use the document.
+*/
+struct packed_document_t
+{
+    const char* buffer;
+    std::size_t buffer_length;
+    const int64_t* token_offsets;
+    std::size_t ntokens;
+    const int64_t* sentence_offsets;
+    std::size_t nsentences;
+
+    /// throws std::invalid_argument if any offsets are out of range
+    void check() const;
+
+    token_ref_t token(std::size_t k) const
+    {
+        return token_ref_t(buffer + token_offsets[2 * k],
+            token_offsets[2 * k + 1] - token_offsets[2 * k]);
+    }
+};
+
+/// check (start, end) offsets for ntokens tokens in a buffer, throws
+/// std::invalid_argument if any are out of range
+void check_token_offsets(const int64_t* token_offsets, std::size_t ntokens,
+    std::size_t buffer_length);
+
+
+/**
+    Define an interface for the taggers/chunkers/parsers/etc.
+
+    These are stages of the pipeline that operate on a single sentence,
+    as represented as a list of a templated types.  They have templated
+    types for both input and output types.
+
+    TIN is representation for a single word (e.g. string, (string, POS), etc
+    TOUT is representation for the tagged version of word
+    Subclasses implement tag_sentence(single sentence) and base class
+        tags entire documents by looping over sentences
+
+    The base class optionally keeps a bounded cache of tagged sentences
+    so that repeated sentences (boilerplate text) are only tagged once.
+    The cache is disabled by default.  It can be reconfigured while
+    other threads are tagging: each tag_sentences call holds the cache it
+    started with, so a replaced cache is freed once the last call using
+    it returns.
+*/
+template <class TIN, class TOUT>
+class TaggerBase
+{
+    public:
+        TaggerBase();
+        virtual ~TaggerBase();
+
+        /// tags a single sentence.  Subclasses implement
+        virtual std::vector<TOUT> tag_sentence(
+            std::vector<TIN> const &) const = 0;
+
+        /// tag a document as a list of sentences
+        void tag_sentences(std::vector<std::vector<TIN> >& document,
+            std::vector<std::vector<TOUT> >& tags) const;
+
+        /// enable the sentence cache with the given number of entries.
+        /// A capacity of 0 disables the cache
+        void set_cache(std::size_t capacity, cache_policy_t policy);
+
+        /// remove all cached sentences and reset the hit/miss counters
+        void clear_cache();
+
+        /// cache statistics.  Everything is 0 if the cache is disabled
+        cache_info_t cache_info() const;
+
+    private:
+        std::shared_ptr<SentenceCache<TIN, TOUT> > cache;
+        // so tagging without a cache doesn't take atomic_load's lock
+        std::atomic<bool> has_cache;
+        // one set_cache at a time, so has_cache matches cache
+        std::mutex cache_lock;
+
+        /// the current cache, or NULL if it's disabled
+        std::shared_ptr<SentenceCache<TIN, TOUT> > current_cache() const;
+
+};
+
+template <class TIN, class TOUT>
+TaggerBase<TIN, TOUT>::TaggerBase() : has_cache(false) {}
+
+template <class TIN, class TOUT>
+TaggerBase<TIN, TOUT>::~TaggerBase() {}
+
+template <class TIN, class TOUT>
+std::shared_ptr<SentenceCache<TIN, TOUT> >
+TaggerBase<TIN, TOUT>::current_cache() const
+{
+    if (!has_cache.load(std::memory_order_acquire))
+        return std::shared_ptr<SentenceCache<TIN, TOUT> >();
+    return std::atomic_load(&cache);
+}
+
+template <class TIN, class TOUT>
+void TaggerBase<TIN, TOUT>::tag_sentences(
+    std::vector<std::vector<TIN> >& document,
+    std::vector<std::vector<TOUT> >& tags) const
+{
+    tags.clear();
+    tags.reserve(document.size());
+    typename std::vector<std::vector<TIN> >::const_iterator it;
+    std::shared_ptr<SentenceCache<TIN, TOUT> > cache = current_cache();
+    if (!cache)
+    {
+        for (it = document.begin(); it != document.end(); ++it)
+            tags.push_back(tag_sentence(*it));
+        return;
+    }
+
+    for (it = document.begin(); it != document.end(); ++it)
+    {
+        uint64_t hash = sentence_hash(*it);
+        uint64_t epoch = cache->epoch();
+        tags.push_back(std::vector<TOUT>());
+        if (!cache->lookup(hash, *it, tags.back()))
+        {
+            tags.back() = tag_sentence(*it);
+            cache->insert(hash, *it, tags.back(), epoch);
+        }
+    }
+}
+
+template <class TIN, class TOUT>
+void TaggerBase<TIN, TOUT>::set_cache(std::size_t capacity,
+    cache_policy_t policy)
+{
+    std::shared_ptr<SentenceCache<TIN, TOUT> > replacement;
+    std::lock_guard<std::mutex> guard(cache_lock);
+    if (capacity > 0)
+        replacement.reset(new SentenceCache<TIN, TOUT>(capacity, policy));
+    std::atomic_store(&cache, replacement);
+    has_cache.store(bool(replacement), std::memory_order_release);
+}
+
+template <class TIN, class TOUT>
+void TaggerBase<TIN, TOUT>::clear_cache()
+{
+    std::shared_ptr<SentenceCache<TIN, TOUT> > cache = current_cache();
+    if (cache)
+        cache->clear();
+}
+
+template <class TIN, class TOUT>
+cache_info_t TaggerBase<TIN, TOUT>::cache_info() const
+{
+    std::shared_ptr<SentenceCache<TIN, TOUT> > cache = current_cache();
+    if (cache)
+        return cache->info();
+
+    cache_info_t ret = {0, 0, 0, 0};
+    return ret;
+}
+
+/// normalize a word before feature extraction
+std::string normalize(std::string const & word);
+
+/// normalize a word into out, which can be word itself.  Reuses out's
+/// memory, so a string kept between calls stops allocating once it's
+/// long enough
+void normalize_into(std::string const & word, std::string& out);
+
+// a variety of join functions, depending on how many strings to join...
+// They join into out, reusing its memory like normalize_into
+extern const std::string SPACE;
+
+void join_into(std::string const & s1, std::string const & s2,
+    std::string& out);
+void join_into(const char* s1, int n, std::string const & s2,
+    std::string& out);
+void join_into(const char* s1, int n, std::string const & s2,
+    std::string const & s3, std::string& out);
+void join_into(const char* s1, int n, std::string const & s2,
+    std::string const & s3, std::string const & s4, std::string& out);
+void join_into(const char s1, const char& s2, std::string& out);
+
+#endif // _MLTK_UTILS_H_
@@ -5,6 +5,8 @@ from libcpp.vector cimport vector
 from libcpp.pair cimport pair
 from libcpp.string cimport string
 from libcpp.map cimport map
+from libcpp.memory cimport shared_ptr
+from libc.stdint cimport int64_t
 
 ctypedef vector[pair[string, float] ] class_weights_in_t
 ctypedef vector[map[string, class_weights_in_t] ] weights_in_t
@@ -12,20 +14,138 @@ ctypedef map[string, string] tagmap_in_t
 ctypedef pair[string, string] tag_t
 
 # wrappers for the C++ classes we'll use
-cdef extern from "_ctagger.cc":
+cdef extern from "_ctagger.h" nogil:
+    ctypedef enum huge_page_mode_t:
+        HUGE_PAGES_OFF
+        HUGE_PAGES_THP
+        HUGE_PAGES_HUGETLB
+    ctypedef enum cache_policy_t:
+        CACHE_LRU
+        CACHE_FIFO
+    ctypedef struct cache_info_t:
+        unsigned long long hits
+        unsigned long long misses
+        size_t size
+        size_t capacity
+
+    ctypedef struct feature_memory_t:
+        string name
+        size_t entries
+        size_t bytes
+        float load_factor
+
+    size_t prune_weights(weights_in_t& weights, size_t max_bytes) except +
+
+    cdef cppclass packed_document_t:
+        const char* buffer
+        size_t buffer_length
+        const int64_t* token_offsets
+        size_t ntokens
+        const int64_t* sentence_offsets
+        size_t nsentences
+        void check() except +
+
+    cdef cppclass tagger_model_t "PerceptronTagger::model_t":
+        pass
+    cdef cppclass pending_tagger_model_t "PerceptronTagger::pending_model_t":
+        pass
+
     cdef cppclass PerceptronTagger:
         PerceptronTagger(
             weights_in_t weights,
             class_weights_in_t bias_weights,
-            tagmap_in_t specified_tags)
+            tagmap_in_t specified_tags,
+            huge_page_mode_t huge_pages) except +
+        PerceptronTagger(pending_tagger_model_t model) except +
+        tagger_model_t shared_model() except +
+        bint model_loaded()
+        bint wait_for_model()
         void tag_sentences(
             vector[vector[string] ]& document,
             vector[vector[tag_t] ]& tags
-        )
+        ) except +
+        void tag_ids(vector[string]& sentence, vector[size_t]& ids) except +
+        void tag_packed(packed_document_t& document,
+            vector[size_t]& ids) except +
+        size_t ntags()
+        string tag_name(size_t id) except +
+        size_t update(vector[string]& sentence,
+            vector[string]& gold_tags) except +
+        void snapshot() except +
+        void reset_updates() except +
+        void get_weights(weights_in_t& weights,
+            class_weights_in_t& bias_weights,
+            tagmap_in_t& specified_tags) except +
+        void set_early_exit(float bound_scale) except +
+        void memory_usage(vector[feature_memory_t]& usage) except +
+        void set_cache(size_t capacity, cache_policy_t policy) except +
+        void clear_cache()
+        cache_info_t cache_info()
+
+cdef extern from "_model_io.h" nogil:
+    ctypedef enum model_load_t:
+        LOAD_NOW
+        LOAD_LAZY
+        LOAD_BACKGROUND
+
+    cdef cppclass model_key_t:
+        string path
+        huge_page_mode_t huge_pages
+
+    cdef cppclass tagger_registry_t:
+        @staticmethod
+        tagger_registry_t& instance()
+        vector[pair[model_key_t, long] ] loaded() except +
+
+    pending_tagger_model_t shared_tagger_model(string path,
+        huge_page_mode_t huge_pages, model_load_t when) except +
+
+    void write_tagger_model(string path, weights_in_t& weights,
+        class_weights_in_t& bias_weights,
+        tagmap_in_t& specified_tags) except +
+
+cdef extern from "_model_handle.h" nogil:
+    cdef cppclass ModelHandle[T]:
+        ModelHandle(T* model)
+        T* acquire(unsigned int& token)
+        void release(unsigned int token)
+        void swap(T* new_model)
+
+ctypedef void (*tag_callback_t)(
+    void* context, vector[tag_t]& result, const char* error) noexcept
+
+cdef extern from "_batch_executor.h" nogil:
+    cdef cppclass TagExecutor "BatchExecutor<PerceptronTagger, std::string, tag_t>":
+        TagExecutor(ModelHandle[PerceptronTagger]& model,
+            size_t max_batch_size, size_t max_delay_us,
+            size_t nthreads) except +
+        void submit(vector[string] sentence, tag_callback_t callback,
+            void* context) except +
+
+cdef extern from "_scheduler.h" nogil:
+    cdef cppclass schedule_options_t:
+        size_t task_tokens
+        size_t overlap
+        bint steal
+
+    cdef cppclass DocumentScheduler:
+        DocumentScheduler(size_t nthreads,
+            schedule_options_t& options) except +
+        size_t nthreads()
+        size_t tag_sentences(PerceptronTagger& tagger,
+            vector[vector[string] ]& document,
+            vector[vector[tag_t] ]& tags) except +
 
 # only need to define C attributes and methods here
 cdef class FastPerceptronTagger:
-    cdef PerceptronTagger *_taggerptr
-    cdef void _tag_sentences(
-        self, vector[vector[string] ]& document, vector[vector[tag_t] ]& tags)
+    cdef ModelHandle[PerceptronTagger] *_handle
+    cdef size_t _cache_capacity
+    cdef cache_policy_t _cache_policy
+    cdef float _bound_scale
+    cdef huge_page_mode_t _huge_pages
+    cdef TagExecutor *_executor
+    cdef shared_ptr[DocumentScheduler] _scheduler
+    cdef PerceptronTagger* _acquire(self, unsigned int& token) except NULL
+    cdef int _tag_sentences(self, vector[vector[string] ]& document,
+        vector[vector[tag_t] ]& tags) except -1
 
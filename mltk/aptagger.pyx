@@ -7,37 +7,145 @@ https://honnibal.wordpress.com/2013/09/11/a-good-part-of-speechpos-tagger-in-abo
 
 # c imports
 cimport cython
+from cpython.ref cimport Py_INCREF, Py_DECREF
 from aptagger cimport *
 
 # python imports
 import os
-import pkgutil
-try:
-    # if faster option is available use it
-    import simplejson as json
-except ImportError:
-    import json
-    
-from gzip import GzipFile
-from StringIO import StringIO
+
+# the model included in mltk
+DEFAULT_MODEL = os.path.join(
+    os.path.dirname(os.path.abspath(__file__)), 'models',
+    'aptagger-0.1.0.json.gz')
+
+# the available sentence cache eviction policies
+CACHE_POLICIES = {'lru': CACHE_LRU, 'fifo': CACHE_FIFO}
+
+# how the memory for the model weights can be backed
+HUGE_PAGE_MODES = {
+    None: HUGE_PAGES_OFF, 'thp': HUGE_PAGES_THP, 'hugetlb': HUGE_PAGES_HUGETLB}
+
+# when a model that isn't already loaded is loaded
+LOAD_MODES = {
+    'now': LOAD_NOW, 'lazy': LOAD_LAZY, 'background': LOAD_BACKGROUND}
+
+cdef PerceptronTagger* _new_tagger(path, huge_page_mode_t huge_pages,
+        model_load_t when) except NULL:
+    '''
+    Construct the C++ class for the model in path (or the default),
+    sharing the weights with every other tagger in the process using the
+    same file
+    '''
+    cdef string model_path = DEFAULT_MODEL if path is None else path
+    return new PerceptronTagger(
+        shared_tagger_model(model_path, huge_pages, when))
+
+def loaded_models():
+    '''
+    The tagger models loaded in this process as a list of
+    (path, huge_pages, references) tuples.  All the taggers for the same
+    model file (and huge_pages) share one copy, which is freed when the
+    last of them is.
+    '''
+    cdef vector[pair[model_key_t, long] ] models = (
+        tagger_registry_t.instance().loaded())
+    cdef size_t k
+    names = {mode: name for name, mode in HUGE_PAGE_MODES.items()}
+    return [(models[k].first.path, names[models[k].first.huge_pages],
+        models[k].second) for k in range(models.size())]
+
+cdef int _pack_document(const unsigned char[::1] buffer,
+        const int64_t[:, ::1] token_offsets,
+        const int64_t[::1] sentence_offsets,
+        packed_document_t& document) except -1:
+    '''
+    Point document at the buffer and offset arrays and check the offsets.
+    Nothing is copied so the arguments must outlive document
+    '''
+    if token_offsets.shape[1] != 2:
+        raise ValueError("token_offsets must have shape (ntokens, 2)")
+    document.buffer = <const char*> &buffer[0] if buffer.shape[0] else NULL
+    document.buffer_length = buffer.shape[0]
+    document.token_offsets = (
+        &token_offsets[0, 0] if token_offsets.shape[0] else NULL)
+    document.ntokens = token_offsets.shape[0]
+    document.sentence_offsets = (
+        &sentence_offsets[0] if sentence_offsets.shape[0] else NULL)
+    document.nsentences = max(sentence_offsets.shape[0] - 1, 0)
+    document.check()
+    return 0
+
+cdef int _check_ntags(PerceptronTagger* tagger) except -1:
+    '''the tag ids are returned as uint8'''
+    if tagger.ntags() > 256:
+        raise ValueError("too many tags for uint8 tag ids")
+    return 0
+
+cdef void _tag_done(void* context, vector[tag_t]& result,
+        const char* error) noexcept with gil:
+    '''BatchExecutor callback, completes the future from submit'''
+    future = <object> context
+    Py_DECREF(future)
+    try:
+        if error != NULL:
+            future.set_exception(RuntimeError(error))
+        else:
+            future.set_result(result)
+    except Exception:
+        pass
 
 cdef class FastPerceptronTagger:
-    def __cinit__(self):
+    def __cinit__(self, model_path=None, huge_pages=None, load='now'):
         '''
         Initialize the tagger.
-        Load the model and construct the C++ class
+        model_path is a gzipped JSON model file, defaults to the model
+        included in mltk.  All the taggers in the process for the same
+        file share one copy of the model.
+        huge_pages puts the model weights in 2MB huge pages to reduce TLB
+        misses, either 'thp' (transparent huge pages) or 'hugetlb' (the
+        hugetlbfs pool, falling back to 'thp').  Off by default.
+        load is when the model is loaded if no other tagger is using it:
+        'now', 'lazy' (when it is first used) or 'background' (starting
+        now in a background thread).  With 'lazy' and 'background' errors
+        loading the model are raised when it is first used.
         '''
-        with GzipFile(
-                fileobj=StringIO(pkgutil.get_data(
-                'mltk', os.path.join('models', 'aptagger-0.1.0.json.gz'))),
-                mode='r') as fin:
-            model_weights = json.load(fin)
-        self._taggerptr = new PerceptronTagger(
-            model_weights['weights'], model_weights['bias_weights'],
-            model_weights['specified_tags'])
+        if huge_pages not in HUGE_PAGE_MODES:
+            raise ValueError("Unknown huge page mode %s" % huge_pages)
+        if load not in LOAD_MODES:
+            raise ValueError("Unknown load mode %s" % load)
+        self._huge_pages = HUGE_PAGE_MODES[huge_pages]
+        self._cache_capacity = 0
+        self._cache_policy = CACHE_LRU
+        self._bound_scale = 0.0
+        self._executor = NULL
+        self._handle = new ModelHandle[PerceptronTagger](
+            _new_tagger(model_path, self._huge_pages, LOAD_MODES[load]))
 
     def __dealloc__(self):
-        del self._taggerptr
+        # the executor threads need the GIL to finish any queued sentences
+        with nogil:
+            del self._executor
+            self._scheduler.reset()
+        del self._handle
+
+    def load_model(self, model_path=None):
+        '''
+        Replace the model with the one in model_path (or the default).
+        The model is loaded before it replaces the old one, unless
+        another tagger is already using it.
+
+        This is safe to call while other threads are tagging: calls
+        that are in progress finish with the old model and new calls use
+        the new model.  The cache, early exit and huge page settings are
+        kept, but the cached sentences are not since they were tagged with
+        the old model.
+        '''
+        cdef PerceptronTagger* tagger = _new_tagger(
+            model_path, self._huge_pages, LOAD_NOW)
+        tagger.set_cache(self._cache_capacity, self._cache_policy)
+        tagger.set_early_exit(self._bound_scale)
+        with nogil:
+            self._handle.swap(tagger)
 
     def tag_sents(self, sentences):
         '''
@@ -60,14 +168,376 @@ cdef class FastPerceptronTagger:
         cdef vector[vector[tag_t] ] tags
         cdef vector[vector[string] ] sentence
         sentence.push_back(tokens)
-        self._taggerptr.tag_sentences(sentence, tags)
+        self._tag_sentences(sentence, tags)
         return tags[0]
 
-    cdef void _tag_sentences(self, vector[vector[string] ]& document,
-                       vector[vector[tag_t] ]& tags):
-        '''forwarding method'''
-        self._taggerptr.tag_sentences(document, tags)
+    def enable_batching(self, max_batch_size=64, max_delay=0.002,
+            nthreads=1):
+        '''
+        Start nthreads background threads for submit().  Sentences
+        submitted concurrently are tagged together in batches of up to
+        max_batch_size, waiting at most max_delay seconds after a
+        sentence is submitted for its batch to fill up.
+        '''
+        self.disable_batching()
+        self._executor = new TagExecutor(self._handle[0], max_batch_size,
+            int(max_delay * 1e6), nthreads)
+
+    def disable_batching(self):
+        '''Stop the background threads after tagging any queued sentences'''
+        cdef TagExecutor* executor = self._executor
+        self._executor = NULL
+        with nogil:
+            del executor
+
+    def enable_threads(self, nthreads=None, task_tokens=512):
+        '''
+        Tag each document given to tag_sents on nthreads threads (by
+        default one per core), for lower latency on large documents.  The
+        sentences are grouped into tasks of about task_tokens tokens, and
+        longer sentences (e.g. tables in web pages) are split into pieces
+        of about that many.  The tags are the same as without threads.
+        Documents tagged from several Python threads at once share the
+        threads, each thread working through its tasks in order.  The
+        cache isn't used.
+        '''
+        cdef schedule_options_t options
+        options.task_tokens = task_tokens
+        self._scheduler.reset(new DocumentScheduler(
+            0 if nthreads is None else nthreads, options))
+
+    def disable_threads(self):
+        '''Stop the threads from enable_threads'''
+        cdef shared_ptr[DocumentScheduler] scheduler
+        # another thread may still be tagging with it
+        self._scheduler.swap(scheduler)
+        with nogil:
+            scheduler.reset()
+
+    def submit(self, tokens):
+        '''
+        Tag a single sentence on the background threads, batched with
+        any other sentences submitted at about the same time, e.g. by
+        other requests in a web service.  Calls enable_batching with the
+        defaults if needed.
+        Returns a concurrent.futures.Future for the result of tag(tokens).
+        From asyncio use
+            tags = await asyncio.wrap_future(tagger.submit(tokens))
+        '''
+        cdef vector[string] sentence = tokens
+        from concurrent.futures import Future
 
+        if self._executor == NULL:
+            self.enable_batching()
+
+        # the future can't be cancelled once it is queued
+        future = Future()
+        future.set_running_or_notify_cancel()
+
+        # the reference is released in _tag_done
+        Py_INCREF(future)
+        self._executor.submit(sentence, _tag_done, <void*> future)
+        return future
+
+    def tag_arrays(self, sentences):
+        '''
+        Tag sentences, returning flat numpy arrays instead of lists of
+        tuples, for numpy based pipelines:
+            tag_ids = uint8 array with the tag id for each token, the
+                tag names are tag_names()[tag_id]
+            sentence_offsets = int64 array of length nsentences + 1.  The
+                tags for sentence j are
+                tag_ids[sentence_offsets[j]:sentence_offsets[j + 1]]
+        Returns (tag_ids, sentence_offsets).  The cache isn't used.
+        '''
+        import numpy as np
+        cdef vector[vector[string] ] document = sentences
+        cdef vector[size_t] ids
+        cdef unsigned int token = 0
+        cdef PerceptronTagger* tagger
+        cdef int64_t[::1] offsets
+        cdef unsigned char[::1] tag_ids
+        cdef size_t j, k, n = 0
+
+        sentence_offsets = np.empty(document.size() + 1, dtype=np.int64)
+        offsets = sentence_offsets
+        offsets[0] = 0
+        for j in range(document.size()):
+            n += document[j].size()
+            offsets[j + 1] = n
+        ret = np.empty(n, dtype=np.uint8)
+        tag_ids = ret
+
+        tagger = self._acquire(token)
+        try:
+            _check_ntags(tagger)
+            with nogil:
+                n = 0
+                for j in range(document.size()):
+                    tagger.tag_ids(document[j], ids)
+                    for k in range(ids.size()):
+                        tag_ids[n] = ids[k]
+                        n += 1
+        finally:
+            self._handle.release(token)
+
+        return ret, sentence_offsets
+
+    def tag_names(self):
+        '''
+        The tag for each tag id returned by tag_arrays.  These depend on
+        the model, so call again after load_model
+        '''
+        cdef unsigned int token = 0
+        cdef PerceptronTagger* tagger = self._acquire(token)
+        cdef size_t k
+        try:
+            return [tagger.tag_name(k) for k in range(tagger.ntags())]
+        finally:
+            self._handle.release(token)
+
+    def tag_packed(self, buffer, token_offsets, sentence_offsets,
+            arrays=False):
+        '''
+        Tag sentences packed in a single buffer.  This skips making a
+        Python and C++ string for every token so is faster than tag_sents
+        if the tokenizer already gives offsets.
+            buffer = the utf-8 encoded text, e.g. bytes
+            token_offsets = int64 array (e.g. numpy) of shape (ntokens, 2)
+                with the (start, end) byte offsets of each token in buffer
+            sentence_offsets = int64 array of length nsentences + 1.
+                Sentence j is tokens sentence_offsets[j]:sentence_offsets[j+1]
+        Returns a list of the tags for each sentence:
+            [['DT', 'JJ', '.'], ['DT', 'NN', '.']]
+        or if arrays is True a uint8 numpy array of the tag ids as in
+        tag_arrays.  The cache isn't used.
+        '''
+        cdef packed_document_t document
+        cdef vector[size_t] ids
+        cdef unsigned int token = 0
+        cdef PerceptronTagger* tagger
+        cdef unsigned char[::1] tag_ids
+        cdef size_t j, k
+
+        _pack_document(buffer, token_offsets, sentence_offsets, document)
+
+        # the tag names must come from the same model as the ids
+        tagger = self._acquire(token)
+        try:
+            with nogil:
+                tagger.tag_packed(document, ids)
+            if arrays:
+                _check_ntags(tagger)
+            else:
+                names = [tagger.tag_name(k) for k in range(tagger.ntags())]
+        finally:
+            self._handle.release(token)
+
+        if arrays:
+            import numpy as np
+            ret = np.empty(ids.size(), dtype=np.uint8)
+            tag_ids = ret
+            with nogil:
+                for k in range(ids.size()):
+                    tag_ids[k] = ids[k]
+            return ret
+
+        ret = []
+        for j in range(document.nsentences):
+            ret.append([names[ids[k]]
+                for k in range(document.sentence_offsets[j],
+                    document.sentence_offsets[j + 1])])
+        return ret
+
+    def update(self, tokens, tags):
+        '''
+        Learn from a correctly tagged sentence, e.g. to fix systematic
+        mistakes on a new domain without retraining.  tokens is a list of
+        tokens and tags their correct tags.  Makes the usual perceptron
+        update for each token the tagger gets wrong, taking the earlier
+        updates into account.  Returns the number of wrong tags.
+
+        The updates are kept on top of the model weights and aren't used
+        for tagging until snapshot() is called.  This is safe to call
+        while other threads are tagging.  Reloading the model discards the
+        updates.
+        '''
+        cdef vector[string] sentence = tokens
+        cdef vector[string] gold_tags = tags
+        cdef unsigned int token = 0
+        cdef PerceptronTagger* tagger = self._acquire(token)
+        try:
+            return tagger.update(sentence, gold_tags)
+        finally:
+            self._handle.release(token)
+
+    def snapshot(self):
+        '''
+        Start tagging with all the updates so far.  Calls in progress
+        finish with the weights they started with.  Clears the cache.
+        '''
+        cdef unsigned int token = 0
+        cdef PerceptronTagger* tagger
+        tagger = self._acquire(token)
+        try:
+            tagger.snapshot()
+        finally:
+            self._handle.release(token)
+
+    def reset_updates(self):
+        '''Discard all the updates and go back to the model weights'''
+        cdef unsigned int token = 0
+        cdef PerceptronTagger* tagger
+        tagger = self._acquire(token)
+        try:
+            tagger.reset_updates()
+        finally:
+            self._handle.release(token)
+
+    def export_model(self, path, max_bytes=None):
+        '''
+        Save the model weights, including the updates in the snapshot, to
+        path as a JSON model that load_model can load, gzipped if path ends
+        in .gz.
+
+        If max_bytes is given the feature weights are pruned to about that
+        much memory once loaded (see memory_usage), removing the feature
+        values with the smallest weights first.
+        '''
+        cdef weights_in_t weights
+        cdef class_weights_in_t bias_weights
+        cdef tagmap_in_t specified_tags
+        cdef unsigned int token = 0
+        cdef PerceptronTagger* tagger
+        tagger = self._acquire(token)
+        try:
+            tagger.get_weights(weights, bias_weights, specified_tags)
+        finally:
+            self._handle.release(token)
+        if max_bytes is not None:
+            prune_weights(weights, max_bytes)
+        write_tagger_model(path, weights, bias_weights, specified_tags)
+
+    def memory_usage(self):
+        '''
+        Returns the memory used by the weights for each feature template,
+        as a list of dicts with the template name, the number of feature
+        values (entries), the estimated bytes and the hash table load
+        factor.  Doesn't include the online updates
+        '''
+        cdef vector[feature_memory_t] usage
+        cdef unsigned int token = 0
+        cdef PerceptronTagger* tagger
+        tagger = self._acquire(token)
+        try:
+            tagger.memory_usage(usage)
+        finally:
+            self._handle.release(token)
+        return usage
+
+    def enable_early_exit(self, bound_scale=1.0):
+        '''
+        Approximate tagging: stop adding up the feature weights for a token
+        once the best tag can't be overtaken by the remaining features.
+        With bound_scale 1 the tags are the same as without it; smaller
+        values stop sooner at some cost in accuracy.  Not used for
+        sentences tagged with online updates.  Clears the cache.
+        '''
+        cdef unsigned int token = 0
+        cdef PerceptronTagger* tagger
+        if bound_scale < 0:
+            raise ValueError("bound_scale must be >= 0")
+        self._bound_scale = bound_scale
+        tagger = self._acquire(token)
+        try:
+            tagger.set_early_exit(self._bound_scale)
+        finally:
+            self._handle.release(token)
+
+    def disable_early_exit(self):
+        self.enable_early_exit(0.0)
+
+    def enable_cache(self, capacity=10000, policy='lru'):
+        '''
+        Cache the tags for up to capacity sentences, so that repeated
+        sentences (e.g. boilerplate text) are only tagged once.
+        policy is the eviction policy, one of 'lru' or 'fifo'.
+        Enabling the cache discards any previously cached sentences.
+        '''
+        cdef unsigned int token = 0
+        cdef PerceptronTagger* tagger
+        if policy not in CACHE_POLICIES:
+            raise ValueError("Unknown cache policy %s" % policy)
+        self._cache_capacity = capacity
+        self._cache_policy = CACHE_POLICIES[policy]
+        tagger = self._acquire(token)
+        try:
+            tagger.set_cache(self._cache_capacity, self._cache_policy)
+        finally:
+            self._handle.release(token)
+
+    def disable_cache(self):
+        self.enable_cache(0)
+
+    def clear_cache(self):
+        '''Remove all cached sentences and reset the hit/miss counters'''
+        cdef unsigned int token = 0
+        cdef PerceptronTagger* tagger
+        tagger = self._acquire(token)
+        try:
+            tagger.clear_cache()
+        finally:
+            self._handle.release(token)
+
+    def cache_info(self):
+        '''
+        Returns a dict with the cache hits, misses, size and capacity
+        '''
+        cdef unsigned int token = 0
+        cdef cache_info_t info
+        cdef PerceptronTagger* tagger
+        tagger = self._acquire(token)
+        try:
+            info = tagger.cache_info()
+        finally:
+            self._handle.release(token)
+        return info
+
+    cdef PerceptronTagger* _acquire(self, unsigned int& token) except NULL:
+        '''
+        self._handle.acquire(token) for methods that use the model.  If
+        the model is still loading this waits for it (without the GIL),
+        and raises the error if it failed to load
+        '''
+        cdef PerceptronTagger* tagger = self._handle.acquire(token)
+        cdef bint loaded = tagger.model_loaded()
+        if not loaded:
+            with nogil:
+                loaded = tagger.wait_for_model()
+            if not loaded:
+                try:
+                    # raises the load error
+                    tagger.shared_model()
+                finally:
+                    self._handle.release(token)
+                raise RuntimeError("The model failed to load")
+        return tagger
+
+    cdef int _tag_sentences(self, vector[vector[string] ]& document,
+                       vector[vector[tag_t] ]& tags) except -1:
+        '''forwarding method.  The GIL is released while tagging'''
+        cdef unsigned int token = 0
+        cdef shared_ptr[DocumentScheduler] scheduler = self._scheduler
+        cdef PerceptronTagger* tagger = self._acquire(token)
+        try:
+            with nogil:
+                if scheduler.get() != NULL:
+                    scheduler.get().tag_sentences(tagger[0], document, tags)
+                else:
+                    tagger.tag_sentences(document, tags)
+        finally:
+            self._handle.release(token)
+        return 0
 
 def _weights_to_vector(weights):
     '''
@@ -0,0 +1,67 @@
+/**
+    C interface to the mltk POS tagger and NP chunker.
+
+    This is a thin wrapper around PerceptronTagger and FastNPChunker
+    for FFI callers and services that don't want to embed Python.
+    Link against libmltk (make lib).
+
+    Tokens and tags are utf-8 encoded, null terminated strings.
+    Functions that can fail return 0 on success and -1 on error, or NULL
+    for the load functions.  mltk_last_error returns a description of the
+    last error in the calling thread.
+
+    A loaded tagger or chunker can be shared between threads without
+    locking.  The reload functions replace the model while other threads
+    are tagging: in-flight calls finish with the old model and later
+    calls use the new one.
+*/
+#ifndef _MLTK_H_
+#define _MLTK_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct mltk_tagger mltk_tagger;
+typedef struct mltk_chunker mltk_chunker;
+
+/// description of the last error in this thread, or "" if none
+const char* mltk_last_error(void);
+
+/// load a POS tagger from a model file, e.g. models/aptagger-0.1.0.json.gz
+mltk_tagger* mltk_tagger_load(const char* path);
+void mltk_tagger_free(mltk_tagger* tagger);
+
+/// replace the tagger's model with the one in path
+int mltk_tagger_reload(mltk_tagger* tagger, const char* path);
+
+/**
+    POS tag a single sentence of ntokens tokens.  On return tags[i]
+    is the tag for tokens[i].  The tag strings are owned by the library
+    and are valid for the lifetime of the process.
+*/
+int mltk_tagger_tag(const mltk_tagger* tagger, const char* const* tokens,
+    size_t ntokens, const char** tags);
+
+/// load a NP chunker from a model file, e.g. models/np_chunker.json.gz
+mltk_chunker* mltk_chunker_load(const char* path);
+void mltk_chunker_free(mltk_chunker* chunker);
+
+/// replace the chunker's model with the one in path
+int mltk_chunker_reload(mltk_chunker* chunker, const char* path);
+
+/**
+    Chunk a single POS tagged sentence.  On return labels[i] is the
+    IOB label ('I', 'O' or 'B') for tokens[i].
+*/
+int mltk_chunker_chunk(const mltk_chunker* chunker,
+    const char* const* tokens, const char* const* tags, size_t ntokens,
+    char* labels);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _MLTK_H_
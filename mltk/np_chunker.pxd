@@ -5,9 +5,10 @@ from libcpp.vector cimport vector
 from libcpp.pair cimport pair
 from libcpp.string cimport string
 from libcpp.map cimport map
+from libc.stdint cimport int64_t
 
 # wrappers for the C++ classes we'll use
-cdef extern from "_np_chunker.cc":
+cdef extern from "_np_chunker.h" nogil:
     ctypedef vector[float] np_weights_t
     ctypedef map[string, char] np_labelmap_in_t
     ctypedef pair[string, string] tag_t
@@ -17,23 +18,131 @@ cdef extern from "_np_chunker.cc":
         char label
     ctypedef vector[iob_t] iob_label_t
     ctypedef vector[tag_t] np_t;
+    ctypedef struct np_span_t:
+        size_t sentence
+        size_t start
+        size_t end
+
+    ctypedef enum huge_page_mode_t:
+        HUGE_PAGES_OFF
+        HUGE_PAGES_THP
+        HUGE_PAGES_HUGETLB
+    ctypedef enum cache_policy_t:
+        CACHE_LRU
+        CACHE_FIFO
+    ctypedef struct cache_info_t:
+        unsigned long long hits
+        unsigned long long misses
+        size_t size
+        size_t capacity
+
+    ctypedef enum np_normalize_t:
+        NP_EXACT
+        NP_LOWERCASE
+        NP_NORMALIZE
+
+    cdef cppclass token_ref_t:
+        const char* data
+        size_t length
+
+    cdef cppclass NounPhraseCounts:
+        NounPhraseCounts()
+        size_t size()
+        token_ref_t phrase(size_t k)
+        size_t count(size_t k)
+
+    cdef cppclass packed_document_t:
+        const char* buffer
+        size_t buffer_length
+        const int64_t* token_offsets
+        size_t ntokens
+        const int64_t* sentence_offsets
+        size_t nsentences
+        void check() except +
+
+    cdef cppclass chunker_model_t "FastNPChunker::model_t":
+        pass
+    cdef cppclass pending_chunker_model_t "FastNPChunker::pending_model_t":
+        pass
 
     cdef cppclass FastNPChunker:
         FastNPChunker(
             np_weights_t weights,
-            np_labelmap_in_t labelmap_in)
+            np_labelmap_in_t labelmap_in,
+            huge_page_mode_t huge_pages) except +
+        FastNPChunker(pending_chunker_model_t model) except +
+        chunker_model_t shared_model() except +
+        bint model_loaded()
+        bint wait_for_model()
         void tag_sentences(
-            vector[vector[tag_t] ]& document, vector[iob_label_t]& iob)
+            vector[vector[tag_t] ]& document,
+            vector[iob_label_t]& iob) except +
         void chunk_sentences(
             vector[vector[tag_t] ]& document,
-            vector[vector[np_t] ] & noun_phrases)
+            vector[vector[np_t] ] & noun_phrases) except +
+        void tag_labels(vector[tag_t]& sentence,
+            vector[char]& labels) except +
+        void chunk_spans(
+            vector[vector[tag_t] ]& document,
+            vector[np_span_t]& spans) except +
+        void tag_packed(packed_document_t& document,
+            packed_document_t& tags, vector[char]& labels) except +
+        void count_noun_phrases(vector[vector[tag_t] ]& document,
+            np_normalize_t normalize, NounPhraseCounts& counts) except +
+        void count_noun_phrases(packed_document_t& document,
+            packed_document_t& tags, np_normalize_t normalize,
+            NounPhraseCounts& counts) except +
+        size_t update(vector[tag_t]& sentence,
+            vector[char]& gold_labels) except +
+        void snapshot() except +
+        void reset_updates() except +
+        void get_weights(np_weights_t& weights,
+            np_labelmap_in_t& labelmap) except +
+        void set_early_exit(float bound_scale) except +
+        void set_cache(size_t capacity, cache_policy_t policy) except +
+        void clear_cache()
+        cache_info_t cache_info()
+
+cdef extern from "_model_io.h" nogil:
+    ctypedef enum model_load_t:
+        LOAD_NOW
+        LOAD_LAZY
+        LOAD_BACKGROUND
+
+    cdef cppclass model_key_t:
+        string path
+        huge_page_mode_t huge_pages
+
+    cdef cppclass chunker_registry_t:
+        @staticmethod
+        chunker_registry_t& instance()
+        vector[pair[model_key_t, long] ] loaded() except +
+
+    pending_chunker_model_t shared_chunker_model(string path,
+        huge_page_mode_t huge_pages, model_load_t when) except +
+
+    void write_chunker_model(string path, np_weights_t& weights,
+        np_labelmap_in_t& labelmap) except +
+
+cdef extern from "_model_handle.h" nogil:
+    cdef cppclass ModelHandle[T]:
+        ModelHandle(T* model)
+        T* acquire(unsigned int& token)
+        void release(unsigned int token)
+        void swap(T* new_model)
 
 # only need to define C attributes and methods here
 cdef class NPChunker:
-    cdef FastNPChunker *_chunkerptr
-    cdef void _tag_sentences(
-        self, vector[vector[tag_t] ]& document, vector[iob_label_t]& iob)
-    cdef void _chunk_sentences(
+    cdef ModelHandle[FastNPChunker] *_handle
+    cdef size_t _cache_capacity
+    cdef cache_policy_t _cache_policy
+    cdef float _bound_scale
+    cdef huge_page_mode_t _huge_pages
+    cdef FastNPChunker* _acquire(self, unsigned int& token) except NULL
+    cdef int _tag_sentences(
+        self, vector[vector[tag_t] ]& document,
+        vector[iob_label_t]& iob) except -1
+    cdef int _chunk_sentences(
         self, vector[vector[tag_t] ]& document,
-        vector[vector[np_t] ] & noun_phrases)
+        vector[vector[np_t] ] & noun_phrases) except -1
 
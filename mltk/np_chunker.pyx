@@ -5,38 +5,117 @@ from np_chunker cimport *
 
 # python imports
 import os
-import pkgutil
-try:
-    # if faster option is available use it
-    import simplejson as json
-except ImportError:
-    import json
 
-from gzip import GzipFile
-from StringIO import StringIO
+# the model included in mltk
+DEFAULT_MODEL = os.path.join(
+    os.path.dirname(os.path.abspath(__file__)), 'models',
+    'np_chunker.json.gz')
+
+# the available sentence cache eviction policies
+CACHE_POLICIES = {'lru': CACHE_LRU, 'fifo': CACHE_FIFO}
+
+# how the memory for the model weights can be backed
+HUGE_PAGE_MODES = {
+    None: HUGE_PAGES_OFF, 'thp': HUGE_PAGES_THP, 'hugetlb': HUGE_PAGES_HUGETLB}
+
+# how count_noun_phrases normalizes the tokens
+NORMALIZE_MODES = {
+    None: NP_EXACT, 'lower': NP_LOWERCASE, 'normalize': NP_NORMALIZE}
+
+# when a model that isn't already loaded is loaded
+LOAD_MODES = {
+    'now': LOAD_NOW, 'lazy': LOAD_LAZY, 'background': LOAD_BACKGROUND}
+
+cdef FastNPChunker* _new_chunker(path, huge_page_mode_t huge_pages,
+        model_load_t when) except NULL:
+    '''
+    Construct the C++ class for the model in path (or the default),
+    sharing the weights with every other chunker in the process using the
+    same file
+    '''
+    cdef string model_path = DEFAULT_MODEL if path is None else path
+    return new FastNPChunker(
+        shared_chunker_model(model_path, huge_pages, when))
+
+def loaded_models():
+    '''
+    The chunker models loaded in this process, see
+    mltk.aptagger.loaded_models
+    '''
+    cdef vector[pair[model_key_t, long] ] models = (
+        chunker_registry_t.instance().loaded())
+    cdef size_t k
+    names = {mode: name for name, mode in HUGE_PAGE_MODES.items()}
+    return [(models[k].first.path, names[models[k].first.huge_pages],
+        models[k].second) for k in range(models.size())]
+
+cdef int _pack_document(const unsigned char[::1] buffer,
+        const int64_t[:, ::1] token_offsets,
+        const int64_t[::1] sentence_offsets,
+        packed_document_t& document) except -1:
+    '''
+    Point document at the buffer and offset arrays and check the offsets.
+    Nothing is copied so the arguments must outlive document
+    '''
+    if token_offsets.shape[1] != 2:
+        raise ValueError("token_offsets must have shape (ntokens, 2)")
+    document.buffer = <const char*> &buffer[0] if buffer.shape[0] else NULL
+    document.buffer_length = buffer.shape[0]
+    document.token_offsets = (
+        &token_offsets[0, 0] if token_offsets.shape[0] else NULL)
+    document.ntokens = token_offsets.shape[0]
+    document.sentence_offsets = (
+        &sentence_offsets[0] if sentence_offsets.shape[0] else NULL)
+    document.nsentences = max(sentence_offsets.shape[0] - 1, 0)
+    document.check()
+    return 0
+
+cdef dict _counts_dict(NounPhraseCounts& counts):
+    '''The noun phrase counts as a dict of phrase -> count'''
+    cdef size_t k
+    cdef token_ref_t phrase
+    ret = {}
+    for k in range(counts.size()):
+        phrase = counts.phrase(k)
+        ret[phrase.data[:phrase.length]] = counts.count(k)
+    return ret
 
 cdef class NPChunker:
-    def __cinit__(self):
+    def __cinit__(self, model_path=None, huge_pages=None, load='now'):
         '''
         Initialize the chunker.
-        Load the model and construct the C++ class
-        '''
-        with GzipFile(
-                fileobj=StringIO(pkgutil.get_data(
-                'mltk', os.path.join('models', 'np_chunker.json.gz'))),
-                mode='r') as fin:
-            model_weights = json.load(fin)
-        # in C, labelmap is string -> char
-        # model_weights stores label as a string, e.g. 'I'
-        # to get conversion from python to C, need to convert the string
-        # to int value with ord
-        labelmap = {k: ord(v)
-            for k, v in model_weights['labelmap'].iteritems()}
-        self._chunkerptr = new FastNPChunker(
-            model_weights['weights'], labelmap)
+        model_path is a gzipped JSON model file, defaults to the model
+        included in mltk.  All the chunkers in the process for the same
+        file share one copy of the model.
+        huge_pages and load are as for FastPerceptronTagger
+        '''
+        if huge_pages not in HUGE_PAGE_MODES:
+            raise ValueError("Unknown huge page mode %s" % huge_pages)
+        if load not in LOAD_MODES:
+            raise ValueError("Unknown load mode %s" % load)
+        self._huge_pages = HUGE_PAGE_MODES[huge_pages]
+        self._cache_capacity = 0
+        self._cache_policy = CACHE_LRU
+        self._bound_scale = 0.0
+        self._handle = new ModelHandle[FastNPChunker](
+            _new_chunker(model_path, self._huge_pages, LOAD_MODES[load]))
 
     def __dealloc__(self):
-        del self._chunkerptr
+        del self._handle
+
+    def load_model(self, model_path=None):
+        '''
+        Replace the model with the one in model_path (or the default).
+
+        This is safe to call while other threads are chunking, see
+        FastPerceptronTagger.load_model
+        '''
+        cdef FastNPChunker* chunker = _new_chunker(
+            model_path, self._huge_pages, LOAD_NOW)
+        chunker.set_cache(self._cache_capacity, self._cache_policy)
+        chunker.set_early_exit(self._bound_scale)
+        with nogil:
+            self._handle.swap(chunker)
 
     def chunk_sents(self, sentences, iob=False):
         '''
@@ -66,6 +145,307 @@ cdef class NPChunker:
         '''
         return self.chunk_sents([sentence])[0]
 
+    def chunk_spans(self, sentences):
+        '''
+        Sentences = a list of tokenized and POS tagged sentences, as for
+            chunk_sents
+        Returns the noun phrases as (sentence_idx, start, end) token spans,
+        so each noun phrase is sentences[sentence_idx][start:end].  This
+        is cheaper than chunk_sents since no tokens are copied.
+        The cache isn't used.
+        '''
+        cdef vector[vector[tag_t] ] document = sentences
+        cdef vector[np_span_t] spans
+        cdef unsigned int token = 0
+        cdef FastNPChunker* chunker = self._acquire(token)
+        cdef size_t k
+
+        try:
+            with nogil:
+                chunker.chunk_spans(document, spans)
+        finally:
+            self._handle.release(token)
+
+        return [(spans[k].sentence, spans[k].start, spans[k].end)
+            for k in range(spans.size())]
+
+    def chunk_arrays(self, sentences):
+        '''
+        Sentences = a list of tokenized and POS tagged sentences, as for
+            chunk_sents
+        Returns flat numpy arrays instead of lists of tuples:
+            labels = uint8 array with the IOB label for each token as
+                the character code, so labels.view('S1') gives 'I', 'O', 'B'
+            sentence_offsets = int64 array of length nsentences + 1.  The
+                labels for sentence j are
+                labels[sentence_offsets[j]:sentence_offsets[j + 1]]
+        Returns (labels, sentence_offsets).  The cache isn't used.
+        '''
+        import numpy as np
+        cdef vector[vector[tag_t] ] document = sentences
+        cdef vector[char] sentence_labels
+        cdef unsigned int token = 0
+        cdef FastNPChunker* chunker
+        cdef int64_t[::1] offsets
+        cdef unsigned char[::1] labels
+        cdef size_t j, k, n = 0
+
+        sentence_offsets = np.empty(document.size() + 1, dtype=np.int64)
+        offsets = sentence_offsets
+        offsets[0] = 0
+        for j in range(document.size()):
+            n += document[j].size()
+            offsets[j + 1] = n
+        ret = np.empty(n, dtype=np.uint8)
+        labels = ret
+
+        chunker = self._acquire(token)
+        try:
+            with nogil:
+                n = 0
+                for j in range(document.size()):
+                    chunker.tag_labels(document[j], sentence_labels)
+                    for k in range(sentence_labels.size()):
+                        labels[n] = sentence_labels[k]
+                        n += 1
+        finally:
+            self._handle.release(token)
+
+        return ret, sentence_offsets
+
+    def chunk_packed(self, buffer, token_offsets, sentence_offsets,
+            tag_buffer, tag_offsets, arrays=False):
+        '''
+        Chunk sentences packed in a single buffer, see
+        FastPerceptronTagger.tag_packed.  The POS tags are packed the same
+        way, in tag_buffer with tag_offsets of shape (ntokens, 2).
+        Returns a list of the IOB labels for each sentence:
+            [['B', 'I', 'O'], ['B', 'I', 'O']]
+        or if arrays is True a uint8 numpy array of the labels as in
+        chunk_arrays.  The cache isn't used.
+        '''
+        cdef packed_document_t document
+        cdef packed_document_t tags
+        cdef vector[char] labels
+        cdef unsigned int token = 0
+        cdef FastNPChunker* chunker
+        cdef unsigned char[::1] label_codes
+        cdef size_t j, k
+
+        _pack_document(buffer, token_offsets, sentence_offsets, document)
+        _pack_document(tag_buffer, tag_offsets, sentence_offsets, tags)
+        if tags.ntokens != document.ntokens:
+            raise ValueError("need one tag for each token")
+
+        chunker = self._acquire(token)
+        try:
+            with nogil:
+                chunker.tag_packed(document, tags, labels)
+        finally:
+            self._handle.release(token)
+
+        if arrays:
+            import numpy as np
+            ret = np.empty(labels.size(), dtype=np.uint8)
+            label_codes = ret
+            with nogil:
+                for k in range(labels.size()):
+                    label_codes[k] = labels[k]
+            return ret
+
+        ret = []
+        for j in range(document.nsentences):
+            ret.append([chr(labels[k])
+                for k in range(document.sentence_offsets[j],
+                    document.sentence_offsets[j + 1])])
+        return ret
+
+    def count_noun_phrases(self, sentences, normalize=None):
+        '''
+        Sentences = a list of tokenized and POS tagged sentences, as for
+            chunk_sents
+        Returns a dict of noun phrase -> the number of times it occurs,
+        e.g. for keyword extraction.  A phrase is its tokens joined by
+        spaces, e.g. 'the first sentence'.  normalize is None to count
+        the tokens as they are, 'lower' to lower case them or 'normalize'
+        to also replace numbers with '!DIGITS' etc as in the features.
+        The phrases are counted in C++ without making a Python object for
+        each one, so this is much faster than counting chunk_sents.
+        The cache isn't used.
+        '''
+        cdef vector[vector[tag_t] ] document = sentences
+        cdef NounPhraseCounts counts
+        cdef np_normalize_t mode
+        cdef unsigned int token = 0
+        cdef FastNPChunker* chunker
+
+        if normalize not in NORMALIZE_MODES:
+            raise ValueError("Unknown normalization %s" % normalize)
+        mode = NORMALIZE_MODES[normalize]
+        chunker = self._acquire(token)
+        try:
+            with nogil:
+                chunker.count_noun_phrases(document, mode, counts)
+        finally:
+            self._handle.release(token)
+        return _counts_dict(counts)
+
+    def count_noun_phrases_packed(self, buffer, token_offsets,
+            sentence_offsets, tag_buffer, tag_offsets, normalize=None):
+        '''
+        count_noun_phrases for sentences packed as for chunk_packed
+        '''
+        cdef packed_document_t document
+        cdef packed_document_t tags
+        cdef NounPhraseCounts counts
+        cdef np_normalize_t mode
+        cdef unsigned int token = 0
+        cdef FastNPChunker* chunker
+
+        if normalize not in NORMALIZE_MODES:
+            raise ValueError("Unknown normalization %s" % normalize)
+        mode = NORMALIZE_MODES[normalize]
+        _pack_document(buffer, token_offsets, sentence_offsets, document)
+        _pack_document(tag_buffer, tag_offsets, sentence_offsets, tags)
+        if tags.ntokens != document.ntokens:
+            raise ValueError("need one tag for each token")
+
+        chunker = self._acquire(token)
+        try:
+            with nogil:
+                chunker.count_noun_phrases(document, tags, mode, counts)
+        finally:
+            self._handle.release(token)
+        return _counts_dict(counts)
+
+    def update(self, sentence, labels):
+        '''
+        Learn from a correctly chunked sentence, e.g. to fix systematic
+        mistakes on a new domain without retraining.  sentence is a POS
+        tagged sentence [(token, tag), ...] and labels its correct IOB
+        labels, e.g. 'BIO' or ['B', 'I', 'O'].  Makes the usual perceptron
+        update for each token the chunker gets wrong, taking the earlier
+        updates into account.  Returns the number of wrong labels.
+
+        The updates are kept on top of the model weights and aren't used
+        for chunking until snapshot() is called.  This is safe to call
+        while other threads are chunking.  Reloading the model discards
+        the updates.
+        '''
+        cdef vector[tag_t] tags = sentence
+        cdef vector[char] gold_labels = [ord(label) for label in labels]
+        cdef unsigned int token = 0
+        cdef FastNPChunker* chunker = self._acquire(token)
+        try:
+            return chunker.update(tags, gold_labels)
+        finally:
+            self._handle.release(token)
+
+    def snapshot(self):
+        '''
+        Start chunking with all the updates so far.  Calls in progress
+        finish with the weights they started with.  Clears the cache.
+        '''
+        cdef unsigned int token = 0
+        cdef FastNPChunker* chunker
+        chunker = self._acquire(token)
+        try:
+            chunker.snapshot()
+        finally:
+            self._handle.release(token)
+
+    def reset_updates(self):
+        '''Discard all the updates and go back to the model weights'''
+        cdef unsigned int token = 0
+        cdef FastNPChunker* chunker
+        chunker = self._acquire(token)
+        try:
+            chunker.reset_updates()
+        finally:
+            self._handle.release(token)
+
+    def export_model(self, path):
+        '''
+        Save the model weights, including the updates in the snapshot, to
+        path as a JSON model that load_model can load, gzipped if path ends
+        in .gz
+        '''
+        cdef np_weights_t weights
+        cdef np_labelmap_in_t labelmap
+        cdef unsigned int token = 0
+        cdef FastNPChunker* chunker
+        chunker = self._acquire(token)
+        try:
+            chunker.get_weights(weights, labelmap)
+        finally:
+            self._handle.release(token)
+        write_chunker_model(path, weights, labelmap)
+
+    def enable_early_exit(self, bound_scale=1.0):
+        '''
+        Approximate chunking, see FastPerceptronTagger.enable_early_exit.
+        Clears the cache.
+        '''
+        cdef unsigned int token = 0
+        cdef FastNPChunker* chunker
+        if bound_scale < 0:
+            raise ValueError("bound_scale must be >= 0")
+        self._bound_scale = bound_scale
+        chunker = self._acquire(token)
+        try:
+            chunker.set_early_exit(self._bound_scale)
+        finally:
+            self._handle.release(token)
+
+    def disable_early_exit(self):
+        self.enable_early_exit(0.0)
+
+    def enable_cache(self, capacity=10000, policy='lru'):
+        '''
+        Cache the IOB labels for up to capacity sentences, so that repeated
+        sentences (e.g. boilerplate text) are only chunked once.
+        policy is the eviction policy, one of 'lru' or 'fifo'.
+        Enabling the cache discards any previously cached sentences.
+        '''
+        cdef unsigned int token = 0
+        cdef FastNPChunker* chunker
+        if policy not in CACHE_POLICIES:
+            raise ValueError("Unknown cache policy %s" % policy)
+        self._cache_capacity = capacity
+        self._cache_policy = CACHE_POLICIES[policy]
+        chunker = self._acquire(token)
+        try:
+            chunker.set_cache(self._cache_capacity, self._cache_policy)
+        finally:
+            self._handle.release(token)
+
+    def disable_cache(self):
+        self.enable_cache(0)
+
+    def clear_cache(self):
+        '''Remove all cached sentences and reset the hit/miss counters'''
+        cdef unsigned int token = 0
+        cdef FastNPChunker* chunker
+        chunker = self._acquire(token)
+        try:
+            chunker.clear_cache()
+        finally:
+            self._handle.release(token)
+
+    def cache_info(self):
+        '''
+        Returns a dict with the cache hits, misses, size and capacity
+        '''
+        cdef unsigned int token = 0
+        cdef cache_info_t info
+        cdef FastNPChunker* chunker
+        chunker = self._acquire(token)
+        try:
+            info = chunker.cache_info()
+        finally:
+            self._handle.release(token)
+        return info
+
     def _unpack_struct(self, iob_labels):
         ret = []
         for sentence in iob_labels:
@@ -74,13 +454,46 @@ cdef class NPChunker:
                 for label in sentence])
         return ret
 
-    cdef void _tag_sentences(self,
-        vector[vector[tag_t] ]& document, vector[iob_label_t]& iob):
-        '''forwarding method'''
-        self._chunkerptr.tag_sentences(document, iob)
+    cdef FastNPChunker* _acquire(self, unsigned int& token) except NULL:
+        '''
+        self._handle.acquire(token) for methods that use the model, see
+        FastPerceptronTagger._acquire
+        '''
+        cdef FastNPChunker* chunker = self._handle.acquire(token)
+        cdef bint loaded = chunker.model_loaded()
+        if not loaded:
+            with nogil:
+                loaded = chunker.wait_for_model()
+            if not loaded:
+                try:
+                    # raises the load error
+                    chunker.shared_model()
+                finally:
+                    self._handle.release(token)
+                raise RuntimeError("The model failed to load")
+        return chunker
 
-    cdef void _chunk_sentences(self,
-        vector[vector[tag_t] ]& document, vector[vector[np_t] ]& noun_phrases):
-        '''forwarding method'''
-        self._chunkerptr.chunk_sentences(document, noun_phrases)
+    cdef int _tag_sentences(self,
+        vector[vector[tag_t] ]& document, vector[iob_label_t]& iob) except -1:
+        '''forwarding method.  The GIL is released while chunking'''
+        cdef unsigned int token = 0
+        cdef FastNPChunker* chunker = self._acquire(token)
+        try:
+            with nogil:
+                chunker.tag_sentences(document, iob)
+        finally:
+            self._handle.release(token)
+        return 0
 
+    cdef int _chunk_sentences(self,
+        vector[vector[tag_t] ]& document,
+        vector[vector[np_t] ]& noun_phrases) except -1:
+        '''forwarding method.  The GIL is released while chunking'''
+        cdef unsigned int token = 0
+        cdef FastNPChunker* chunker = self._acquire(token)
+        try:
+            with nogil:
+                chunker.chunk_sentences(document, noun_phrases)
+        finally:
+            self._handle.release(token)
+        return 0
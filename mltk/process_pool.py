@@ -0,0 +1,376 @@
+'''
+Tag and chunk large batches of packed documents on all the cores with a
+pool of forked worker processes.
+
+The workers are forked after the parent has loaded the models, so they
+share the model memory copy on write instead of each loading a copy (the
+weights are C++ memory that Python's reference counting never touches, so
+the pages stay shared).  Each worker has a shared memory ring buffer: the
+parent copies a document's packed tokens into the ring and the worker
+writes the tag ids and IOB labels next to them, so only small fixed size
+job headers go through pipes and nothing is pickled.
+'''
+import os
+import mmap
+import errno
+import select
+import struct
+from collections import deque
+from multiprocessing import cpu_count
+
+import numpy as np
+
+# job id, offset in the ring, buffer length, ntokens, nsentences
+_JOB = struct.Struct('=5q')
+# job id, 0 or 1 if the worker failed
+_RESULT = struct.Struct('=2q')
+
+
+def _read_exact(fd, size):
+    '''size bytes from fd, or b'' at the end of the file'''
+    data = b''
+    while len(data) < size:
+        try:
+            chunk = os.read(fd, size - len(data))
+        except OSError as e:
+            if e.errno == errno.EINTR:
+                continue
+            raise
+        if not chunk:
+            if data:
+                raise IOError("truncated message from pipe")
+            return b''
+        data += chunk
+    return data
+
+
+def _aligned(size):
+    return (size + 7) & ~7
+
+
+class _Labeler(object):
+    '''
+    Tags and chunks one document from numpy arrays, in the parent for
+    documents too large for the ring buffers and in the workers
+    '''
+    def __init__(self, tagger, chunker):
+        self.tagger = tagger
+        self.chunker = chunker
+        if chunker is None:
+            return
+
+        # the chunker needs the tags packed too: every tag name is padded to
+        # the same width, so a document's tags are names[tag_ids]
+        names = [name if isinstance(name, bytes) else name.encode('utf-8')
+            for name in tagger.tag_names()]
+        self.width = max(len(name) for name in names)
+        self.names = np.array(names, dtype='S%d' % self.width)
+        self.lengths = np.array([len(name) for name in names], dtype=np.int64)
+
+    def label(self, buffer, token_offsets, sentence_offsets, out):
+        '''
+        Tag and chunk the document, writing the tag ids then the labels
+        into the uint8 array out
+        '''
+        ntokens = len(token_offsets)
+        tag_ids = self.tagger.tag_packed(buffer, token_offsets,
+            sentence_offsets, arrays=True)
+        out[:ntokens] = tag_ids
+        if self.chunker is None:
+            return
+
+        tag_buffer = self.names[tag_ids].view(np.uint8)
+        tag_offsets = np.empty((ntokens, 2), dtype=np.int64)
+        tag_offsets[:, 0] = np.arange(ntokens, dtype=np.int64) * self.width
+        tag_offsets[:, 1] = tag_offsets[:, 0] + self.lengths[tag_ids]
+        out[ntokens:] = self.chunker.chunk_packed(buffer, token_offsets,
+            sentence_offsets, tag_buffer, tag_offsets, arrays=True)
+
+
+class _Worker(object):
+    '''The parent's end of a worker process'''
+    def __init__(self, memory_size):
+        self.memory = mmap.mmap(-1, memory_size)
+        self.ring = np.frombuffer(self.memory, dtype=np.uint8)
+        self.pid = None
+        self.jobs = None
+        self.results = None
+        # the jobs sent and not returned yet, oldest first, as
+        # (job id, offset, input size, ntokens, end offset)
+        self.pending = deque()
+        self.ntokens = 0
+
+    def allocate(self, size):
+        '''
+        The offset of size free bytes in the ring, or None if it's too full.
+        The worker finishes jobs in order, so the ring is freed in the
+        order it is allocated
+        '''
+        capacity = len(self.ring)
+        if not self.pending:
+            return 0 if size <= capacity else None
+        head = self.pending[-1][4]
+        tail = self.pending[0][1]
+        if self.pending[-1][1] < tail:
+            # wrapped, the free space is between the newest and oldest jobs
+            return head if head + size <= tail else None
+        if head + size <= capacity:
+            return head
+        return 0 if size <= tail else None
+
+
+class ProcessPool(object):
+    '''
+    A pool of worker processes that tag (and optionally chunk) packed
+    documents, for throughput that scales with the number of cores.
+    Documents are given in the packed format of
+    FastPerceptronTagger.tag_packed.
+
+    The workers are forked when the pool is created, and use the models the
+    tagger and chunker have then.  Create the pool before starting any
+    threads (e.g. enable_batching), since fork only copies the calling
+    thread.  A worker that dies is replaced by a new one, and the
+    map_packed call that was using it raises RuntimeError.
+
+        with ProcessPool(tagger, chunker) as pool:
+            for tag_ids, labels in pool.map_packed(documents):
+                ...
+    '''
+    def __init__(self, tagger, chunker=None, nprocesses=None,
+            memory_size=64 << 20):
+        '''
+        Fork nprocesses workers (default one per core).  memory_size is the
+        size of each worker's ring buffer in bytes; a document takes 18
+        bytes per token plus its text, and documents too large for the
+        ring are tagged in the parent.
+        '''
+        if nprocesses is None:
+            nprocesses = cpu_count()
+        if nprocesses < 1:
+            raise ValueError("need at least one process")
+
+        self._labeler = _Labeler(tagger, chunker)
+        self._nlabels = 1 if chunker is None else 2
+        self._memory_size = _aligned(memory_size)
+        self._workers = []
+        try:
+            for k in range(nprocesses):
+                self._workers.append(self._start(_Worker(self._memory_size)))
+        except:
+            self.close()
+            raise
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def __del__(self):
+        self.close()
+
+    def _start(self, worker):
+        '''fork the process for worker'''
+        jobs_read, jobs_write = os.pipe()
+        results_read, results_write = os.pipe()
+        pid = os.fork()
+        if pid == 0:
+            # the child mustn't hold the other workers' pipes open, or they
+            # wouldn't see the end of their jobs when the pool is closed
+            status = 1
+            try:
+                os.close(jobs_write)
+                os.close(results_read)
+                for other in self._workers:
+                    if other is not worker:
+                        os.close(other.jobs)
+                        os.close(other.results)
+                self._serve(worker, jobs_read, results_write)
+                status = 0
+            finally:
+                os._exit(status)
+
+        os.close(jobs_read)
+        os.close(results_write)
+        worker.pid = pid
+        worker.jobs = jobs_write
+        worker.results = results_read
+        return worker
+
+    def _serve(self, worker, jobs, results):
+        '''the worker process: label documents until the jobs pipe closes'''
+        ring = worker.ring
+        while True:
+            header = _read_exact(jobs, _JOB.size)
+            if not header:
+                return
+            job, offset, buffer_length, ntokens, nsentences = (
+                _JOB.unpack(header))
+            failed = 0
+            try:
+                token_end = offset + 16 * ntokens
+                sentence_end = token_end + 8 * (nsentences + 1)
+                buffer_end = sentence_end + buffer_length
+                out = _aligned(buffer_end)
+                self._labeler.label(
+                    ring[sentence_end:buffer_end],
+                    ring[offset:token_end].view(np.int64).reshape(ntokens, 2),
+                    ring[token_end:sentence_end].view(np.int64),
+                    ring[out:out + self._nlabels * ntokens])
+            except Exception:
+                failed = 1
+            os.write(results, _RESULT.pack(job, failed))
+
+    def _job_size(self, buffer, ntokens, nsentences):
+        '''the ring space for a document and its results'''
+        return (_aligned(16 * ntokens + 8 * (nsentences + 1) + len(buffer))
+            + _aligned(self._nlabels * ntokens))
+
+    def _send(self, worker, job, offset, buffer, token_offsets,
+            sentence_offsets):
+        '''copy a document into worker's ring and queue it'''
+        ntokens = len(token_offsets)
+        nsentences = len(sentence_offsets) - 1
+        ring = worker.ring
+        token_end = offset + 16 * ntokens
+        sentence_end = token_end + 8 * (nsentences + 1)
+        buffer_end = sentence_end + len(buffer)
+        ring[offset:token_end].view(np.int64)[:] = token_offsets.ravel()
+        ring[token_end:sentence_end].view(np.int64)[:] = sentence_offsets
+        ring[sentence_end:buffer_end] = buffer
+
+        size = self._job_size(buffer, ntokens, nsentences)
+        worker.pending.append(
+            (job, offset, _aligned(buffer_end) - offset, ntokens,
+            offset + size))
+        worker.ntokens += ntokens
+        try:
+            os.write(worker.jobs,
+                _JOB.pack(job, offset, len(buffer), ntokens, nsentences))
+        except OSError as e:
+            if e.errno != errno.EPIPE:
+                raise
+            self._restart(worker)
+
+    def _receive(self, worker, finished):
+        '''copy the results of worker's oldest job into finished'''
+        try:
+            header = _read_exact(worker.results, _RESULT.size)
+        except IOError:
+            header = b''
+        if not header:
+            self._restart(worker)
+        job, failed = _RESULT.unpack(header)
+        pending_job, offset, input_size, ntokens, end = worker.pending.popleft()
+        worker.ntokens -= ntokens
+        if failed or job != pending_job:
+            raise RuntimeError("worker %d failed on document %d" % (
+                worker.pid, job))
+        out = offset + input_size
+        finished[job] = self._results(
+            worker.ring[out:out + self._nlabels * ntokens], ntokens)
+
+    def _restart(self, worker):
+        '''
+        Reap worker's process, which has died with its jobs unfinished,
+        start a new one in its place and raise RuntimeError
+        '''
+        pid = worker.pid
+        os.close(worker.jobs)
+        os.close(worker.results)
+        worker.pid = None
+        _, status = os.waitpid(pid, 0)
+        worker.pending.clear()
+        worker.ntokens = 0
+        self._start(worker)
+        raise RuntimeError("worker %d exited with status %d" % (pid, status))
+
+    def _results(self, out, ntokens):
+        tag_ids = out[:ntokens].copy()
+        labels = out[ntokens:].copy() if self._nlabels == 2 else None
+        return tag_ids, labels
+
+    def _wait(self, finished):
+        '''receive the results from all the workers that are done'''
+        busy = [worker for worker in self._workers if worker.pending]
+        try:
+            ready, _, _ = select.select(
+                [worker.results for worker in busy], [], [])
+        except select.error as e:
+            if e.args[0] == errno.EINTR:
+                return
+            raise
+        for worker in busy:
+            if worker.results in ready:
+                self._receive(worker, finished)
+
+    def map_packed(self, documents):
+        '''
+        Tag and chunk documents, an iterable of (buffer, token_offsets,
+        sentence_offsets) in the format of FastPerceptronTagger.tag_packed.
+        Yields (tag_ids, labels) for each document in order: uint8 numpy
+        arrays as from tag_packed and chunk_packed with arrays=True, with
+        labels None if the pool has no chunker.
+        '''
+        if not self._workers:
+            raise ValueError("the pool is closed")
+
+        # drop the results of a previous call that wasn't run to the end
+        finished = {}
+        while any(worker.pending for worker in self._workers):
+            self._wait(finished)
+        finished.clear()
+
+        next_job = 0
+        for job, document in enumerate(documents):
+            buffer, token_offsets, sentence_offsets = document
+            if not isinstance(buffer, np.ndarray):
+                buffer = np.frombuffer(buffer, dtype=np.uint8)
+            token_offsets = np.ascontiguousarray(token_offsets,
+                dtype=np.int64).reshape(-1, 2)
+            sentence_offsets = np.ascontiguousarray(sentence_offsets,
+                dtype=np.int64)
+            ntokens = len(token_offsets)
+
+            size = self._job_size(buffer, ntokens,
+                len(sentence_offsets) - 1)
+            if ntokens == 0 or size > self._memory_size:
+                out = np.empty(self._nlabels * ntokens, dtype=np.uint8)
+                self._labeler.label(buffer, token_offsets, sentence_offsets,
+                    out)
+                finished[job] = self._results(out, ntokens)
+            else:
+                # the least loaded worker with room for the document
+                while True:
+                    for worker in sorted(self._workers,
+                            key=lambda worker: worker.ntokens):
+                        offset = worker.allocate(size)
+                        if offset is not None:
+                            break
+                    if offset is not None:
+                        break
+                    self._wait(finished)
+                self._send(worker, job, offset, buffer, token_offsets,
+                    sentence_offsets)
+
+            while next_job in finished:
+                yield finished.pop(next_job)
+                next_job += 1
+
+        while any(worker.pending for worker in self._workers):
+            self._wait(finished)
+            while next_job in finished:
+                yield finished.pop(next_job)
+                next_job += 1
+
+    def close(self):
+        '''stop the workers'''
+        workers = getattr(self, '_workers', [])
+        for worker in workers:
+            if worker.pid is not None:
+                os.close(worker.jobs)
+                os.close(worker.results)
+        for worker in workers:
+            if worker.pid is not None:
+                os.waitpid(worker.pid, 0)
+        self._workers = []
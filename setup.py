@@ -3,16 +3,24 @@ from distutils.core import setup
 from distutils.extension import Extension
 from Cython.Distutils import build_ext
 
+# the C++ sources shared by all the extensions.  The models are read
+# with the native loader in _model_io.cc, which needs both models
+common_sources = ['mltk/_utils.cc', 'mltk/_placement.cc', 'mltk/_ctagger.cc',
+    'mltk/_np_chunker.cc', 'mltk/_model_io.cc', 'mltk/_scheduler.cc',
+    'ext/murmur3.c']
+
 ext_modules = [
     Extension(
         "mltk.aptagger",
-        sources=['mltk/aptagger.pyx'],
+        sources=['mltk/aptagger.pyx'] + common_sources,
         extra_compile_args=['-std=c++0x'],
+        libraries=['z'],
         language="c++"),
     Extension(
         "mltk.np_chunker",
-        sources=['mltk/np_chunker.pyx'],
+        sources=['mltk/np_chunker.pyx'] + common_sources,
         extra_compile_args=['-std=c++0x'],
+        libraries=['z'],
         language="c++")
 ]
 
@@ -0,0 +1,270 @@
+/**
+    check-allocations: counts the heap allocations made while tagging and
+    chunking once the thread's workspace has warmed up, which should be
+    none.  Run by test_allocations.py.
+
+    Replaces the global operator new with one that counts calls, tags a
+    small document once to warm up, then tags it again through each API
+    and prints the number of allocations for each.  Exits with 1 if any
+    API allocated.
+
+    Usage:
+        check-allocations [MODEL_DIR]
+*/
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <new>
+#include <memory>
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+#include <functional>
+
+#include "../mltk/_model_io.h"
+#include "../mltk/mltk.h"
+
+#ifndef MLTK_MODEL_DIR
+#define MLTK_MODEL_DIR "mltk/models"
+#endif
+
+
+namespace
+{
+
+std::atomic<bool> counting(false);
+std::atomic<std::size_t> allocations(0);
+
+void* counted_new(std::size_t size)
+{
+    if (counting.load(std::memory_order_relaxed))
+        ++allocations;
+    void* p = std::malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+}
+
+void* operator new(std::size_t size) { return counted_new(size); }
+void* operator new[](std::size_t size) { return counted_new(size); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+
+typedef std::vector<std::string> sentence_t;
+
+// sentences of different lengths, some with words and tags too long for
+// the short string optimization
+const char* TEXT[] =
+{
+    "The first sentence is short .",
+    "Internationalization and counterrevolutionaries were "
+        "mischaracterized by the extraordinarily uncharacteristically "
+        "long-winded correspondent in 1999 .",
+    "A cat sat on the mat .",
+    "She said that the 3.5 % increase in telecommunications "
+        "infrastructure spending was disproportionately concentrated "
+        "in the northeastern states , according to the report .",
+    "Go !"
+};
+
+/// the allocations made by f
+std::size_t count(std::function<void()> f)
+{
+    allocations.store(0);
+    counting.store(true);
+    f();
+    counting.store(false);
+    return allocations.load();
+}
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        std::string model_dir = argc > 1 ? argv[1] : MLTK_MODEL_DIR;
+        std::unique_ptr<PerceptronTagger> tagger(
+            load_tagger(model_dir + "/aptagger-0.1.0.json.gz"));
+        std::unique_ptr<FastNPChunker> chunker(
+            load_chunker(model_dir + "/np_chunker.json.gz"));
+        mltk_tagger* ctagger = mltk_tagger_load(
+            (model_dir + "/aptagger-0.1.0.json.gz").c_str());
+        mltk_chunker* cchunker = mltk_chunker_load(
+            (model_dir + "/np_chunker.json.gz").c_str());
+        if (!ctagger || !cchunker)
+            throw std::runtime_error(mltk_last_error());
+
+        // the document as strings, token_ref_t and packed
+        std::vector<sentence_t> document;
+        std::string buffer;
+        std::vector<int64_t> token_offsets;
+        std::vector<int64_t> sentence_offsets(1, 0);
+        for (std::size_t j = 0; j < sizeof(TEXT) / sizeof(TEXT[0]); ++j)
+        {
+            std::istringstream words(TEXT[j]);
+            sentence_t sentence;
+            std::string word;
+            while (words >> word)
+            {
+                sentence.push_back(word);
+                token_offsets.push_back(buffer.size());
+                buffer += word;
+                token_offsets.push_back(buffer.size());
+                buffer += " ";
+            }
+            document.push_back(sentence);
+            sentence_offsets.push_back(sentence_offsets.back() +
+                sentence.size());
+        }
+        packed_document_t packed = {buffer.data(), buffer.size(),
+            token_offsets.data(), token_offsets.size() / 2,
+            sentence_offsets.data(), document.size()};
+
+        // the POS tags, in the same forms
+        std::vector<std::vector<tag_t> > tagged(document.size());
+        std::vector<std::vector<std::pair<token_ref_t, token_ref_t> > >
+            tagged_refs(document.size());
+        std::vector<std::vector<token_ref_t> > refs(document.size());
+        std::string tag_buffer;
+        std::vector<int64_t> tag_offsets;
+        std::vector<std::size_t> ids;
+        for (std::size_t j = 0; j < document.size(); ++j)
+        {
+            tagger->tag_ids(document[j], ids);
+            for (std::size_t i = 0; i < document[j].size(); ++i)
+            {
+                std::string const & tag = tagger->tag_name(ids[i]);
+                tagged[j].push_back(std::make_pair(document[j][i], tag));
+                refs[j].push_back(token_ref_t(document[j][i]));
+                tag_offsets.push_back(tag_buffer.size());
+                tag_buffer += tag;
+                tag_offsets.push_back(tag_buffer.size());
+            }
+        }
+        for (std::size_t j = 0; j < document.size(); ++j)
+        {
+            for (std::size_t i = 0; i < tagged[j].size(); ++i)
+                tagged_refs[j].push_back(std::make_pair(
+                    token_ref_t(tagged[j][i].first),
+                    token_ref_t(tagged[j][i].second)));
+        }
+        packed_document_t packed_tags = {tag_buffer.data(),
+            tag_buffer.size(), tag_offsets.data(), tag_offsets.size() / 2,
+            sentence_offsets.data(), document.size()};
+
+        std::vector<char> labels;
+        NounPhraseCounts counts;
+        std::vector<const char*> ctokens;
+        std::vector<const char*> ctags;
+        std::vector<char> clabels;
+
+        std::vector<std::pair<std::string, std::function<void()> > > apis;
+        apis.push_back(std::make_pair("tag_ids", [&]() {
+            for (std::size_t j = 0; j < document.size(); ++j)
+                tagger->tag_ids(document[j], ids);
+        }));
+        apis.push_back(std::make_pair("tag_ids token_ref_t", [&]() {
+            for (std::size_t j = 0; j < refs.size(); ++j)
+                tagger->tag_ids(refs[j], ids);
+        }));
+        apis.push_back(std::make_pair("tag_packed", [&]() {
+            tagger->tag_packed(packed, ids);
+        }));
+        apis.push_back(std::make_pair("tag_labels", [&]() {
+            for (std::size_t j = 0; j < tagged.size(); ++j)
+                chunker->tag_labels(tagged[j], labels);
+        }));
+        apis.push_back(std::make_pair("tag_labels token_ref_t", [&]() {
+            for (std::size_t j = 0; j < tagged_refs.size(); ++j)
+                chunker->tag_labels(tagged_refs[j], labels);
+        }));
+        apis.push_back(std::make_pair("chunker tag_packed", [&]() {
+            chunker->tag_packed(packed, packed_tags, labels);
+        }));
+        apis.push_back(std::make_pair("count_noun_phrases", [&]() {
+            counts.clear();
+            chunker->count_noun_phrases(tagged, NP_NORMALIZE, counts);
+        }));
+        apis.push_back(std::make_pair("mltk_tagger_tag", [&]() {
+            for (std::size_t j = 0; j < document.size(); ++j)
+            {
+                ctokens.resize(document[j].size());
+                ctags.resize(document[j].size());
+                for (std::size_t i = 0; i < document[j].size(); ++i)
+                    ctokens[i] = document[j][i].c_str();
+                mltk_tagger_tag(ctagger, ctokens.data(), ctokens.size(),
+                    ctags.data());
+            }
+        }));
+        apis.push_back(std::make_pair("mltk_chunker_chunk", [&]() {
+            for (std::size_t j = 0; j < tagged.size(); ++j)
+            {
+                ctokens.resize(tagged[j].size());
+                ctags.resize(tagged[j].size());
+                clabels.resize(tagged[j].size());
+                for (std::size_t i = 0; i < tagged[j].size(); ++i)
+                {
+                    ctokens[i] = tagged[j][i].first.c_str();
+                    ctags[i] = tagged[j][i].second.c_str();
+                }
+                mltk_chunker_chunk(cchunker, ctokens.data(), ctags.data(),
+                    ctokens.size(), clabels.data());
+            }
+        }));
+
+        // with early exit and then with online updates in the snapshot
+        std::vector<std::string> settings;
+        settings.push_back("exact");
+        settings.push_back("early exit");
+        settings.push_back("updates");
+
+        int status = 0;
+        for (std::size_t s = 0; s < settings.size(); ++s)
+        {
+            if (settings[s] == "early exit")
+            {
+                tagger->set_early_exit(1.0);
+                chunker->set_early_exit(1.0);
+            }
+            else if (settings[s] == "updates")
+            {
+                tagger->set_early_exit(0.0);
+                chunker->set_early_exit(0.0);
+                std::vector<std::string> gold(document[0].size(), "NN");
+                tagger->update(document[0], gold);
+                tagger->snapshot();
+                std::vector<char> gold_labels(tagged[0].size(), 'B');
+                chunker->update(tagged[0], gold_labels);
+                chunker->snapshot();
+            }
+
+            for (std::size_t k = 0; k < apis.size(); ++k)
+            {
+                // warm up the workspace and the output vectors
+                apis[k].second();
+                std::size_t n = count(apis[k].second);
+                std::printf("%-12s %-24s %zu allocations\n",
+                    settings[s].c_str(), apis[k].first.c_str(), n);
+                if (n > 0)
+                    status = 1;
+            }
+        }
+
+        mltk_tagger_free(ctagger);
+        mltk_chunker_free(cchunker);
+        return status;
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "check-allocations: " << e.what() << std::endl;
+        return 2;
+    }
+}
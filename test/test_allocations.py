@@ -0,0 +1,29 @@
+
+import os
+import subprocess
+import unittest
+
+# built with "make check-allocations"
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+CHECK_PATH = os.path.join(ROOT, 'build', 'test', 'check-allocations')
+MODEL_DIR = os.path.join(ROOT, 'mltk', 'models')
+
+
+@unittest.skipUnless(os.path.exists(CHECK_PATH),
+    'check-allocations is not built')
+class TestAllocations(unittest.TestCase):
+    def test_no_allocations(self):
+        # every API tags without allocating once warmed up, exactly,
+        # with early exit and with online updates
+        proc = subprocess.Popen([CHECK_PATH, MODEL_DIR],
+            stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        out, err = proc.communicate()
+        self.assertEqual(proc.returncode, 0, out + err)
+        lines = out.strip().split(b'\n')
+        self.assertEqual(len(lines), 27)
+        for line in lines:
+            self.assertTrue(line.endswith(b' 0 allocations'), line)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -1,10 +1,33 @@
 
+import os
+import json
+import shutil
+import tempfile
 import unittest
+import threading
 
-from mltk.aptagger import FastPerceptronTagger
+import numpy as np
+
+from mltk.aptagger import FastPerceptronTagger, loaded_models, DEFAULT_MODEL
 
 tagger = FastPerceptronTagger()
 
+
+def pack_sentences(sentences):
+    '''
+    Pack tokenized sentences into a buffer and offset arrays,
+    for tag_packed/chunk_packed
+    '''
+    tokens = [token for sentence in sentences for token in sentence]
+    token_offsets = np.zeros((len(tokens), 2), dtype=np.int64)
+    start = 0
+    for k, token in enumerate(tokens):
+        token_offsets[k] = (start, start + len(token))
+        start += len(token) + 1
+    sentence_offsets = np.cumsum(
+        [0] + [len(sentence) for sentence in sentences]).astype(np.int64)
+    return ' '.join(tokens), token_offsets, sentence_offsets
+
 class TestFastPerceptronTagger(unittest.TestCase):
     def test_tag(self):
         tags = tagger.tag(['The', 'first', 'sentence', '.'])
@@ -178,6 +201,370 @@ class TestFastPerceptronTagger(unittest.TestCase):
              ('by', 'IN'),
              ('2', 'CD')])
 
+    def test_cache(self):
+        '''Repeated sentences are tagged from the cache'''
+        cached_tagger = FastPerceptronTagger()
+        cached_tagger.enable_cache(capacity=2)
+        sentences = [
+            ['The', 'first', 'sentence', '.'],
+            ['Another', 'sentence', '.'],
+            ['The', 'first', 'sentence', '.']]
+        self.assertEqual(
+            cached_tagger.tag_sents(sentences), tagger.tag_sents(sentences))
+        self.assertEqual(
+            cached_tagger.cache_info(),
+            {'hits': 1, 'misses': 2, 'size': 2, 'capacity': 2})
+
+        # the cache is bounded
+        cached_tagger.tag(['A', 'third', 'sentence', '.'])
+        self.assertEqual(cached_tagger.cache_info()['size'], 2)
+
+        cached_tagger.clear_cache()
+        self.assertEqual(
+            cached_tagger.cache_info(),
+            {'hits': 0, 'misses': 0, 'size': 0, 'capacity': 2})
+
+        cached_tagger.disable_cache()
+        self.assertEqual(cached_tagger.cache_info()['capacity'], 0)
+        self.assertRaises(ValueError, cached_tagger.enable_cache, 10, 'bad')
+
+    def test_load_model(self):
+        '''The model can be replaced, keeping the cache settings'''
+        reloaded_tagger = FastPerceptronTagger()
+        reloaded_tagger.enable_cache(capacity=5)
+        sentence = ['The', 'first', 'sentence', '.']
+        reloaded_tagger.tag(sentence)
+
+        reloaded_tagger.load_model()
+        self.assertEqual(reloaded_tagger.tag(sentence), tagger.tag(sentence))
+        self.assertEqual(
+            reloaded_tagger.cache_info(),
+            {'hits': 0, 'misses': 1, 'size': 1, 'capacity': 5})
+
+        # a bad model leaves the current one in place
+        self.assertRaises(IOError, reloaded_tagger.load_model, '/not/a/model')
+        self.assertEqual(reloaded_tagger.tag(sentence), tagger.tag(sentence))
+
+    def test_shared_model(self):
+        '''Taggers for the same model file share one copy of it'''
+        sentence = ['The', 'first', 'sentence', '.']
+        gold = ['DT', 'JJ', 'VB', '.']
+        tmpdir = tempfile.mkdtemp()
+        try:
+            path = os.path.join(tmpdir, 'model.json.gz')
+            shutil.copy(DEFAULT_MODEL, path)
+            first_tagger = FastPerceptronTagger(path)
+            second_tagger = FastPerceptronTagger(path)
+            self.assertEqual(
+                [model for model in loaded_models()
+                    if model[0] == os.path.realpath(path)],
+                [(os.path.realpath(path), None, 2)])
+            self.assertEqual(
+                second_tagger.tag(sentence), tagger.tag(sentence))
+
+            # replacing the file loads the new model
+            for k in range(20):
+                if first_tagger.update(sentence, gold) == 0:
+                    break
+            first_tagger.snapshot()
+            first_tagger.export_model(path)
+            self.assertEqual(
+                FastPerceptronTagger(path).tag(sentence),
+                list(zip(sentence, gold)))
+            self.assertEqual(
+                second_tagger.tag(sentence), tagger.tag(sentence))
+
+            # the model is freed with the last tagger using it
+            del first_tagger, second_tagger
+            self.assertEqual(
+                [model for model in loaded_models()
+                    if model[0] == os.path.realpath(path)], [])
+        finally:
+            shutil.rmtree(tmpdir)
+
+    def test_load_modes(self):
+        '''The model can be loaded when it's first used or in the background'''
+        text = [['The', 'first', 'sentence', '.'],
+            ['Mr.', 'Vinken', 'is', 'chairman', 'of', 'Elsevier', '.']]
+        tmpdir = tempfile.mkdtemp()
+        try:
+            path = os.path.join(tmpdir, 'model.json.gz')
+            shutil.copy(DEFAULT_MODEL, path)
+            for load in ('lazy', 'background'):
+                loading_tagger = FastPerceptronTagger(path, load=load)
+                self.assertEqual(
+                    loading_tagger.tag_sents(text), tagger.tag_sents(text))
+                del loading_tagger
+
+            # a request to load now loads a model another tagger requested
+            # lazily
+            path = os.path.join(tmpdir, 'lazy.json.gz')
+            shutil.copy(DEFAULT_MODEL, path)
+            lazy_tagger = FastPerceptronTagger(path, load='lazy')
+            loaded_tagger = FastPerceptronTagger(path)
+            self.assertEqual(
+                [model[0] for model in loaded_models()
+                    if model[0] == os.path.realpath(path)],
+                [os.path.realpath(path)])
+            self.assertEqual(
+                lazy_tagger.tag_sents(text), tagger.tag_sents(text))
+            del lazy_tagger, loaded_tagger
+        finally:
+            shutil.rmtree(tmpdir)
+
+        # errors are raised when the model is used
+        lazy_tagger = FastPerceptronTagger('/not/a/model', load='lazy')
+        self.assertRaises(IOError, lazy_tagger.tag, text[0])
+        self.assertRaises(IOError, lazy_tagger.tag_arrays, text)
+        for method in (lazy_tagger.snapshot, lazy_tagger.memory_usage,
+                lazy_tagger.enable_cache, lazy_tagger.cache_info):
+            self.assertRaises(IOError, method)
+        # the failed calls don't keep the model in use
+        lazy_tagger.load_model()
+        self.assertEqual(lazy_tagger.tag_sents(text), tagger.tag_sents(text))
+        self.assertRaises(ValueError, FastPerceptronTagger, load='later')
+
+    def test_tag_packed(self):
+        sentences = [
+            ['The', 'first', 'sentence', '.'],
+            [],
+            ['Another', '', 'sentence', '-', '5', '!']]
+        tags = tagger.tag_packed(*pack_sentences(sentences))
+        self.assertEqual(
+            tags,
+            [[tag for token, tag in sentence]
+                for sentence in tagger.tag_sents(sentences)])
+
+        self.assertEqual(
+            tagger.tag_packed('', np.zeros((0, 2), dtype=np.int64),
+                np.zeros(2, dtype=np.int64)),
+            [[]])
+
+    def test_submit(self):
+        '''Sentences submitted from many threads are tagged in batches'''
+        batch_tagger = FastPerceptronTagger()
+        batch_tagger.enable_batching(max_batch_size=4, max_delay=0.01)
+        sentences = [['The', 'first', 'sentence', '.'],
+            ['Another', 'sentence', '!'], [], ['A', 'fourth', 'one']] * 5
+
+        futures = [None] * len(sentences)
+        def submit(k):
+            futures[k] = batch_tagger.submit(sentences[k])
+        threads = [threading.Thread(target=submit, args=(k, ))
+            for k in range(len(sentences))]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+
+        self.assertEqual(
+            [future.result(timeout=10) for future in futures],
+            tagger.tag_sents(sentences))
+
+        # queued sentences are finished when batching is disabled
+        future = batch_tagger.submit(sentences[0])
+        batch_tagger.disable_batching()
+        self.assertEqual(future.result(timeout=0), tagger.tag(sentences[0]))
+
+    def test_threads(self):
+        '''Tagging on threads, with long sentences split, gives the same tags'''
+        text = [['Pierre', 'Vinken', ',', '61', 'years', 'old', ',',
+            'will', 'join', 'the', 'board', 'as', 'a', 'nonexecutive',
+            'director', 'Nov.', '29', '.'],
+            ['Mr.', 'Vinken', 'is', 'chairman', 'of', 'Elsevier', 'N.V.',
+            ',', 'the', 'Dutch', 'publishing', 'group', '.']]
+        # a long run on sentence, like a table in a web page
+        sentences = text + [[]] + [sum(text * 20, [])] + text
+        expected = tagger.tag_sents(sentences)
+
+        threaded_tagger = FastPerceptronTagger()
+        threaded_tagger.enable_threads(nthreads=3, task_tokens=7)
+        self.assertEqual(threaded_tagger.tag_sents(sentences), expected)
+        self.assertEqual(threaded_tagger.tag(sentences[3]), expected[3])
+        self.assertEqual(threaded_tagger.tag_sents([]), [])
+
+        # documents tagged from several threads at once share the threads
+        results = [None] * 4
+        def tag_sents(k):
+            results[k] = [threaded_tagger.tag_sents(sentences[k:])
+                for i in range(5)]
+        threads = [threading.Thread(target=tag_sents, args=(k, ))
+            for k in range(len(results))]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        for k, result in enumerate(results):
+            self.assertEqual(result, [expected[k:]] * 5)
+
+        threaded_tagger.disable_threads()
+        self.assertEqual(threaded_tagger.tag_sents(sentences), expected)
+
+    def test_tag_arrays(self):
+        sentences = [
+            ['The', 'first', 'sentence', '.'],
+            [],
+            ['Another', 'sentence', '!']]
+        tag_ids, sentence_offsets = tagger.tag_arrays(sentences)
+        self.assertEqual(tag_ids.dtype, np.uint8)
+        self.assertEqual(sentence_offsets.dtype, np.int64)
+        self.assertEqual(list(sentence_offsets), [0, 4, 4, 7])
+
+        names = tagger.tag_names()
+        self.assertEqual(
+            [names[k] for k in tag_ids],
+            [tag for sentence in tagger.tag_sents(sentences)
+                for token, tag in sentence])
+
+        self.assertTrue(np.array_equal(
+            tagger.tag_packed(*pack_sentences(sentences), arrays=True),
+            tag_ids))
+
+    def test_tag_packed_bad_offsets(self):
+        text, token_offsets, sentence_offsets = pack_sentences(
+            [['The', 'first', 'sentence', '.']])
+        self.assertRaises(ValueError, tagger.tag_packed,
+            text[:5], token_offsets, sentence_offsets)
+        self.assertRaises(ValueError, tagger.tag_packed,
+            text, token_offsets, sentence_offsets + 1)
+        self.assertRaises(ValueError, tagger.tag_packed,
+            text, token_offsets.reshape(1, 8), sentence_offsets)
+
+    def test_update(self):
+        '''Online updates are used after a snapshot, and can be exported'''
+        updated_tagger = FastPerceptronTagger()
+        updated_tagger.enable_cache()
+        sentence = ['The', 'first', 'sentence', '.']
+        gold = ['DT', 'JJ', 'VB', '.']
+        original = tagger.tag(sentence)
+        self.assertEqual(updated_tagger.tag(sentence), original)
+
+        self.assertEqual(updated_tagger.update(sentence, gold), 1)
+        for k in range(20):
+            if updated_tagger.update(sentence, gold) == 0:
+                break
+        self.assertEqual(updated_tagger.update(sentence, gold), 0)
+
+        # not used until the snapshot
+        self.assertEqual(updated_tagger.tag(sentence), original)
+        updated_tagger.snapshot()
+        self.assertEqual(
+            updated_tagger.tag(sentence), list(zip(sentence, gold)))
+
+        tmpdir = tempfile.mkdtemp()
+        try:
+            path = os.path.join(tmpdir, 'model.json.gz')
+            updated_tagger.export_model(path)
+            self.assertEqual(
+                FastPerceptronTagger(model_path=path).tag(sentence),
+                list(zip(sentence, gold)))
+        finally:
+            shutil.rmtree(tmpdir)
+
+        updated_tagger.reset_updates()
+        self.assertEqual(updated_tagger.tag(sentence), original)
+        self.assertRaises(
+            ValueError, updated_tagger.update, sentence, ['DT', 'JJ'])
+        self.assertRaises(
+            ValueError, updated_tagger.update, sentence, gold[:2] + ['X', '.'])
+
+    def test_export_exact(self):
+        '''Exported weights read back exactly'''
+        rng = np.random.RandomState(0)
+        def class_weights():
+            return [[tag, float(rng.randn() * 10 ** rng.randint(-6, 3))]
+                for tag in ('DT', 'JJ', 'NN', 'VB')]
+        model = {
+            'weights': [dict((word, class_weights())
+                for word in ('the', 'first', 'sentence'))
+                for k in range(13)],
+            'bias_weights': class_weights(),
+            'specified_tags': {'.': '.'}}
+
+        def read_weights(model):
+            weights = {}
+            for k, feature in enumerate(model['weights']):
+                for word, values in feature.items():
+                    for tag, weight in values:
+                        weights[k, word, tag] = np.float32(weight)
+            for tag, weight in model['bias_weights']:
+                weights['bias', tag] = np.float32(weight)
+            return weights
+
+        tmpdir = tempfile.mkdtemp()
+        try:
+            path = os.path.join(tmpdir, 'model.json')
+            with open(path, 'w') as fout:
+                json.dump(model, fout)
+            exported_path = os.path.join(tmpdir, 'exported.json')
+            FastPerceptronTagger(model_path=path).export_model(exported_path)
+            with open(exported_path) as fin:
+                exported = json.load(fin)
+            self.assertEqual(read_weights(exported), read_weights(model))
+        finally:
+            shutil.rmtree(tmpdir)
+
+    def test_memory_usage(self):
+        '''memory_usage reports each template, and pruning shrinks it'''
+        usage = tagger.memory_usage()
+        self.assertEqual(len(usage), 13)
+        self.assertEqual(usage[0]['name'], 'suffix')
+        for template in usage:
+            self.assertTrue(template['entries'] > 0)
+            self.assertTrue(template['bytes'] > 0)
+            self.assertTrue(0.0 < template['load_factor'] <= 0.1)
+        total = sum(template['bytes'] for template in usage)
+
+        tmpdir = tempfile.mkdtemp()
+        try:
+            path = os.path.join(tmpdir, 'pruned.json.gz')
+            tagger.export_model(path, max_bytes=total // 3)
+            pruned = FastPerceptronTagger(model_path=path)
+            pruned_total = sum(
+                template['bytes'] for template in pruned.memory_usage())
+            self.assertTrue(total // 4 < pruned_total < total // 2)
+            # the most important weights are kept
+            self.assertEqual(
+                pruned.tag(['The', 'first', 'sentence', '.']),
+                tagger.tag(['The', 'first', 'sentence', '.']))
+        finally:
+            shutil.rmtree(tmpdir)
+
+    def test_huge_pages(self):
+        '''The weights can be in huge pages, with the same tags'''
+        text = [['The', 'first', 'sentence', '.'],
+            ['Mr.', 'Vinken', 'is', 'chairman', 'of', 'Elsevier', '.']]
+        for mode in ('thp', 'hugetlb'):
+            huge_tagger = FastPerceptronTagger(huge_pages=mode)
+            self.assertEqual(
+                huge_tagger.tag_sents(text), tagger.tag_sents(text))
+            huge_tagger.load_model()
+            self.assertEqual(
+                huge_tagger.tag_sents(text), tagger.tag_sents(text))
+        self.assertRaises(ValueError, FastPerceptronTagger, huge_pages='2MB')
+
+    def test_early_exit(self):
+        '''With bound_scale 1 early exit gives the same tags'''
+        text = [
+            ['Pierre', 'Vinken', ',', '61', 'years', 'old', ',', 'will',
+            'join', 'the', 'board', 'as', 'a', 'nonexecutive', 'director',
+            'Nov.', '29', '.'],
+            ['The', 'first', 'sentence', '.']]
+        early_tagger = FastPerceptronTagger()
+        early_tagger.enable_early_exit()
+        self.assertEqual(early_tagger.tag_sents(text), tagger.tag_sents(text))
+
+        # an approximation, but still tags every token
+        early_tagger.enable_early_exit(0.01)
+        self.assertEqual(
+            [[token for token, tag in sent]
+                for sent in early_tagger.tag_sents(text)],
+            text)
+
+        early_tagger.disable_early_exit()
+        self.assertEqual(early_tagger.tag_sents(text), tagger.tag_sents(text))
+        self.assertRaises(ValueError, early_tagger.enable_early_exit, -1.0)
+
 
 if __name__ == '__main__':
     unittest.main()
@@ -0,0 +1,116 @@
+
+import os
+import shutil
+import tempfile
+import unittest
+import ctypes
+
+# the C library is built with "make lib"
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+LIB_PATH = os.path.join(ROOT, 'build', 'libmltk', 'libmltk.so')
+MODEL_DIR = os.path.join(ROOT, 'mltk', 'models')
+
+
+def load_library():
+    lib = ctypes.CDLL(LIB_PATH)
+    lib.mltk_last_error.restype = ctypes.c_char_p
+    lib.mltk_tagger_load.restype = ctypes.c_void_p
+    lib.mltk_tagger_load.argtypes = [ctypes.c_char_p]
+    lib.mltk_tagger_free.argtypes = [ctypes.c_void_p]
+    lib.mltk_tagger_reload.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+    lib.mltk_tagger_tag.argtypes = [ctypes.c_void_p,
+        ctypes.POINTER(ctypes.c_char_p), ctypes.c_size_t,
+        ctypes.POINTER(ctypes.c_char_p)]
+    lib.mltk_chunker_load.restype = ctypes.c_void_p
+    lib.mltk_chunker_load.argtypes = [ctypes.c_char_p]
+    lib.mltk_chunker_free.argtypes = [ctypes.c_void_p]
+    lib.mltk_chunker_reload.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+    lib.mltk_chunker_chunk.argtypes = [ctypes.c_void_p,
+        ctypes.POINTER(ctypes.c_char_p), ctypes.POINTER(ctypes.c_char_p),
+        ctypes.c_size_t, ctypes.c_char_p]
+    return lib
+
+
+@unittest.skipUnless(os.path.exists(LIB_PATH), 'libmltk is not built')
+class TestLibMltk(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.lib = load_library()
+        cls.tagger = cls.lib.mltk_tagger_load(
+            os.path.join(MODEL_DIR, 'aptagger-0.1.0.json.gz').encode())
+        cls.chunker = cls.lib.mltk_chunker_load(
+            os.path.join(MODEL_DIR, 'np_chunker.json.gz').encode())
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.lib.mltk_tagger_free(cls.tagger)
+        cls.lib.mltk_chunker_free(cls.chunker)
+
+    def test_tag_and_chunk(self):
+        tokens = [b'The', b'first', b'sentence', b'.', b'(', b'']
+        ntokens = len(tokens)
+        ctokens = (ctypes.c_char_p * ntokens)(*tokens)
+        ctags = (ctypes.c_char_p * ntokens)()
+        self.assertEqual(
+            self.lib.mltk_tagger_tag(self.tagger, ctokens, ntokens, ctags), 0)
+        self.assertEqual(
+            list(ctags), [b'DT', b'JJ', b'NN', b'.', b'(', b'NN'])
+
+        labels = ctypes.create_string_buffer(ntokens)
+        self.assertEqual(
+            self.lib.mltk_chunker_chunk(
+                self.chunker, ctokens, ctags, ntokens, labels), 0)
+        self.assertEqual(labels.raw, b'BIIOOO')
+
+    def test_reload(self):
+        tagger = self.lib.mltk_tagger_load(
+            os.path.join(MODEL_DIR, 'aptagger-0.1.0.json.gz').encode())
+        tokens = (ctypes.c_char_p * 2)(b'The', b'end')
+        tags = (ctypes.c_char_p * 2)()
+        self.assertEqual(self.lib.mltk_tagger_tag(tagger, tokens, 2, tags), 0)
+        self.assertEqual(
+            self.lib.mltk_tagger_reload(
+                tagger,
+                os.path.join(MODEL_DIR, 'aptagger-0.1.0.json.gz').encode()),
+            0)
+        # the old tag strings are still valid after the reload
+        self.assertEqual(list(tags), [b'DT', b'NN'])
+        self.assertEqual(self.lib.mltk_tagger_tag(tagger, tokens, 2, tags), 0)
+        self.assertEqual(list(tags), [b'DT', b'NN'])
+
+        # a failed reload keeps the current model
+        self.assertEqual(
+            self.lib.mltk_tagger_reload(tagger, b'/does/not/exist'), -1)
+        self.assertEqual(self.lib.mltk_tagger_tag(tagger, tokens, 2, tags), 0)
+        self.lib.mltk_tagger_free(tagger)
+
+        self.assertEqual(
+            self.lib.mltk_chunker_reload(self.chunker, b'/does/not/exist'), -1)
+
+    def test_load_error(self):
+        self.assertEqual(self.lib.mltk_tagger_load(b'/does/not/exist'), None)
+        self.assertTrue(b'/does/not/exist' in self.lib.mltk_last_error())
+        self.assertEqual(
+            self.lib.mltk_tagger_tag(None, None, 0, None), -1)
+
+    def test_invalid_json(self):
+        tmpdir = tempfile.mkdtemp()
+        try:
+            path = os.path.join(tmpdir, 'model.json')
+            for text, message in [
+                    (b'{"specified_tags": {"\\ud800\\u0041": "NN"}}',
+                        b'invalid unicode surrogate pair'),
+                    (b'{"bias_weights": [["NN", 1.2.3]]}', b"expected ']'"),
+                    (b'{"bias_weights": [["NN", -]]}',
+                        b'expected a number')]:
+                with open(path, 'wb') as fout:
+                    fout.write(text)
+                self.assertEqual(self.lib.mltk_tagger_load(path.encode()),
+                    None)
+                self.assertTrue(message in self.lib.mltk_last_error())
+        finally:
+            shutil.rmtree(tmpdir)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,64 @@
+
+import os
+import shutil
+import subprocess
+import tempfile
+import unittest
+
+# the command line tools are built with "make cli"
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+PRUNE_PATH = os.path.join(ROOT, 'build', 'bin', 'mltk-prune')
+MODEL_PATH = os.path.join(ROOT, 'mltk', 'models', 'aptagger-0.1.0.json.gz')
+
+
+def run(args):
+    proc = subprocess.Popen([PRUNE_PATH] + args,
+        stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    out, err = proc.communicate()
+    return proc.returncode, out, err
+
+
+def total_bytes(report):
+    '''the total bytes in each of the reports mltk-prune prints'''
+    return [int(line.split()[2]) for line in report.split(b'\n')
+        if line.startswith(b'total')]
+
+
+@unittest.skipUnless(os.path.exists(PRUNE_PATH), 'mltk-prune is not built')
+class TestMltkPrune(unittest.TestCase):
+    def setUp(self):
+        self.tmpdir = tempfile.mkdtemp()
+
+    def tearDown(self):
+        shutil.rmtree(self.tmpdir)
+
+    def test_report(self):
+        code, out, err = run([MODEL_PATH])
+        self.assertEqual(code, 0)
+        self.assertTrue(b'prev tag+word' in out)
+        self.assertEqual(len(total_bytes(out)), 1)
+
+    def test_prune(self):
+        path = os.path.join(self.tmpdir, 'pruned.json.gz')
+        code, out, err = run(['--max-bytes', '5M', '-o', path, MODEL_PATH])
+        self.assertEqual(code, 0)
+        self.assertTrue(os.path.exists(path))
+        original, pruned = total_bytes(out)
+        self.assertTrue(pruned < original)
+        self.assertTrue(4.5e6 < pruned < 5.5e6)
+
+        # the pruned model can be reported (and loaded) again
+        code, out, err = run([path])
+        self.assertEqual(code, 0)
+        self.assertEqual(total_bytes(out), [pruned])
+
+    def test_bad_args(self):
+        code, out, err = run(['--max-bytes', '5M', MODEL_PATH])
+        self.assertEqual(code, 2)
+        code, out, err = run(['--max-bytes', '5X', '-o', 'x', MODEL_PATH])
+        self.assertEqual(code, 1)
+        self.assertTrue(b'Invalid size' in err)
+
+
+if __name__ == "__main__":
+    unittest.main()
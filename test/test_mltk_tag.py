@@ -0,0 +1,130 @@
+
+import os
+import json
+import shutil
+import struct
+import tempfile
+import subprocess
+import unittest
+
+# the command line tagger is built with "make cli"
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+CLI_PATH = os.path.join(ROOT, 'build', 'bin', 'mltk-tag')
+
+
+def run(args, text):
+    proc = subprocess.Popen([CLI_PATH] + args, stdin=subprocess.PIPE,
+        stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    out, err = proc.communicate(text)
+    return proc.returncode, out, err
+
+
+@unittest.skipUnless(os.path.exists(CLI_PATH), 'mltk-tag is not built')
+class TestMltkTag(unittest.TestCase):
+    def test_tokenized_tsv(self):
+        text = b'The first sentence .\n\nAnother one .\n'
+        code, out, err = run(['--chunk', '--threads', '2'], text)
+        self.assertEqual(code, 0)
+        self.assertEqual(
+            out,
+            b'The\tDT\tB\nfirst\tJJ\tI\nsentence\tNN\tI\n.\t.\tO\n\n'
+            b'\n'
+            b'Another\tDT\tB\none\tCD\tI\n.\t.\tO\n\n')
+        self.assertTrue(b'tokens/sec' in err)
+
+    def test_raw_input(self):
+        text = b'"Really?" he asked. It\'s (mostly) fine.\n'
+        code, out, err = run(['--input', 'raw'], text)
+        self.assertEqual(code, 0)
+        sentences = [[line.split(b'\t')[0] for line in s.split(b'\n')]
+            for s in out.strip(b'\n').split(b'\n\n')]
+        self.assertEqual(
+            sentences,
+            [[b'``', b'Really', b'?', b"''"],
+             [b'he', b'asked', b'.'],
+             [b'It', b"'s", b'(', b'mostly', b')', b'fine', b'.']])
+
+    def test_abbreviations(self):
+        '''Abbreviations keep their period, other words at the end of a
+        sentence don't'''
+        text = b'I met Tom. He said hi to Ann. Mr. Smith of the U.S. left.\n'
+        code, out, err = run(['--input', 'raw'], text)
+        self.assertEqual(code, 0)
+        sentences = [[line.split(b'\t')[0] for line in s.split(b'\n')]
+            for s in out.strip(b'\n').split(b'\n\n')]
+        self.assertEqual(
+            sentences,
+            [[b'I', b'met', b'Tom', b'.'],
+             [b'He', b'said', b'hi', b'to', b'Ann', b'.'],
+             [b'Mr.', b'Smith', b'of', b'the', b'U.S.', b'left', b'.']])
+
+    def test_ordered_output(self):
+        '''Output is in input order, no matter the number of threads'''
+        text = b''.join(
+            b'Sentence number ' + str(k).encode() + b' .\n'
+            for k in range(500))
+        code, out1, err = run(['--threads', '1'], text)
+        code, out4, err = run(['--threads', '4', '--batch-size', '3'], text)
+        self.assertEqual(out1, out4)
+
+    def test_placement(self):
+        '''Huge pages and NUMA replicas don't change the output'''
+        text = b''.join(
+            b'Sentence number ' + str(k).encode() + b' .\n'
+            for k in range(100))
+        code, expected, err = run(['--chunk'], text)
+        for args in (['--huge-pages', 'thp'], ['--huge-pages', 'hugetlb'],
+                ['--numa', '--threads', '4']):
+            code, out, err = run(['--chunk'] + args, text)
+            self.assertEqual(code, 0)
+            self.assertEqual(out, expected)
+        code, out, err = run(['--huge-pages', '1G'], text)
+        self.assertEqual(code, 1)
+
+    def test_binary(self):
+        code, out, err = run(
+            ['--chunk', '--output', 'binary'], b'The first sentence .\n')
+        self.assertEqual(code, 0)
+        self.assertEqual(out[:6], b'MLTK\x01\x01')
+        ntags = struct.unpack('<H', out[6:8])[0]
+        tags = []
+        pos = 8
+        for k in range(ntags):
+            n = struct.unpack('B', out[pos:pos + 1])[0]
+            tags.append(out[pos + 1:pos + 1 + n])
+            pos += n + 1
+        ntokens = struct.unpack('<I', out[pos:pos + 4])[0]
+        ids = struct.unpack('4B', out[pos + 4:pos + 8])
+        self.assertEqual(ntokens, 4)
+        self.assertEqual([tags[k] for k in ids], [b'DT', b'JJ', b'NN', b'.'])
+        self.assertEqual(out[pos + 8:], b'BIIO')
+
+    def test_binary_too_many_tags(self):
+        '''Models whose tag ids don't fit in a byte are rejected'''
+        tmpdir = tempfile.mkdtemp()
+        try:
+            path = os.path.join(tmpdir, 'model.json')
+            with open(path, 'w') as fout:
+                json.dump({
+                    'weights': [{} for k in range(13)],
+                    'bias_weights': [['NN', 0.0]],
+                    'specified_tags': dict(
+                        ('w%d' % k, 'T%d' % k) for k in range(300))}, fout)
+            args = ['--tagger-model', path]
+            code, out, err = run(args, b'w299 .\n')
+            self.assertEqual(code, 0)
+            self.assertTrue(out.startswith(b'w299\tT299\n'))
+            code, out, err = run(args + ['--output', 'binary'], b'w299 .\n')
+            self.assertEqual(code, 1)
+            self.assertEqual(out, b'')
+            self.assertTrue(b'too many tags' in err)
+        finally:
+            shutil.rmtree(tmpdir)
+
+    def test_bad_option(self):
+        code, out, err = run(['--output', 'xml'], b'')
+        self.assertEqual(code, 1)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,80 @@
+
+import os
+import shutil
+import subprocess
+import tempfile
+import unittest
+
+# the command line tools are built with "make cli"
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+TAG_PATH = os.path.join(ROOT, 'build', 'bin', 'mltk-tag')
+TRAIN_PATH = os.path.join(ROOT, 'build', 'bin', 'mltk-train')
+
+
+def run(path, args, text=b''):
+    proc = subprocess.Popen([path] + args, stdin=subprocess.PIPE,
+        stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    out, err = proc.communicate(text)
+    return proc.returncode, out, err
+
+
+def read_tsv(out):
+    return [line.split(b'\t') for line in out.split(b'\n') if line]
+
+
+@unittest.skipUnless(os.path.exists(TRAIN_PATH), 'mltk-train is not built')
+class TestMltkTrain(unittest.TestCase):
+    def setUp(self):
+        # tag some text with the shipped models to train on
+        with open(os.path.join(ROOT, 'README.md'), 'rb') as fin:
+            code, self.gold, err = run(
+                TAG_PATH, ['--input', 'raw', '--chunk'], fin.read())
+        self.tokenized = b'\n'.join(
+            b' '.join(line.split(b'\t')[0] for line in sentence.split(b'\n'))
+            for sentence in self.gold.strip(b'\n').split(b'\n\n')) + b'\n'
+        self.tmpdir = tempfile.mkdtemp()
+
+    def tearDown(self):
+        shutil.rmtree(self.tmpdir)
+
+    def agreement(self, args, column):
+        code, out, err = run(TAG_PATH, args, self.tokenized)
+        self.assertEqual(code, 0)
+        gold = read_tsv(self.gold)
+        predicted = read_tsv(out)
+        self.assertEqual(len(gold), len(predicted))
+        return sum(g[column] == p[column]
+            for g, p in zip(gold, predicted)) / float(len(gold))
+
+    def test_train_tagger(self):
+        path = os.path.join(self.tmpdir, 'tagger.json.gz')
+        code, out, err = run(
+            TRAIN_PATH, ['--output', path, '--threads', '2'], self.gold)
+        self.assertEqual(code, 0)
+        self.assertTrue(b'Trained on' in err)
+        self.assertTrue(
+            self.agreement(['--tagger-model', path], 1) > 0.95)
+
+    def test_train_chunker(self):
+        path = os.path.join(self.tmpdir, 'chunker.json')
+        code, out, err = run(
+            TRAIN_PATH, ['--model', 'chunker', '-o', path], self.gold)
+        self.assertEqual(code, 0)
+        self.assertTrue(
+            self.agreement(['--chunk', '--chunker-model', path], 2) > 0.95)
+
+    def test_bad_input(self):
+        path = os.path.join(self.tmpdir, 'model.json')
+        code, out, err = run(
+            TRAIN_PATH, ['--model', 'chunker', '-o', path], b'The\tDT\n')
+        self.assertEqual(code, 1)
+        self.assertTrue(b'IOB labels' in err)
+        # words usually tagged XX would get it as a specified tag
+        code, out, err = run(
+            TRAIN_PATH, ['-o', path], b'The\tDT\n\nThe\tDT\n\nThe\tXX\n')
+        self.assertEqual(code, 1)
+        self.assertTrue(b'Unknown tag' in err)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -1,13 +1,34 @@
 
+import os
+import shutil
+import tempfile
 import unittest
 
+import numpy as np
+
 from mltk.aptagger import FastPerceptronTagger
-from mltk.np_chunker import NPChunker
+from mltk.np_chunker import NPChunker, loaded_models, DEFAULT_MODEL
 
 tagger = FastPerceptronTagger()
 chunker = NPChunker()
 
 
+def pack_sentences(sentences):
+    '''
+    Pack tokenized sentences into a buffer and offset arrays,
+    for tag_packed/chunk_packed
+    '''
+    tokens = [token for sentence in sentences for token in sentence]
+    token_offsets = np.zeros((len(tokens), 2), dtype=np.int64)
+    start = 0
+    for k, token in enumerate(tokens):
+        token_offsets[k] = (start, start + len(token))
+        start += len(token) + 1
+    sentence_offsets = np.cumsum(
+        [0] + [len(sentence) for sentence in sentences]).astype(np.int64)
+    return ' '.join(tokens), token_offsets, sentence_offsets
+
+
 class TestNPChunker(unittest.TestCase):
     def setUp(self):
         self.text_tags_iob = [
@@ -129,6 +150,217 @@ class TestNPChunker(unittest.TestCase):
         chunks = chunker.chunk(sentence)
         self.assertEqual(chunks, [[('The', 'DT'), ('sentence', 'NN')]])
 
+    def test_cache(self):
+        '''Repeated sentences are chunked from the cache'''
+        cached_chunker = NPChunker()
+        cached_chunker.enable_cache(capacity=10, policy='fifo')
+        text_tags = [[(t[0], t[1]) for t in sent]
+            for sent in self.text_tags_iob]
+        text_tags.append(text_tags[0])
+        self.assertEqual(
+            cached_chunker.chunk_sents(text_tags, True),
+            chunker.chunk_sents(text_tags, True))
+        self.assertEqual(
+            cached_chunker.chunk_sents(text_tags),
+            chunker.chunk_sents(text_tags))
+        self.assertEqual(
+            cached_chunker.cache_info(),
+            {'hits': 5, 'misses': 3, 'size': 3, 'capacity': 10})
+
+    def test_load_model(self):
+        '''The model can be replaced while in use'''
+        reloaded_chunker = NPChunker()
+        text_tags = [[(t[0], t[1]) for t in sent]
+            for sent in self.text_tags_iob]
+        reloaded_chunker.load_model()
+        self.assertEqual(
+            reloaded_chunker.chunk_sents(text_tags, True),
+            chunker.chunk_sents(text_tags, True))
+        self.assertRaises(IOError, reloaded_chunker.load_model, '/not/a/model')
+
+    def test_shared_model(self):
+        '''Chunkers for the same model file share one copy of it'''
+        text_tags = [[(t[0], t[1]) for t in sent]
+            for sent in self.text_tags_iob]
+        tmpdir = tempfile.mkdtemp()
+        try:
+            path = os.path.join(tmpdir, 'model.json.gz')
+            shutil.copy(DEFAULT_MODEL, path)
+            chunkers = [NPChunker(path), NPChunker(path, load='lazy'),
+                NPChunker(path, load='background')]
+            self.assertEqual(
+                [model for model in loaded_models()
+                    if model[0] == os.path.realpath(path)],
+                [(os.path.realpath(path), None, 3)])
+            for shared_chunker in chunkers:
+                self.assertEqual(
+                    shared_chunker.chunk_sents(text_tags, True),
+                    self.text_tags_iob)
+            del chunkers, shared_chunker
+            self.assertEqual(
+                [model for model in loaded_models()
+                    if model[0] == os.path.realpath(path)], [])
+        finally:
+            shutil.rmtree(tmpdir)
+
+        lazy_chunker = NPChunker('/not/a/model', load='lazy')
+        self.assertRaises(IOError, lazy_chunker.chunk_sents, text_tags)
+        for method in (lazy_chunker.snapshot, lazy_chunker.enable_cache,
+                lazy_chunker.cache_info):
+            self.assertRaises(IOError, method)
+        # the failed calls don't keep the model in use
+        lazy_chunker.load_model()
+        self.assertEqual(lazy_chunker.chunk_sents(text_tags),
+            chunker.chunk_sents(text_tags))
+        self.assertRaises(ValueError, NPChunker, load='later')
+
+    def test_update(self):
+        '''Online updates are used after a snapshot, and can be exported'''
+        def chunk_iob(chunker, sentence):
+            return chunker.chunk_sents([sentence], True)[0]
+
+        updated_chunker = NPChunker()
+        sentence = [('The', 'DT'), ('first', 'JJ'), ('sentence', 'NN'),
+            ('.', '.')]
+        gold = 'BOBO'
+        original = chunk_iob(chunker, sentence)
+        expected = [(t[0], t[1], l) for t, l in zip(sentence, gold)]
+        self.assertNotEqual(original, expected)
+
+        for k in range(20):
+            if updated_chunker.update(sentence, gold) == 0:
+                break
+        self.assertEqual(updated_chunker.update(sentence, list(gold)), 0)
+
+        # not used until the snapshot
+        self.assertEqual(chunk_iob(updated_chunker, sentence), original)
+        updated_chunker.snapshot()
+        self.assertEqual(chunk_iob(updated_chunker, sentence), expected)
+
+        tmpdir = tempfile.mkdtemp()
+        try:
+            path = os.path.join(tmpdir, 'model.json.gz')
+            updated_chunker.export_model(path)
+            self.assertEqual(
+                chunk_iob(NPChunker(model_path=path), sentence), expected)
+        finally:
+            shutil.rmtree(tmpdir)
+
+        updated_chunker.reset_updates()
+        self.assertEqual(chunk_iob(updated_chunker, sentence), original)
+        self.assertRaises(
+            ValueError, updated_chunker.update, sentence, 'BIXO')
+
+    def test_huge_pages(self):
+        '''The weights can be in huge pages, with the same labels'''
+        text_tags = [[(t[0], t[1]) for t in sent]
+            for sent in self.text_tags_iob]
+        for mode in ('thp', 'hugetlb'):
+            huge_chunker = NPChunker(huge_pages=mode)
+            self.assertEqual(
+                huge_chunker.chunk_sents(text_tags, True), self.text_tags_iob)
+        self.assertRaises(ValueError, NPChunker, huge_pages='2MB')
+
+    def test_early_exit(self):
+        '''With bound_scale 1 early exit gives the same labels'''
+        text_tags = [[(t[0], t[1]) for t in sent]
+            for sent in self.text_tags_iob]
+        early_chunker = NPChunker()
+        early_chunker.enable_early_exit()
+        self.assertEqual(
+            early_chunker.chunk_sents(text_tags, True), self.text_tags_iob)
+
+        early_chunker.enable_early_exit(0.01)
+        self.assertEqual(
+            len(early_chunker.chunk_arrays(text_tags)[0]),
+            sum(len(sent) for sent in text_tags))
+
+        early_chunker.disable_early_exit()
+        self.assertEqual(
+            early_chunker.chunk_sents(text_tags, True), self.text_tags_iob)
+
+    def test_chunk_spans(self):
+        text_tags = [[(t[0], t[1]) for t in sent]
+            for sent in self.text_tags_iob]
+        text_tags.insert(1, [])
+        spans = chunker.chunk_spans(text_tags)
+        self.assertEqual(spans[:3], [(0, 0, 2), (0, 3, 5), (0, 9, 11)])
+        self.assertEqual(
+            [[text_tags[j][start:end] for j, start, end in spans
+                if j == k] for k in range(len(text_tags))],
+            chunker.chunk_sents(text_tags))
+
+    def test_chunk_arrays(self):
+        text_tags = [[(t[0], t[1]) for t in sent]
+            for sent in self.text_tags_iob]
+        labels, sentence_offsets = chunker.chunk_arrays(text_tags)
+        self.assertEqual(labels.dtype, np.uint8)
+        self.assertEqual(
+            list(sentence_offsets),
+            list(np.cumsum([0] + [len(sent) for sent in text_tags])))
+        self.assertEqual(
+            [chr(label) for label in labels],
+            [label for sent in self.text_tags_iob
+                for token, tag, label in sent])
+
+    def test_chunk_packed(self):
+        text_tags = [[(t[0], t[1]) for t in sent]
+            for sent in self.text_tags_iob]
+        text, token_offsets, sentence_offsets = pack_sentences(
+            [[token for token, tag in sent] for sent in text_tags])
+        tag_buffer, tag_offsets, _ = pack_sentences(
+            [[tag for token, tag in sent] for sent in text_tags])
+        labels = chunker.chunk_packed(
+            text, token_offsets, sentence_offsets, tag_buffer, tag_offsets)
+        self.assertEqual(
+            labels,
+            [[label for token, tag, label in sent]
+                for sent in self.text_tags_iob])
+
+        self.assertTrue(np.array_equal(
+            chunker.chunk_packed(text, token_offsets, sentence_offsets,
+                tag_buffer, tag_offsets, arrays=True),
+            chunker.chunk_arrays(text_tags)[0]))
+
+        self.assertRaises(ValueError, chunker.chunk_packed,
+            text, token_offsets, sentence_offsets, tag_buffer,
+            tag_offsets[:-1])
+
+    def test_count_noun_phrases(self):
+        '''The noun phrase counts are the same as counting chunk_sents'''
+        text_tags = [[(t[0], t[1]) for t in sent]
+            for sent in self.text_tags_iob]
+        expected = {}
+        for sent in chunker.chunk_sents(text_tags):
+            for phrase in sent:
+                key = ' '.join(token for token, tag in phrase)
+                expected[key] = expected.get(key, 0) + 1
+        counts = chunker.count_noun_phrases(text_tags)
+        self.assertEqual(counts, expected)
+        self.assertEqual(counts['a nonexecutive director'], 2)
+        self.assertEqual(counts['chairman'], 2)
+
+        lowercase = chunker.count_noun_phrases(text_tags, 'lower')
+        self.assertEqual(lowercase['mr. vinken'], 1)
+        self.assertEqual(sum(lowercase.values()), sum(counts.values()))
+
+        normalized = chunker.count_noun_phrases(text_tags, 'normalize')
+        self.assertEqual(normalized['!DIGITS years'], 2)
+        self.assertEqual(normalized['nov. !DIGITS'], 1)
+
+        text, token_offsets, sentence_offsets = pack_sentences(
+            [[token for token, tag in sent] for sent in text_tags])
+        tag_buffer, tag_offsets, _ = pack_sentences(
+            [[tag for token, tag in sent] for sent in text_tags])
+        self.assertEqual(
+            chunker.count_noun_phrases_packed(text, token_offsets,
+                sentence_offsets, tag_buffer, tag_offsets, 'lower'),
+            lowercase)
+
+        self.assertEqual(chunker.count_noun_phrases([]), {})
+        self.assertRaises(
+            ValueError, chunker.count_noun_phrases, text_tags, 'upper')
+
 
 if __name__ == '__main__':
     unittest.main()
@@ -0,0 +1,101 @@
+
+import os
+import signal
+import unittest
+
+import numpy as np
+
+from mltk.aptagger import FastPerceptronTagger
+from mltk.np_chunker import NPChunker
+from mltk.process_pool import ProcessPool
+from test_np_chunker import pack_sentences
+
+tagger = FastPerceptronTagger()
+chunker = NPChunker()
+
+
+class TestProcessPool(unittest.TestCase):
+    def setUp(self):
+        sentences = [
+            ['Pierre', 'Vinken', ',', '61', 'years', 'old', ',', 'will',
+            'join', 'the', 'board', 'as', 'a', 'nonexecutive', 'director',
+            'Nov.', '29', '.'],
+            ['Mr.', 'Vinken', 'is', 'chairman', 'of', 'Elsevier', 'N.V.', ',',
+            'the', 'Dutch', 'publishing', 'group', '.'],
+            ['The', 'cat', 'sat', '.']]
+        # documents of different lengths, including an empty one and one
+        # too large for the ring buffers below
+        self.documents = [pack_sentences(sentences[:k % 3 + 1] * (k % 5))
+            for k in range(40)]
+        self.documents.append(pack_sentences(sentences * 50))
+
+    def expected(self, document):
+        buffer, token_offsets, sentence_offsets = document
+        tag_ids = tagger.tag_packed(buffer, token_offsets, sentence_offsets,
+            arrays=True)
+        tags = tagger.tag_packed(buffer, token_offsets, sentence_offsets)
+        tag_buffer, tag_offsets, _ = pack_sentences(tags)
+        labels = chunker.chunk_packed(buffer, token_offsets, sentence_offsets,
+            tag_buffer, tag_offsets, arrays=True)
+        return tag_ids, labels
+
+    def test_map_packed(self):
+        '''The pool gives the same results as tag_packed and chunk_packed'''
+        # small ring buffers so they fill up and wrap around
+        with ProcessPool(tagger, chunker, nprocesses=2,
+                memory_size=4096) as pool:
+            results = list(pool.map_packed(self.documents))
+            self.assertEqual(len(results), len(self.documents))
+            for document, (tag_ids, labels) in zip(self.documents, results):
+                expected_ids, expected_labels = self.expected(document)
+                self.assertEqual(tag_ids.dtype, np.uint8)
+                self.assertTrue(np.array_equal(tag_ids, expected_ids))
+                self.assertTrue(np.array_equal(labels, expected_labels))
+
+            # a pool can be used again, even after stopping part way
+            for result in pool.map_packed(self.documents):
+                break
+            results = list(pool.map_packed(self.documents[:3]))
+            self.assertEqual(len(results), 3)
+
+        self.assertRaises(ValueError, list,
+            pool.map_packed(self.documents))
+
+    def test_tagger_only(self):
+        with ProcessPool(tagger, nprocesses=2) as pool:
+            for document, (tag_ids, labels) in zip(self.documents,
+                    pool.map_packed(self.documents)):
+                self.assertTrue(np.array_equal(tag_ids,
+                    self.expected(document)[0]))
+                self.assertEqual(labels, None)
+
+    def test_errors(self):
+        self.assertRaises(ValueError, ProcessPool, tagger, nprocesses=0)
+
+        buffer, token_offsets, sentence_offsets = self.documents[1]
+        token_offsets = token_offsets.copy()
+        token_offsets[0, 1] = len(buffer) + 10
+        with ProcessPool(tagger, nprocesses=1) as pool:
+            self.assertRaises(RuntimeError, list, pool.map_packed(
+                [(buffer, token_offsets, sentence_offsets)]))
+            # the worker keeps going after a bad document
+            self.assertEqual(len(list(pool.map_packed(self.documents))),
+                len(self.documents))
+
+    def test_worker_died(self):
+        with ProcessPool(tagger, nprocesses=2) as pool:
+            pid = pool._workers[0].pid
+            os.kill(pid, signal.SIGKILL)
+            try:
+                list(pool.map_packed(self.documents))
+                self.fail("RuntimeError not raised")
+            except RuntimeError as e:
+                self.assertTrue(str(pid) in str(e))
+            # the worker is replaced
+            self.assertNotEqual(pool._workers[0].pid, pid)
+            self.assertEqual(len(list(pool.map_packed(self.documents))),
+                len(self.documents))
+
+
+if __name__ == '__main__':
+    unittest.main()
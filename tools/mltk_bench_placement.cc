@@ -0,0 +1,278 @@
+/**
+    mltk-bench-placement: measures how the placement of the model weights
+    in memory affects tagging (and chunking) throughput.
+
+    Tags the sentences in FILE (one tokenized sentence per line) over and
+    over from several threads, with the weights in regular pages, in
+    transparent huge pages and in hugetlbfs pages, each with a single
+    shared copy of the models and with a copy on each NUMA node.  On a
+    multi-socket host the threads are spread over the nodes and bound to
+    them, so the shared copy (built on the main thread's node) is remote
+    for some of them.  The replicated runs are skipped on a single node
+    host.
+
+    Reports tokens/sec and how much of the process is in huge pages
+    (AnonHugePages and Private_Hugetlb from /proc/self/smaps_rollup).
+
+    Usage:
+        mltk-bench-placement [--threads N] [--seconds S] [--chunk]
+            [--tagger-model PATH] [--chunker-model PATH] FILE
+*/
+
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include <getopt.h>
+
+#include "../mltk/_model_io.h"
+
+#ifndef MLTK_MODEL_DIR
+#define MLTK_MODEL_DIR "mltk/models"
+#endif
+
+
+typedef std::vector<std::string> sentence_t;
+
+struct options_t
+{
+    std::size_t nthreads;
+    double seconds;
+    bool chunk;
+    std::string tagger_model;
+    std::string chunker_model;
+    std::string input;
+};
+
+
+void usage()
+{
+    std::cerr <<
+        "Usage: mltk-bench-placement [options] FILE\n"
+        "Benchmark tagging the tokenized sentences in FILE with different "
+        "model\nmemory placements\n\n"
+        "  -t, --threads N          number of threads (default: all cores)\n"
+        "  -s, --seconds S          time for each placement (default: 2)\n"
+        "  -c, --chunk              also NP chunk\n"
+        "      --tagger-model PATH  POS tagger model file\n"
+        "      --chunker-model PATH NP chunker model file\n"
+        "  -h, --help               show this message\n";
+}
+
+options_t parse_options(int argc, char** argv)
+{
+    options_t options;
+    options.nthreads = std::max(1u, std::thread::hardware_concurrency());
+    options.seconds = 2.0;
+    options.chunk = false;
+    options.tagger_model = MLTK_MODEL_DIR "/aptagger-0.1.0.json.gz";
+    options.chunker_model = MLTK_MODEL_DIR "/np_chunker.json.gz";
+
+    static struct option long_options[] =
+    {
+        {"threads", required_argument, 0, 't'},
+        {"seconds", required_argument, 0, 's'},
+        {"chunk", no_argument, 0, 'c'},
+        {"tagger-model", required_argument, 0, 'T'},
+        {"chunker-model", required_argument, 0, 'C'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "t:s:ch", long_options, 0)) != -1)
+    {
+        switch (c)
+        {
+            case 't':
+                options.nthreads = std::max(1, std::atoi(optarg));
+                break;
+            case 's':
+                options.seconds = std::max(0.1, std::atof(optarg));
+                break;
+            case 'c':
+                options.chunk = true;
+                break;
+            case 'T':
+                options.tagger_model = optarg;
+                break;
+            case 'C':
+                options.chunker_model = optarg;
+                break;
+            case 'h':
+                usage();
+                std::exit(0);
+            default:
+                usage();
+                std::exit(2);
+        }
+    }
+
+    if (optind + 1 != argc)
+    {
+        usage();
+        std::exit(2);
+    }
+    options.input = argv[optind];
+    return options;
+}
+
+std::vector<sentence_t> read_sentences(std::string const & path)
+{
+    std::ifstream fin(path.c_str());
+    if (!fin)
+        throw std::runtime_error("Unable to open " + path);
+
+    std::vector<sentence_t> sentences;
+    std::string line;
+    while (std::getline(fin, line))
+    {
+        std::istringstream words(line);
+        sentence_t sentence;
+        std::string word;
+        while (words >> word)
+            sentence.push_back(word);
+        if (!sentence.empty())
+            sentences.push_back(sentence);
+    }
+    if (sentences.empty())
+        throw std::runtime_error("No sentences in " + path);
+    return sentences;
+}
+
+/// kB of huge pages mapped by this process, from /proc/self/smaps_rollup
+std::size_t huge_page_kb()
+{
+    std::ifstream fin("/proc/self/smaps_rollup");
+    std::string line;
+    std::size_t kb = 0;
+    while (std::getline(fin, line))
+    {
+        if (line.compare(0, 14, "AnonHugePages:") == 0 ||
+                line.compare(0, 16, "Private_Hugetlb:") == 0)
+            kb += std::strtoul(line.c_str() + line.find(':') + 1, 0, 10);
+    }
+    return kb;
+}
+
+/// tag (and chunk) from nthreads threads for the given time, returns
+/// tokens per second
+double run(options_t const & options,
+    std::vector<sentence_t> const & sentences,
+    NumaReplicas<PerceptronTagger> const & taggers,
+    NumaReplicas<FastNPChunker> const * chunkers)
+{
+    NumaTopology const & topology = NumaTopology::host();
+    std::atomic<bool> stop(false);
+    std::vector<std::size_t> ntokens(options.nthreads, 0);
+
+    std::vector<std::thread> threads;
+    for (std::size_t k = 0; k < options.nthreads; ++k)
+    {
+        threads.push_back(std::thread([&, k]()
+        {
+            // spread the threads over the nodes
+            std::size_t node = k % topology.nnodes();
+            if (topology.nnodes() > 1)
+                topology.bind_thread(node);
+            PerceptronTagger const & tagger = taggers.replica(node);
+
+            std::vector<std::size_t> ids;
+            std::vector<tag_t> tags;
+            std::vector<char> labels;
+            std::size_t count = 0;
+            for (std::size_t j = k; !stop.load(std::memory_order_relaxed);
+                j = (j + 1) % sentences.size())
+            {
+                sentence_t const & sentence = sentences[j];
+                tagger.tag_ids(sentence, ids);
+                if (chunkers)
+                {
+                    tags.clear();
+                    for (std::size_t i = 0; i < sentence.size(); ++i)
+                        tags.push_back(std::make_pair(
+                            sentence[i], tagger.tag_name(ids[i])));
+                    chunkers->replica(node).tag_labels(tags, labels);
+                }
+                count += sentence.size();
+            }
+            ntokens[k] = count;
+        }));
+    }
+
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::duration<double>(
+        options.seconds));
+    stop.store(true);
+    for (std::size_t k = 0; k < threads.size(); ++k)
+        threads[k].join();
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    std::size_t total = 0;
+    for (std::size_t k = 0; k < ntokens.size(); ++k)
+        total += ntokens[k];
+    return total / seconds;
+}
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        options_t options = parse_options(argc, argv);
+        std::vector<sentence_t> sentences = read_sentences(options.input);
+        NumaTopology const & topology = NumaTopology::host();
+
+        std::cout << topology.nnodes() << " NUMA node(s), "
+            << options.nthreads << " threads" << std::endl;
+        std::printf("%-10s %-11s %14s %16s\n",
+            "pages", "models", "tokens/sec", "huge pages kB");
+
+        static const char* PAGE_NAMES[] = {"regular", "thp", "hugetlb"};
+        static const huge_page_mode_t MODES[] =
+            {HUGE_PAGES_OFF, HUGE_PAGES_THP, HUGE_PAGES_HUGETLB};
+        for (std::size_t m = 0; m < 3; ++m)
+        {
+            for (int replicate = 0; replicate < 2; ++replicate)
+            {
+                if (replicate && topology.nnodes() == 1)
+                    continue;
+
+                huge_page_mode_t mode = MODES[m];
+                std::size_t kb_before = huge_page_kb();
+                NumaReplicas<PerceptronTagger> taggers(
+                    [&]() { return load_tagger(options.tagger_model, mode); },
+                    replicate);
+                std::unique_ptr<NumaReplicas<FastNPChunker> > chunkers;
+                if (options.chunk)
+                    chunkers.reset(new NumaReplicas<FastNPChunker>(
+                        [&]() {
+                            return load_chunker(options.chunker_model, mode);
+                        }, replicate));
+                std::size_t kb = huge_page_kb() - kb_before;
+
+                double rate = run(options, sentences, taggers, chunkers.get());
+                std::printf("%-10s %-11s %14.0f %16zu\n", PAGE_NAMES[m],
+                    replicate ? "per node" : "shared", rate, kb);
+                std::fflush(stdout);
+            }
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "mltk-bench-placement: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,351 @@
+/**
+    mltk-bench-scheduler: measures the latency of tagging (and chunking)
+    single documents on several threads when a few sentences are much
+    longer than the rest.
+
+    Builds documents from the sentences in FILE (one tokenized sentence
+    per line), some with a pathological "sentence" of thousands of tokens
+    like the tables and lists in web pages, and tags each document on its
+    own, one after another:
+
+        sequential          TaggerBase::tag_sentences on one thread
+        per sentence        a task for each sentence, dealt out evenly
+        per sentence+steal  the same with work stealing
+        balanced+split      token balanced tasks with long sentences split
+                            (DocumentScheduler's defaults)
+
+    Reports the latency percentiles per document and the throughput, and
+    checks that every schedule gives the same tags as sequential.
+
+    Usage:
+        mltk-bench-scheduler [--threads N] [--documents N] [--chunk]
+            [--task-tokens N] [--overlap N] [--seed N]
+            [--tagger-model PATH] [--chunker-model PATH] FILE
+*/
+
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <memory>
+#include <random>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#include <getopt.h>
+
+#include "../mltk/_model_io.h"
+#include "../mltk/_scheduler.h"
+
+#ifndef MLTK_MODEL_DIR
+#define MLTK_MODEL_DIR "mltk/models"
+#endif
+
+
+typedef std::vector<std::string> sentence_t;
+typedef std::vector<sentence_t> document_t;
+
+struct options_t
+{
+    std::size_t nthreads;
+    std::size_t ndocuments;
+    bool chunk;
+    schedule_options_t schedule;
+    unsigned int seed;
+    std::string tagger_model;
+    std::string chunker_model;
+    std::string input;
+};
+
+
+void usage()
+{
+    std::cerr <<
+        "Usage: mltk-bench-scheduler [options] FILE\n"
+        "Benchmark the latency of tagging documents made from the tokenized "
+        "sentences\nin FILE, with a few very long sentences, on several "
+        "threads\n\n"
+        "  -t, --threads N          number of threads (default: all cores)\n"
+        "  -n, --documents N        number of documents (default: 200)\n"
+        "  -c, --chunk              also NP chunk\n"
+        "      --task-tokens N      tokens per task (default: 512)\n"
+        "      --overlap N          words tagged before each piece of a "
+        "split\n"
+        "                           sentence (default: 8)\n"
+        "      --seed N             seed for making the documents "
+        "(default: 42)\n"
+        "      --tagger-model PATH  POS tagger model file\n"
+        "      --chunker-model PATH NP chunker model file\n"
+        "  -h, --help               show this message\n";
+}
+
+options_t parse_options(int argc, char** argv)
+{
+    options_t options;
+    options.nthreads = std::max(1u, std::thread::hardware_concurrency());
+    options.ndocuments = 200;
+    options.chunk = false;
+    options.seed = 42;
+    options.tagger_model = MLTK_MODEL_DIR "/aptagger-0.1.0.json.gz";
+    options.chunker_model = MLTK_MODEL_DIR "/np_chunker.json.gz";
+
+    static struct option long_options[] =
+    {
+        {"threads", required_argument, 0, 't'},
+        {"documents", required_argument, 0, 'n'},
+        {"chunk", no_argument, 0, 'c'},
+        {"task-tokens", required_argument, 0, 'k'},
+        {"overlap", required_argument, 0, 'o'},
+        {"seed", required_argument, 0, 's'},
+        {"tagger-model", required_argument, 0, 'T'},
+        {"chunker-model", required_argument, 0, 'C'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "t:n:ch", long_options, 0)) != -1)
+    {
+        switch (c)
+        {
+            case 't':
+                options.nthreads = std::max(1, std::atoi(optarg));
+                break;
+            case 'n':
+                options.ndocuments = std::max(1, std::atoi(optarg));
+                break;
+            case 'c':
+                options.chunk = true;
+                break;
+            case 'k':
+                options.schedule.task_tokens = std::max(1, std::atoi(optarg));
+                break;
+            case 'o':
+                options.schedule.overlap = std::max(2, std::atoi(optarg));
+                break;
+            case 's':
+                options.seed = std::atoi(optarg);
+                break;
+            case 'T':
+                options.tagger_model = optarg;
+                break;
+            case 'C':
+                options.chunker_model = optarg;
+                break;
+            case 'h':
+                usage();
+                std::exit(0);
+            default:
+                usage();
+                std::exit(2);
+        }
+    }
+
+    if (optind + 1 != argc)
+    {
+        usage();
+        std::exit(2);
+    }
+    options.input = argv[optind];
+    return options;
+}
+
+std::vector<sentence_t> read_sentences(std::string const & path)
+{
+    std::ifstream fin(path.c_str());
+    if (!fin)
+        throw std::runtime_error("Unable to open " + path);
+
+    std::vector<sentence_t> sentences;
+    std::string line;
+    while (std::getline(fin, line))
+    {
+        std::istringstream words(line);
+        sentence_t sentence;
+        std::string word;
+        while (words >> word)
+            sentence.push_back(word);
+        if (!sentence.empty())
+            sentences.push_back(sentence);
+    }
+    if (sentences.empty())
+        throw std::runtime_error("No sentences in " + path);
+    return sentences;
+}
+
+/// documents of 20-80 sentences, a quarter of them with one run on
+/// sentence of 1000-5000 tokens
+std::vector<document_t> make_documents(options_t const & options,
+    std::vector<sentence_t> const & sentences)
+{
+    std::mt19937 rng(options.seed);
+    std::vector<document_t> documents(options.ndocuments);
+    std::size_t next = 0;
+    for (std::size_t d = 0; d < documents.size(); ++d)
+    {
+        document_t& document = documents[d];
+        std::size_t nsentences = 20 + rng() % 61;
+        for (std::size_t k = 0; k < nsentences; ++k)
+            document.push_back(sentences[next++ % sentences.size()]);
+
+        if (rng() % 4 == 0)
+        {
+            std::size_t ntokens = 1000 + rng() % 4001;
+            sentence_t table;
+            while (table.size() < ntokens)
+            {
+                sentence_t const & sentence = sentences[
+                    next++ % sentences.size()];
+                table.insert(table.end(), sentence.begin(), sentence.end());
+            }
+            document.insert(document.begin() + rng() % (nsentences + 1),
+                table);
+        }
+    }
+    return documents;
+}
+
+struct result_t
+{
+    std::vector<std::vector<tag_t> > tags;
+    std::vector<iob_label_t> labels;
+};
+
+/// tag (and chunk) a document, with scheduler or sequentially if NULL.
+/// Returns the number of sentences tagged again
+std::size_t tag_document(document_t& document,
+    PerceptronTagger const & tagger, FastNPChunker const * chunker,
+    DocumentScheduler* scheduler, result_t& result)
+{
+    if (!scheduler)
+    {
+        tagger.tag_sentences(document, result.tags);
+        if (chunker)
+            chunker->tag_sentences(result.tags, result.labels);
+        return 0;
+    }
+
+    std::size_t nretagged = scheduler->tag_sentences(tagger, document,
+        result.tags);
+    if (chunker)
+        nretagged += scheduler->tag_sentences(*chunker, result.tags,
+            result.labels);
+    return nretagged;
+}
+
+double percentile(std::vector<double> sorted, double p)
+{
+    std::size_t k = std::min(sorted.size() - 1,
+        std::size_t(p * sorted.size()));
+    return sorted[k];
+}
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        options_t options = parse_options(argc, argv);
+        std::vector<document_t> documents = make_documents(options,
+            read_sentences(options.input));
+
+        std::size_t ntokens = 0;
+        std::size_t longest = 0;
+        for (std::size_t d = 0; d < documents.size(); ++d)
+        {
+            for (std::size_t k = 0; k < documents[d].size(); ++k)
+            {
+                ntokens += documents[d][k].size();
+                longest = std::max(longest, documents[d][k].size());
+            }
+        }
+
+        std::unique_ptr<PerceptronTagger> tagger(
+            load_tagger(options.tagger_model));
+        std::unique_ptr<FastNPChunker> chunker;
+        if (options.chunk)
+            chunker.reset(load_chunker(options.chunker_model));
+
+        std::cout << documents.size() << " documents, " << ntokens
+            << " tokens, longest sentence " << longest << " tokens, "
+            << options.nthreads << " threads" << std::endl;
+        std::printf("%-20s %9s %9s %9s %9s %12s %9s\n", "schedule",
+            "p50 ms", "p90 ms", "p99 ms", "max ms", "tokens/sec",
+            "retagged");
+
+        schedule_options_t per_sentence;
+        per_sentence.task_tokens = 0;
+        per_sentence.steal = false;
+        schedule_options_t per_sentence_steal = per_sentence;
+        per_sentence_steal.steal = true;
+
+        static const char* NAMES[] = {"sequential", "per sentence",
+            "per sentence+steal", "balanced+split"};
+        std::unique_ptr<DocumentScheduler> schedulers[] = {
+            std::unique_ptr<DocumentScheduler>(),
+            std::unique_ptr<DocumentScheduler>(new DocumentScheduler(
+                options.nthreads, per_sentence)),
+            std::unique_ptr<DocumentScheduler>(new DocumentScheduler(
+                options.nthreads, per_sentence_steal)),
+            std::unique_ptr<DocumentScheduler>(new DocumentScheduler(
+                options.nthreads, options.schedule))};
+
+        std::vector<result_t> expected(documents.size());
+        std::size_t nmismatched = 0;
+        for (std::size_t m = 0; m < 4; ++m)
+        {
+            // warm up the workspaces and the threads
+            result_t result;
+            tag_document(documents[0], *tagger, chunker.get(),
+                schedulers[m].get(), result);
+
+            std::vector<double> latencies;
+            std::size_t nretagged = 0;
+            std::chrono::steady_clock::time_point start =
+                std::chrono::steady_clock::now();
+            for (std::size_t d = 0; d < documents.size(); ++d)
+            {
+                std::chrono::steady_clock::time_point t1 =
+                    std::chrono::steady_clock::now();
+                nretagged += tag_document(documents[d], *tagger,
+                    chunker.get(), schedulers[m].get(), result);
+                latencies.push_back(std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - t1).count() * 1000);
+
+                if (m == 0)
+                    std::swap(expected[d], result);
+                else if (result.tags != expected[d].tags ||
+                        result.labels != expected[d].labels)
+                    ++nmismatched;
+            }
+            double seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+
+            std::sort(latencies.begin(), latencies.end());
+            std::printf("%-20s %9.2f %9.2f %9.2f %9.2f %12.0f %9zu\n",
+                NAMES[m], percentile(latencies, 0.5),
+                percentile(latencies, 0.9), percentile(latencies, 0.99),
+                latencies.back(), ntokens / seconds, nretagged);
+            std::fflush(stdout);
+        }
+
+        if (nmismatched > 0)
+        {
+            std::cerr << "mltk-bench-scheduler: " << nmismatched
+                << " documents tagged differently than sequentially"
+                << std::endl;
+            return 1;
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "mltk-bench-scheduler: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
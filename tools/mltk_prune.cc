@@ -0,0 +1,163 @@
+/**
+    mltk-prune: reports the memory used by a POS tagger model and prunes
+    it to a memory budget.
+
+    Prints the entries, estimated bytes and hash table load factor of
+    each feature template's weights once loaded.  With --max-bytes and
+    --output it removes the least important feature values (see
+    prune_weights) until the weights fit and writes the pruned model,
+    gzipped if the path ends in .gz, then reports its memory too.
+
+    Usage:
+        mltk-prune [--max-bytes N[k|M|G] --output PATH] MODEL
+*/
+
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <stdexcept>
+#include <memory>
+
+#include <getopt.h>
+
+#include "../mltk/_model_io.h"
+
+
+struct options_t
+{
+    std::size_t max_bytes;
+    std::string output;
+    std::string model;
+};
+
+
+void usage()
+{
+    std::cerr <<
+        "Usage: mltk-prune [options] MODEL\n"
+        "Report the memory used by a POS tagger MODEL and optionally prune "
+        "it\n\n"
+        "  -b, --max-bytes N        prune the weights to N bytes, with an\n"
+        "                           optional k, M or G suffix\n"
+        "  -o, --output PATH        the pruned model file to write\n"
+        "  -h, --help               show this message\n";
+}
+
+std::size_t parse_bytes(std::string const & value)
+{
+    char* end = 0;
+    double bytes = std::strtod(value.c_str(), &end);
+    std::string suffix(end);
+    if (suffix == "k" || suffix == "K")
+        bytes *= 1024;
+    else if (suffix == "M")
+        bytes *= 1024 * 1024;
+    else if (suffix == "G")
+        bytes *= 1024 * 1024 * 1024;
+    else if (!suffix.empty())
+        throw std::invalid_argument("Invalid size " + value);
+    if (end == value.c_str() || bytes < 0)
+        throw std::invalid_argument("Invalid size " + value);
+    return bytes;
+}
+
+options_t parse_options(int argc, char** argv)
+{
+    options_t options;
+    options.max_bytes = 0;
+
+    static struct option long_options[] =
+    {
+        {"max-bytes", required_argument, 0, 'b'},
+        {"output", required_argument, 0, 'o'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "b:o:h", long_options, 0)) != -1)
+    {
+        switch (c)
+        {
+            case 'b':
+                options.max_bytes = parse_bytes(optarg);
+                break;
+            case 'o':
+                options.output = optarg;
+                break;
+            case 'h':
+                usage();
+                std::exit(0);
+            default:
+                usage();
+                std::exit(2);
+        }
+    }
+
+    // pruning needs both a budget and somewhere to write the model
+    if (optind + 1 != argc ||
+            (options.max_bytes == 0) != options.output.empty())
+    {
+        usage();
+        std::exit(2);
+    }
+    options.model = argv[optind];
+    return options;
+}
+
+void report(std::string const & title, weights_in_t const & weights,
+    class_weights_in_t const & bias_weights,
+    tagmap_in_t const & specified_tags)
+{
+    std::unique_ptr<PerceptronTagger> tagger(
+        new PerceptronTagger(weights, bias_weights, specified_tags));
+    std::vector<feature_memory_t> usage;
+    tagger->memory_usage(usage);
+
+    std::size_t entries = 0;
+    std::size_t bytes = 0;
+    std::cout << title << "\n";
+    std::printf("%-18s %10s %12s %8s\n",
+        "template", "entries", "bytes", "load");
+    for (std::size_t k = 0; k < usage.size(); ++k)
+    {
+        std::printf("%-18s %10zu %12zu %8.2f\n", usage[k].name.c_str(),
+            usage[k].entries, usage[k].bytes, usage[k].load_factor);
+        entries += usage[k].entries;
+        bytes += usage[k].bytes;
+    }
+    std::printf("%-18s %10zu %12zu\n\n", "total", entries, bytes);
+    std::fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        options_t options = parse_options(argc, argv);
+
+        weights_in_t weights;
+        class_weights_in_t bias_weights;
+        tagmap_in_t specified_tags;
+        read_tagger_model(options.model, weights, bias_weights,
+            specified_tags);
+        report(options.model, weights, bias_weights, specified_tags);
+
+        if (!options.output.empty())
+        {
+            prune_weights(weights, options.max_bytes);
+            write_tagger_model(options.output, weights, bias_weights,
+                specified_tags);
+            report(options.output, weights, bias_weights, specified_tags);
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "mltk-prune: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,671 @@
+/**
+    mltk-tag: a command line batch POS tagger and NP chunker.
+
+    Reads text from stdin or files, tags and optionally chunks it using
+    all the cores on the machine and writes the results in input order.
+    Throughput is reported on stderr at the end.
+
+    Input formats (--input):
+        tokenized   one sentence per line, tokens separated by whitespace
+        raw         free text.  Each line is split into sentences and
+                    tokenized with a simple Penn Treebank style tokenizer
+
+    Output formats (--output):
+        tsv         one token per line: token TAB tag [TAB IOB label],
+                    with an empty line after each sentence
+        binary      a compact little endian format:
+                        "MLTK" magic, uint8 version (1),
+                        uint8 flags (1 if IOB labels are included),
+                        uint16 number of tags, then each tag name as
+                        uint8 length + bytes.
+                    Then for each sentence:
+                        uint32 number of tokens, one uint8 tag id per
+                        token and (if chunking) one uint8 IOB label per
+                        token
+                    Tokens are not repeated since the output is in the
+                    same order as the input.
+                    Models with more than 256 tags or tag names over
+                    255 bytes can't be written in this format.
+
+    Model placement:
+        --huge-pages MODE   put the model weights in 2MB huge pages,
+                            thp (transparent huge pages) or hugetlb
+                            (the hugetlbfs pool, else thp)
+        --numa              on multi-socket hosts, load a copy of the
+                            models on each NUMA node and bind each worker
+                            thread to a node so it uses the local copy.
+                            Does nothing on single node hosts
+
+    Usage:
+        mltk-tag [--chunk] [--threads N] [--input tokenized|raw]
+            [--output tsv|binary] [--batch-size N] [--tagger-model PATH]
+            [--chunker-model PATH] [--huge-pages thp|hugetlb] [--numa]
+            [FILE ...]
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <memory>
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include <getopt.h>
+
+#include "../mltk/_model_io.h"
+
+#ifndef MLTK_MODEL_DIR
+#define MLTK_MODEL_DIR "mltk/models"
+#endif
+
+
+typedef std::vector<std::string> sentence_t;
+
+/// a batch of sentences, processed by one worker thread
+struct batch_t
+{
+    std::size_t id;
+    std::vector<sentence_t> sentences;
+    std::string output;
+};
+
+struct options_t
+{
+    bool chunk;
+    bool raw_input;
+    bool binary_output;
+    std::size_t nthreads;
+    std::size_t batch_size;
+    std::string tagger_model;
+    std::string chunker_model;
+    huge_page_mode_t huge_pages;
+    bool numa;
+    std::vector<std::string> files;
+};
+
+
+// a simple tokenizer for raw text
+
+bool is_sentence_end(std::string const & token)
+{
+    return token == "." || token == "!" || token == "?";
+}
+
+bool is_abbreviation(std::string const & word, std::size_t start,
+    std::size_t end)
+{
+    /** true if word[start, end) ending in a period is an abbreviation that
+    keeps its period, either with periods inside (U.S., e.g.) or a common
+    one (Mr., Inc.) */
+    static const char* ABBREVIATIONS[] =
+        {"Mr", "Mrs", "Ms", "Dr", "Prof", "Rev", "Gen", "Sen", "Rep", "Gov",
+        "St", "Jr", "Sr", "Inc", "Ltd", "Co", "Corp", "Bros", "vs", "No",
+        "Jan", "Feb", "Mar", "Apr", "Jun", "Jul", "Aug", "Sep", "Sept",
+        "Oct", "Nov", "Dec"};
+
+    if (end - start < 2)
+        return false;
+    if (word.find('.', start) < end - 1)
+        return true;
+    for (std::size_t k = 0; k < sizeof(ABBREVIATIONS) / sizeof(char*); ++k)
+    {
+        if (word.compare(start, end - 1 - start, ABBREVIATIONS[k]) == 0)
+            return true;
+    }
+    return false;
+}
+
+void split_token(std::string const & word, sentence_t& tokens)
+{
+    /** split leading and trailing punctuation and common contractions
+    off of a whitespace delimited word */
+    static const char* LEADING = "\"'([{`";
+    static const char* TRAILING = "\"'.,;:!?)]}";
+    static const char* CONTRACTIONS[] =
+        {"n't", "'s", "'re", "'ve", "'ll", "'d", "'m"};
+
+    std::size_t start = 0;
+    std::size_t end = word.length();
+    // quotes are `` and '' in the Penn Treebank
+    while (start < end && std::strchr(LEADING, word[start]))
+    {
+        tokens.push_back(word[start] == '"' ? "``" : word.substr(start, 1));
+        ++start;
+    }
+
+    std::vector<std::string> trailing;
+    while (end > start && std::strchr(TRAILING, word[end - 1]))
+    {
+        // keep the period in abbreviations like U.S. or Mr.
+        if (word[end - 1] == '.' && is_abbreviation(word, start, end))
+            break;
+        --end;
+        trailing.push_back(word[end] == '"' ? "''" : word.substr(end, 1));
+    }
+
+    std::string core = word.substr(start, end - start);
+    for (std::size_t k = 0; k < sizeof(CONTRACTIONS) / sizeof(char*); ++k)
+    {
+        std::size_t n = std::strlen(CONTRACTIONS[k]);
+        if (core.length() > n &&
+                core.compare(core.length() - n, n, CONTRACTIONS[k]) == 0)
+        {
+            tokens.push_back(core.substr(0, core.length() - n));
+            core = CONTRACTIONS[k];
+            break;
+        }
+    }
+    if (!core.empty())
+        tokens.push_back(core);
+
+    tokens.insert(tokens.end(), trailing.rbegin(), trailing.rend());
+}
+
+void tokenize_raw(std::string const & line, std::vector<sentence_t>& out)
+{
+    /// split a line of raw text into tokenized sentences
+    sentence_t tokens;
+    std::size_t pos = 0;
+    while (pos < line.length())
+    {
+        while (pos < line.length() && std::isspace(line[pos]))
+            ++pos;
+        std::size_t start = pos;
+        while (pos < line.length() && !std::isspace(line[pos]))
+            ++pos;
+        if (pos > start)
+            split_token(line.substr(start, pos - start), tokens);
+    }
+
+    sentence_t sentence;
+    for (std::size_t k = 0; k < tokens.size(); ++k)
+    {
+        sentence.push_back(tokens[k]);
+        if (is_sentence_end(tokens[k]))
+        {
+            // closing quotes and brackets belong to this sentence
+            while (k + 1 < tokens.size() &&
+                    (tokens[k + 1] == "''" || tokens[k + 1] == ")" ||
+                    tokens[k + 1] == "]" || tokens[k + 1] == "}"))
+                sentence.push_back(tokens[++k]);
+            out.push_back(sentence);
+            sentence.clear();
+        }
+    }
+    if (!sentence.empty())
+        out.push_back(sentence);
+}
+
+void tokenize_line(std::string const & line, std::vector<sentence_t>& out)
+{
+    /// a pre-tokenized sentence
+    sentence_t sentence;
+    std::size_t pos = 0;
+    while (pos < line.length())
+    {
+        while (pos < line.length() && std::isspace(line[pos]))
+            ++pos;
+        std::size_t start = pos;
+        while (pos < line.length() && !std::isspace(line[pos]))
+            ++pos;
+        if (pos > start)
+            sentence.push_back(line.substr(start, pos - start));
+    }
+    out.push_back(sentence);
+}
+
+
+// output
+
+void append_uint(std::string& out, uint64_t value, std::size_t nbytes)
+{
+    /// little endian
+    for (std::size_t k = 0; k < nbytes; ++k)
+        out.push_back(static_cast<char>((value >> (8 * k)) & 0xFF));
+}
+
+std::string binary_header(PerceptronTagger const & tagger, bool chunk)
+{
+    // the tag ids and the tag name lengths are written as uint8
+    if (tagger.ntags() > 256)
+        throw std::runtime_error("too many tags for the binary output");
+    for (std::size_t k = 0; k < tagger.ntags(); ++k)
+    {
+        if (tagger.tag_name(k).length() > 255)
+            throw std::runtime_error(
+                "tag name too long for the binary output");
+    }
+
+    std::string ret("MLTK");
+    append_uint(ret, 1, 1);
+    append_uint(ret, chunk ? 1 : 0, 1);
+    append_uint(ret, tagger.ntags(), 2);
+    for (std::size_t k = 0; k < tagger.ntags(); ++k)
+    {
+        std::string const & name = tagger.tag_name(k);
+        append_uint(ret, name.length(), 1);
+        ret.append(name);
+    }
+    return ret;
+}
+
+void process_batch(PerceptronTagger const & tagger,
+    FastNPChunker const * chunker, bool binary_output, batch_t& batch)
+{
+    /// tag/chunk all the sentences in the batch and format the output
+    std::vector<std::size_t> ids;
+    std::vector<tag_t> tags;
+    iob_label_t iob;
+
+    batch.output.clear();
+    for (std::vector<sentence_t>::const_iterator it =
+        batch.sentences.begin(); it != batch.sentences.end(); ++it)
+    {
+        tagger.tag_ids(*it, ids);
+
+        if (chunker)
+        {
+            tags.clear();
+            for (std::size_t k = 0; k < it->size(); ++k)
+                tags.push_back(
+                    std::make_pair((*it)[k], tagger.tag_name(ids[k])));
+            iob = chunker->tag_sentence(tags);
+        }
+
+        if (binary_output)
+        {
+            append_uint(batch.output, it->size(), 4);
+            for (std::size_t k = 0; k < ids.size(); ++k)
+                batch.output.push_back(static_cast<char>(ids[k]));
+            if (chunker)
+                for (std::size_t k = 0; k < iob.size(); ++k)
+                    batch.output.push_back(iob[k].label);
+        }
+        else
+        {
+            for (std::size_t k = 0; k < it->size(); ++k)
+            {
+                batch.output.append((*it)[k]);
+                batch.output.push_back('\t');
+                batch.output.append(tagger.tag_name(ids[k]));
+                if (chunker)
+                {
+                    batch.output.push_back('\t');
+                    batch.output.push_back(iob[k].label);
+                }
+                batch.output.push_back('\n');
+            }
+            batch.output.push_back('\n');
+        }
+    }
+}
+
+
+/**
+    Runs batches through a pool of worker threads and writes the results
+    in the order the batches were added.  With options.numa the workers
+    are spread over the NUMA nodes and use the models on their node.
+
+    The number of batches in flight is bounded so memory use stays
+    constant no matter how large the input.
+*/
+class BatchPipeline
+{
+    public:
+        BatchPipeline(NumaReplicas<PerceptronTagger> const & taggers,
+            NumaReplicas<FastNPChunker> const * chunkers,
+            options_t const & options, std::FILE* out);
+        ~BatchPipeline();
+
+        /// queue a batch for processing, blocking if too many are queued
+        void add(std::unique_ptr<batch_t> batch);
+
+        /// wait for all batches to be processed and written
+        void finish();
+
+    private:
+        NumaReplicas<PerceptronTagger> const & taggers;
+        NumaReplicas<FastNPChunker> const * chunkers;
+        bool binary_output;
+        bool numa;
+        std::FILE* out;
+
+        std::size_t max_in_flight;
+        std::size_t in_flight;
+        std::size_t next_to_write;
+        bool done;
+
+        std::deque<std::unique_ptr<batch_t> > pending;
+        std::map<std::size_t, std::unique_ptr<batch_t> > finished;
+
+        std::mutex lock;
+        std::condition_variable work_available;
+        std::condition_variable batch_finished;
+        std::condition_variable space_available;
+
+        std::vector<std::thread> workers;
+        std::thread writer;
+
+        void work(std::size_t worker);
+        void write();
+};
+
+BatchPipeline::BatchPipeline(NumaReplicas<PerceptronTagger> const & taggers,
+    NumaReplicas<FastNPChunker> const * chunkers, options_t const & options,
+    std::FILE* out) :
+    taggers(taggers), chunkers(chunkers),
+    binary_output(options.binary_output), numa(options.numa), out(out),
+    max_in_flight(4 * options.nthreads), in_flight(0), next_to_write(0),
+    done(false)
+{
+    for (std::size_t k = 0; k < options.nthreads; ++k)
+        workers.push_back(std::thread(&BatchPipeline::work, this, k));
+    writer = std::thread(&BatchPipeline::write, this);
+}
+
+BatchPipeline::~BatchPipeline()
+{
+    finish();
+}
+
+void BatchPipeline::add(std::unique_ptr<batch_t> batch)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    space_available.wait(guard,
+        [this]() { return in_flight < max_in_flight; });
+    ++in_flight;
+    pending.push_back(std::move(batch));
+    work_available.notify_one();
+}
+
+void BatchPipeline::finish()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (done)
+            return;
+        done = true;
+    }
+    work_available.notify_all();
+    batch_finished.notify_all();
+    for (std::size_t k = 0; k < workers.size(); ++k)
+        workers[k].join();
+    writer.join();
+}
+
+void BatchPipeline::work(std::size_t worker)
+{
+    NumaTopology const & topology = NumaTopology::host();
+    std::size_t node = worker % topology.nnodes();
+    if (numa && topology.nnodes() > 1)
+        topology.bind_thread(node);
+    PerceptronTagger const & tagger = taggers.replica(node);
+    FastNPChunker const * chunker =
+        chunkers ? &chunkers->replica(node) : NULL;
+
+    while (true)
+    {
+        std::unique_ptr<batch_t> batch;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            work_available.wait(guard,
+                [this]() { return done || !pending.empty(); });
+            if (pending.empty())
+                return;
+            batch = std::move(pending.front());
+            pending.pop_front();
+        }
+
+        process_batch(tagger, chunker, binary_output, *batch);
+
+        std::lock_guard<std::mutex> guard(lock);
+        std::size_t id = batch->id;
+        finished[id] = std::move(batch);
+        if (id == next_to_write)
+            batch_finished.notify_one();
+    }
+}
+
+void BatchPipeline::write()
+{
+    while (true)
+    {
+        std::unique_ptr<batch_t> batch;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            batch_finished.wait(guard, [this]() {
+                return finished.count(next_to_write) > 0 ||
+                    (done && in_flight == 0); });
+            if (finished.count(next_to_write) == 0)
+                return;
+            batch = std::move(finished[next_to_write]);
+            finished.erase(next_to_write);
+        }
+
+        std::fwrite(batch->output.data(), 1, batch->output.length(), out);
+
+        std::lock_guard<std::mutex> guard(lock);
+        ++next_to_write;
+        --in_flight;
+        space_available.notify_one();
+    }
+}
+
+
+void usage()
+{
+    std::cerr <<
+        "Usage: mltk-tag [options] [FILE ...]\n"
+        "POS tag (and optionally NP chunk) text from FILEs or stdin\n\n"
+        "  -c, --chunk              also output NP chunk IOB labels\n"
+        "  -t, --threads N          number of worker threads "
+            "(default: all cores)\n"
+        "  -i, --input FORMAT       tokenized (default) or raw\n"
+        "  -o, --output FORMAT      tsv (default) or binary\n"
+        "  -b, --batch-size N       sentences per batch (default: 1000)\n"
+        "      --tagger-model PATH  POS tagger model file\n"
+        "      --chunker-model PATH NP chunker model file\n"
+        "      --huge-pages MODE    put the models in huge pages, thp or "
+            "hugetlb\n"
+        "      --numa               a copy of the models on each NUMA node\n"
+        "  -h, --help               show this message\n";
+}
+
+options_t parse_options(int argc, char** argv)
+{
+    options_t options;
+    options.chunk = false;
+    options.raw_input = false;
+    options.binary_output = false;
+    options.nthreads = std::max(1u, std::thread::hardware_concurrency());
+    options.batch_size = 1000;
+    options.tagger_model = MLTK_MODEL_DIR "/aptagger-0.1.0.json.gz";
+    options.chunker_model = MLTK_MODEL_DIR "/np_chunker.json.gz";
+    options.huge_pages = HUGE_PAGES_OFF;
+    options.numa = false;
+
+    static struct option long_options[] =
+    {
+        {"chunk", no_argument, 0, 'c'},
+        {"threads", required_argument, 0, 't'},
+        {"input", required_argument, 0, 'i'},
+        {"output", required_argument, 0, 'o'},
+        {"batch-size", required_argument, 0, 'b'},
+        {"tagger-model", required_argument, 0, 'T'},
+        {"chunker-model", required_argument, 0, 'C'},
+        {"huge-pages", required_argument, 0, 'H'},
+        {"numa", no_argument, 0, 'N'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "ct:i:o:b:h", long_options, 0)) != -1)
+    {
+        switch (c)
+        {
+            case 'c':
+                options.chunk = true;
+                break;
+            case 't':
+                options.nthreads = std::max(1, std::atoi(optarg));
+                break;
+            case 'i':
+                if (std::strcmp(optarg, "raw") == 0)
+                    options.raw_input = true;
+                else if (std::strcmp(optarg, "tokenized") != 0)
+                    throw std::invalid_argument(
+                        std::string("Unknown input format ") + optarg);
+                break;
+            case 'o':
+                if (std::strcmp(optarg, "binary") == 0)
+                    options.binary_output = true;
+                else if (std::strcmp(optarg, "tsv") != 0)
+                    throw std::invalid_argument(
+                        std::string("Unknown output format ") + optarg);
+                break;
+            case 'b':
+                options.batch_size = std::max(1, std::atoi(optarg));
+                break;
+            case 'T':
+                options.tagger_model = optarg;
+                break;
+            case 'C':
+                options.chunker_model = optarg;
+                break;
+            case 'H':
+                if (std::strcmp(optarg, "thp") == 0)
+                    options.huge_pages = HUGE_PAGES_THP;
+                else if (std::strcmp(optarg, "hugetlb") == 0)
+                    options.huge_pages = HUGE_PAGES_HUGETLB;
+                else
+                    throw std::invalid_argument(
+                        std::string("Unknown huge page mode ") + optarg);
+                break;
+            case 'N':
+                options.numa = true;
+                break;
+            case 'h':
+                usage();
+                std::exit(0);
+            default:
+                usage();
+                std::exit(2);
+        }
+    }
+
+    for (int k = optind; k < argc; ++k)
+        options.files.push_back(argv[k]);
+    return options;
+}
+
+std::size_t run(options_t const & options,
+    NumaReplicas<PerceptronTagger> const & taggers,
+    NumaReplicas<FastNPChunker> const * chunkers)
+{
+    /// read all the input, returns the number of tokens processed
+    if (options.binary_output)
+    {
+        std::string header = binary_header(taggers.replica(0), options.chunk);
+        std::fwrite(header.data(), 1, header.length(), stdout);
+    }
+
+    BatchPipeline pipeline(taggers, chunkers, options, stdout);
+
+    std::vector<std::string> files(options.files);
+    if (files.empty())
+        files.push_back("-");
+
+    std::size_t ntokens = 0;
+    std::size_t nbatches = 0;
+    std::unique_ptr<batch_t> batch(new batch_t());
+    batch->id = nbatches++;
+
+    for (std::size_t k = 0; k < files.size(); ++k)
+    {
+        std::ifstream fin;
+        if (files[k] != "-")
+        {
+            fin.open(files[k].c_str());
+            if (!fin)
+                throw std::runtime_error("Unable to open " + files[k]);
+        }
+        std::istream& in = files[k] == "-" ? std::cin : fin;
+
+        std::string line;
+        while (std::getline(in, line))
+        {
+            std::size_t first_new = batch->sentences.size();
+            if (options.raw_input)
+                tokenize_raw(line, batch->sentences);
+            else
+                tokenize_line(line, batch->sentences);
+            for (std::size_t i = first_new; i < batch->sentences.size(); ++i)
+                ntokens += batch->sentences[i].size();
+
+            if (batch->sentences.size() >= options.batch_size)
+            {
+                pipeline.add(std::move(batch));
+                batch.reset(new batch_t());
+                batch->id = nbatches++;
+            }
+        }
+    }
+
+    if (!batch->sentences.empty())
+        pipeline.add(std::move(batch));
+    pipeline.finish();
+    std::fflush(stdout);
+
+    return ntokens;
+}
+
+int main(int argc, char** argv)
+{
+    std::ios_base::sync_with_stdio(false);
+
+    try
+    {
+        options_t options = parse_options(argc, argv);
+
+        NumaReplicas<PerceptronTagger> taggers([&]()
+            { return load_tagger(options.tagger_model, options.huge_pages); },
+            options.numa);
+        std::unique_ptr<NumaReplicas<FastNPChunker> > chunkers;
+        if (options.chunk)
+            chunkers.reset(new NumaReplicas<FastNPChunker>([&]()
+                {
+                    return load_chunker(
+                        options.chunker_model, options.huge_pages);
+                }, options.numa));
+
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+        std::size_t ntokens = run(options, taggers, chunkers.get());
+        double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+
+        std::cerr << "Processed " << ntokens << " tokens in " << seconds
+            << " seconds with " << options.nthreads << " threads ("
+            << static_cast<std::size_t>(ntokens / std::max(seconds, 1e-9))
+            << " tokens/sec)" << std::endl;
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "mltk-tag: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
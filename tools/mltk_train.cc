@@ -0,0 +1,217 @@
+/**
+    mltk-train: trains a POS tagger or NP chunker model.
+
+    Reads tagged sentences from stdin or files in the tsv format that
+    mltk-tag writes: one token per line as token TAB tag [TAB IOB label],
+    with an empty line after each sentence.  The chunker needs the IOB
+    labels.  Writes a model that load_tagger/load_chunker and the Python
+    classes can load, gzipped if the path ends in .gz.  Training time is
+    reported on stderr at the end.
+
+    Usage:
+        mltk-train [--model tagger|chunker] [--iterations N] [--threads N]
+            [--seed N] --output PATH [FILE ...]
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <chrono>
+
+#include <getopt.h>
+
+#include "../mltk/_trainer.h"
+
+
+struct options_t
+{
+    bool chunker;
+    std::string output;
+    train_options_t train;
+    std::vector<std::string> files;
+};
+
+
+void usage()
+{
+    std::cerr <<
+        "Usage: mltk-train [options] -o PATH [FILE ...]\n"
+        "Train a model from tagged sentences in FILEs or stdin\n\n"
+        "  -m, --model TYPE         tagger (default) or chunker\n"
+        "  -o, --output PATH        the model file to write\n"
+        "  -n, --iterations N       passes over the data (default: 5)\n"
+        "  -t, --threads N          training threads (default: 1)\n"
+        "  -s, --seed N             seed for shuffling (default: 42)\n"
+        "  -h, --help               show this message\n";
+}
+
+options_t parse_options(int argc, char** argv)
+{
+    options_t options;
+    options.chunker = false;
+
+    static struct option long_options[] =
+    {
+        {"model", required_argument, 0, 'm'},
+        {"output", required_argument, 0, 'o'},
+        {"iterations", required_argument, 0, 'n'},
+        {"threads", required_argument, 0, 't'},
+        {"seed", required_argument, 0, 's'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "m:o:n:t:s:h", long_options, 0))
+        != -1)
+    {
+        switch (c)
+        {
+            case 'm':
+                if (std::strcmp(optarg, "chunker") == 0)
+                    options.chunker = true;
+                else if (std::strcmp(optarg, "tagger") != 0)
+                    throw std::invalid_argument(
+                        std::string("Unknown model type ") + optarg);
+                break;
+            case 'o':
+                options.output = optarg;
+                break;
+            case 'n':
+                options.train.niterations = std::max(1, std::atoi(optarg));
+                break;
+            case 't':
+                options.train.nthreads = std::max(1, std::atoi(optarg));
+                break;
+            case 's':
+                options.train.seed = std::strtoul(optarg, 0, 10);
+                break;
+            case 'h':
+                usage();
+                std::exit(0);
+            default:
+                usage();
+                std::exit(2);
+        }
+    }
+
+    if (options.output.empty())
+    {
+        usage();
+        std::exit(2);
+    }
+    for (int k = optind; k < argc; ++k)
+        options.files.push_back(argv[k]);
+    return options;
+}
+
+void read_sentences(options_t const & options,
+    std::vector<iob_label_t>& sentences)
+{
+    /// read all the input.  The label is 0 if the line doesn't have one
+    std::vector<std::string> files(options.files);
+    if (files.empty())
+        files.push_back("-");
+
+    iob_label_t sentence;
+    for (std::size_t k = 0; k < files.size(); ++k)
+    {
+        std::ifstream fin;
+        if (files[k] != "-")
+        {
+            fin.open(files[k].c_str());
+            if (!fin)
+                throw std::runtime_error("Unable to open " + files[k]);
+        }
+        std::istream& in = files[k] == "-" ? std::cin : fin;
+
+        std::string line;
+        std::size_t nline = 0;
+        while (std::getline(in, line))
+        {
+            ++nline;
+            if (line.empty())
+            {
+                if (!sentence.empty())
+                    sentences.push_back(sentence);
+                sentence.clear();
+                continue;
+            }
+
+            std::size_t tab = line.find('\t');
+            std::size_t tab2 = line.find('\t', tab + 1);
+            if (tab == std::string::npos || tab == 0 || tab + 1 == tab2 ||
+                    tab + 1 == line.length())
+                throw std::invalid_argument(files[k] + ":" +
+                    std::to_string(nline) + ": expected token TAB tag");
+            char label = 0;
+            if (tab2 != std::string::npos)
+            {
+                if (line.length() != tab2 + 2)
+                    throw std::invalid_argument(files[k] + ":" +
+                        std::to_string(nline) + ": expected an IOB label");
+                label = line[tab2 + 1];
+            }
+            else if (options.chunker)
+                throw std::invalid_argument(files[k] + ":" +
+                    std::to_string(nline) + ": the chunker needs IOB labels");
+
+            sentence.push_back(iob_t(line.substr(0, tab),
+                line.substr(tab + 1, tab2 - tab - 1), label));
+        }
+    }
+    if (!sentence.empty())
+        sentences.push_back(sentence);
+}
+
+int main(int argc, char** argv)
+{
+    std::ios_base::sync_with_stdio(false);
+
+    try
+    {
+        options_t options = parse_options(argc, argv);
+
+        std::vector<iob_label_t> sentences;
+        read_sentences(options, sentences);
+        std::size_t ntokens = 0;
+        for (std::size_t k = 0; k < sentences.size(); ++k)
+            ntokens += sentences[k].size();
+
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+        if (options.chunker)
+            train_chunker(sentences, options.train, options.output);
+        else
+        {
+            std::vector<std::vector<tag_t> > tagged(sentences.size());
+            for (std::size_t k = 0; k < sentences.size(); ++k)
+            {
+                for (std::size_t i = 0; i < sentences[k].size(); ++i)
+                    tagged[k].push_back(std::make_pair(
+                        sentences[k][i].token, sentences[k][i].tag));
+            }
+            sentences.clear();
+            train_tagger(tagged, options.train, options.output);
+        }
+        double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+
+        std::cerr << "Trained on " << ntokens << " tokens x "
+            << options.train.niterations << " iterations in " << seconds
+            << " seconds with " << options.train.nthreads << " threads"
+            << std::endl;
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "mltk-train: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}